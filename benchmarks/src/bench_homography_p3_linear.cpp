@@ -0,0 +1,105 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <vector>
+#include <stdexcept>
+#include <opencv2/core/core.hpp>
+#include <core/include/core.h>
+
+using namespace std;
+using namespace cv;
+using namespace autocalib;
+
+// Compares FindHomographyP3Linear() with the fixed-size solver and with SVD on
+// MSAC-sized point subsets, as it's the inner call of FindHomographyP3Robust()
+
+void ParseArgs(int argc, char **argv);
+void CreateClouds(int num_points, RNG &rng, Mat_<double> &xyzw1, Mat_<double> &xyzw2);
+double TimeFindHomographyP3Linear(const vector<Mat_<double> > &xyzw1, const vector<Mat_<double> > &xyzw2,
+                                  bool fixed_size_solver, vector<Mat_<double> > &Hs);
+
+int num_calls = 20000;
+int num_samples = 100;
+
+
+int main(int argc, char **argv) {
+    try {
+        ParseArgs(argc, argv);
+
+        cout << "num points | fixed-size, us | SVD, us | speedup | max H difference\n";
+
+        RNG rng(0);
+        for (int num_points = 5; num_points <= 10; ++num_points) {
+            vector<Mat_<double> > xyzw1(num_samples), xyzw2(num_samples);
+            for (int i = 0; i < num_samples; ++i)
+                CreateClouds(num_points, rng, xyzw1[i], xyzw2[i]);
+
+            vector<Mat_<double> > Hs_fixed, Hs_svd;
+            double time_fixed = TimeFindHomographyP3Linear(xyzw1, xyzw2, true, Hs_fixed);
+            double time_svd = TimeFindHomographyP3Linear(xyzw1, xyzw2, false, Hs_svd);
+
+            double max_diff = 0;
+            for (int i = 0; i < num_samples; ++i) {
+                Mat_<double> H_fixed = Hs_fixed[i] / Hs_fixed[i](3, 3);
+                Mat_<double> H_svd = Hs_svd[i] / Hs_svd[i](3, 3);
+                max_diff = max(max_diff, norm(H_fixed, H_svd, NORM_INF));
+            }
+
+            cout << setw(10) << num_points << " | "
+                 << setw(14) << fixed << setprecision(2) << time_fixed << " | "
+                 << setw(7) << time_svd << " | "
+                 << setw(7) << time_svd / time_fixed << " | "
+                 << scientific << setprecision(1) << max_diff << endl;
+        }
+    }
+    catch (const exception &e) {
+        cout << "Error: " << e.what() << endl;
+    }
+    return 0;
+}
+
+
+void ParseArgs(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "--num-calls")
+            num_calls = atoi(argv[++i]);
+        else if (string(argv[i]) == "--num-samples")
+            num_samples = atoi(argv[++i]);
+        else
+            throw runtime_error("unknown argument: " + string(argv[i]));
+    }
+    CV_Assert(num_calls > 0 && num_samples > 0);
+}
+
+
+/** Creates clouds related by a random homography, the second one is noisy. */
+void CreateClouds(int num_points, RNG &rng, Mat_<double> &xyzw1, Mat_<double> &xyzw2) {
+    Mat_<double> H = Mat::zeros(4, 4, CV_64F);
+    while (abs(determinant(H)) < 1e-3)
+        rng.fill(H, RNG::UNIFORM, -1, 1);
+
+    xyzw1.create(1, num_points * 4);
+    xyzw2.create(1, num_points * 4);
+    rng.fill(xyzw1, RNG::UNIFORM, -1, 1);
+    for (int i = 0; i < num_points; ++i) {
+        Mat_<double> p = H * xyzw1.colRange(4 * i, 4 * i + 4).t();
+        for (int k = 0; k < 4; ++k)
+            xyzw2(0, 4 * i + k) = p(k, 0) + rng.gaussian(1e-3);
+    }
+}
+
+
+/** \return Average time of a call in microseconds */
+double TimeFindHomographyP3Linear(const vector<Mat_<double> > &xyzw1, const vector<Mat_<double> > &xyzw2,
+                                  bool fixed_size_solver, vector<Mat_<double> > &Hs)
+{
+    Hs.resize(xyzw1.size());
+
+    int64 start = getTickCount();
+    for (int i = 0; i < num_calls; ++i) {
+        int sample = i % (int)xyzw1.size();
+        Hs[sample] = FindHomographyP3Linear(xyzw1[sample], xyzw2[sample], fixed_size_solver);
+    }
+    return (getTickCount() - start) / getTickFrequency() / num_calls * 1e6;
+}
@@ -0,0 +1,134 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <vector>
+#include <stdexcept>
+#include <opencv2/core/core.hpp>
+#include <core/include/core.h>
+#include <evaluation/include/evaluation.h>
+
+using namespace std;
+using namespace cv;
+using namespace autocalib;
+using namespace autocalib::evaluation;
+
+// Times residual passes of the functions minimized by RefineRigidCamera() and
+// RefineStereoCamera(), and counts heap allocations they make, as the minimizer
+// calls them at every step
+
+void ParseArgs(int argc, char **argv);
+void TimeResiduals(autocalib::internal::BlockwiseFunc &func, const Mat &arg,
+                   double &time, double &num_allocs_per_eval);
+
+int num_evals = 1000;
+int num_shots = 5;
+
+#ifdef __GLIBC__
+// Counts allocations of the whole process, OpenCV matrices are allocated with malloc too
+size_t num_allocs = 0;
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *malloc(size_t size) {
+    ++num_allocs;
+    return __libc_malloc(size);
+}
+#endif
+
+
+int main(int argc, char **argv) {
+    try {
+        ParseArgs(argc, argv);
+
+        RNG rng(0);
+        Mat K;
+        AbsoluteRotationMats Rs;
+        FeaturesCollection features_rot;
+        MatchesCollection matches_rot;
+        CreateSyntheticRotationalShots(num_shots, rng, K, Rs, features_rot, matches_rot);
+
+        RigidCamera rig;
+        AbsoluteMotions motions;
+        FeaturesCollection features_stereo;
+        MatchesCollection matches_stereo;
+        CreateSyntheticStereoShots(num_shots, rng, rig, motions, features_stereo, matches_stereo);
+
+        // Each mask selects a different intrinsics layout
+        const int masks[] = {REFINE_FLAG_K_ALL, REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW,
+                             REFINE_FLAG_K_FX | REFINE_FLAG_K_FY,
+                             REFINE_FLAG_K_PPX | REFINE_FLAG_K_PPY};
+        const char *mask_names[] = {"all", "all but skew", "focal", "principal point"};
+
+        cout << "function | refined intrinsics | residuals | us per eval | allocations per eval\n";
+
+        for (int i = 0; i < 2; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                Mat arg;
+                Ptr<autocalib::internal::BlockwiseFunc> func;
+                if (i == 0)
+                    func = autocalib::internal::CreateRigidCameraFunc(
+                            K, Rs, features_rot, matches_rot, masks[j], MinimizeOpts(), arg);
+                else
+                    func = autocalib::internal::CreateStereoCameraFunc(
+                            rig, motions, features_stereo, matches_stereo, masks[j],
+                            RelativeConfidences(), MinimizeOpts(), arg);
+
+                double time, num_allocs_per_eval;
+                TimeResiduals(*func, arg, time, num_allocs_per_eval);
+
+                cout << setw(8) << (i == 0 ? "rigid" : "stereo") << " | "
+                     << setw(18) << mask_names[j] << " | "
+                     << setw(9) << func->dimension() << " | "
+                     << setw(11) << fixed << setprecision(2) << time << " | ";
+                if (num_allocs_per_eval < 0)
+                    cout << setw(20) << "n/a" << endl;
+                else
+                    cout << setw(20) << num_allocs_per_eval << endl;
+            }
+        }
+    }
+    catch (const exception &e) {
+        cout << "Error: " << e.what() << endl;
+    }
+    return 0;
+}
+
+
+void ParseArgs(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (string(argv[i]) == "--num-evals")
+            num_evals = atoi(argv[++i]);
+        else if (string(argv[i]) == "--num-shots")
+            num_shots = atoi(argv[++i]);
+        else
+            throw runtime_error("unknown argument: " + string(argv[i]));
+    }
+    CV_Assert(num_evals > 0 && num_shots >= 2);
+}
+
+
+/** \param time Average time of an evaluation in microseconds
+  * \param num_allocs_per_eval Average number of heap allocations, negative if they
+  *                            aren't counted on this platform
+  */
+void TimeResiduals(autocalib::internal::BlockwiseFunc &func, const Mat &arg,
+                   double &time, double &num_allocs_per_eval)
+{
+    // The first call allocates the residuals, the minimizer reuses them as well
+    Mat err;
+    func(arg, err);
+
+#ifdef __GLIBC__
+    size_t num_allocs_start = num_allocs;
+#endif
+
+    int64 start = getTickCount();
+    for (int i = 0; i < num_evals; ++i)
+        func(arg, err);
+    time = (getTickCount() - start) / getTickFrequency() / num_evals * 1e6;
+
+#ifdef __GLIBC__
+    num_allocs_per_eval = double(num_allocs - num_allocs_start) / num_evals;
+#else
+    num_allocs_per_eval = -1;
+#endif
+}
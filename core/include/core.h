@@ -185,10 +185,123 @@ private:
 //============================================================================
 // Optimization
 
+/** Observes minimization progress, see MinimizeOpts::set_callback(). */
+class MinimizeCallback {
+public:
+    virtual ~MinimizeCallback() {}
+
+    /** Called after each iteration.
+      *
+      * \param iter Number of iterations done
+      * \param arg Current argument
+      * \param rms_err Current RMS error
+      * \param damping_lg10 Decimal logarithm of the damping the next iteration starts with
+      *                     (Levenberg-Marquardt) or of the trust region radius (dogleg)
+      * \return true to continue minimization, false to stop it
+      */
+    virtual bool operator()(int iter, const cv::Mat &arg, double rms_err, int damping_lg10) = 0;
+};
+
+
+/** Minimization statistics, see MinimizeOpts::set_stats().
+  *
+  * Statistics of several minimizations are accumulated: counters and times are summed,
+  * per-iteration histories are concatenated and the termination reason is the last one.
+  */
+struct MinimizeStats {
+
+    /** Reason of minimization termination. */
+    enum Termination {
+        TERMINATION_NONE = 0,
+        TERMINATION_MAX_ITERS = 1,
+        TERMINATION_SMALL_STEP = 2,
+        TERMINATION_SMALL_COST_DECREASE = 3,
+        TERMINATION_NO_PROGRESS = 4,
+        TERMINATION_CALLBACK = 5
+    };
+
+    MinimizeStats() { Clear(); }
+
+    void Clear() {
+        num_iters = 0;
+        num_residual_evals = 0;
+        num_jacobian_evals = 0;
+        num_jacobian_updates = 0;
+        num_factorizations = 0;
+        residual_time = 0;
+        jacobian_time = 0;
+        solve_time = 0;
+        iter_rms_errors.clear();
+        iter_damping_lg10.clear();
+        termination = TERMINATION_NONE;
+    }
+
+    MinimizeStats& operator +=(const MinimizeStats &other) {
+        num_iters += other.num_iters;
+        num_residual_evals += other.num_residual_evals;
+        num_jacobian_evals += other.num_jacobian_evals;
+        num_jacobian_updates += other.num_jacobian_updates;
+        num_factorizations += other.num_factorizations;
+        residual_time += other.residual_time;
+        jacobian_time += other.jacobian_time;
+        solve_time += other.solve_time;
+        iter_rms_errors.insert(iter_rms_errors.end(), other.iter_rms_errors.begin(),
+                               other.iter_rms_errors.end());
+        iter_damping_lg10.insert(iter_damping_lg10.end(), other.iter_damping_lg10.begin(),
+                                 other.iter_damping_lg10.end());
+        termination = other.termination;
+        return *this;
+    }
+
+    /** Number of iterations, i.e. accepted or final rejected steps */
+    int num_iters;
+
+    /** Number of error function evaluations */
+    int num_residual_evals;
+
+    /** Number of Jacobian evaluations */
+    int num_jacobian_evals;
+
+    /** Number of Broyden's Jacobian updates, see MinimizeOpts::jacobian_recompute_period() */
+    int num_jacobian_updates;
+
+    /** Number of linear systems solved */
+    int num_factorizations;
+
+    /** Time spent in error function evaluations (seconds) */
+    double residual_time;
+
+    /** Time spent in Jacobian evaluations (seconds). Solvers accumulating normal equations
+      * from streamed Jacobian rows count the accumulation here.
+      */
+    double jacobian_time;
+
+    /** Time spent in building and solving linear systems (seconds) */
+    double solve_time;
+
+    /** RMS error after each iteration */
+    std::vector<double> iter_rms_errors;
+
+    /** Decimal logarithm of the damping (Levenberg-Marquardt) or of the trust region
+      * radius (dogleg) after each iteration
+      */
+    std::vector<int> iter_damping_lg10;
+
+    /** Reason the last minimization stopped */
+    int termination;
+};
+
+
 /** Minimization method options. */
 class MinimizeOpts {
 public:
 
+    /** Minimization method. */
+    enum Method {
+        METHOD_LEVMARQ = 0,
+        METHOD_DOGLEG = 1
+    };
+
     /** Verbosity level. */
     enum Verbose {
         VERBOSE_NO = 0,
@@ -196,6 +309,26 @@ public:
         VERBOSE_ITER = 2
     };
 
+    /** Jacobian computation method. */
+    enum JacobianMethod {
+        JACOBIAN_ANALYTIC = 0,
+        JACOBIAN_NUMERIC = 1
+    };
+
+    /** Linear solver used to compute minimization steps. */
+    enum LinearSolver {
+        LINEAR_SOLVER_DENSE = 0,
+        LINEAR_SOLVER_SCHUR = 1,
+        LINEAR_SOLVER_DENSE_STREAMED = 2,
+        LINEAR_SOLVER_PCG = 3
+    };
+
+    /** Floating-point precision of residual and Jacobian evaluation. */
+    enum Precision {
+        PRECISION_DOUBLE = 0,
+        PRECISION_MIXED = 1
+    };
+
     /** \param crit Termination criteria
       * \param verbose Verbosity level
       * \see Verbose
@@ -221,18 +354,138 @@ public:
     const int verbose() const { return verbose_; }
     const cv::TermCriteria& crit() const { return crit_; }
 
+    /** Dogleg factorizes the normal equations once per iteration and handles rejected
+      * steps by shrinking the trust region, while Levenberg-Marquardt solves the damped
+      * equations for each step. Dogleg is used with the dense linear solver only.
+      *
+      * \return Minimization method
+      * \see Method, Minimize()
+      */
+    int method() const { return method_; }
+    void set_method(int val) { method_ = val; }
+
+    /** Functions which provide closed-form or automatic derivatives fall back to central
+      * differences when the numeric method is selected.
+      *
+      * \return Jacobian computation method
+      * \see JacobianMethod
+      */
+    int jacobian_method() const { return jacobian_method_; }
+    void set_jacobian_method(int val) { jacobian_method_ = val; }
+
+    /** The Schur complement solver eliminates per-shot parameter blocks using sparse
+      * factorization. The dense streamed solver accumulates normal equations from Jacobian
+      * rows without storing the Jacobian, so it needs memory quadratic in the number of
+      * parameters only. The PCG solver finds steps inexactly by conjugate gradients
+      * preconditioned with the block diagonal of the normal equations, its memory and
+      * time per iteration are linear in the number of residuals. These solvers are used
+      * by functions which can stream their Jacobian rows (see RefineRigidCamera() and
+      * RefineStereoCamera()) and always rely on closed-form derivatives; others fall back
+      * to the dense solver.
+      *
+      * \return Linear solver
+      * \see LinearSolver
+      */
+    int linear_solver() const { return linear_solver_; }
+    void set_linear_solver(int val) { linear_solver_ = val; }
+
+    /** Numeric Jacobian columns are split into this number of jobs, which are run by
+      * the OpenCV thread pool (see cv::setNumThreads()).
+      *
+      * \return Number of threads used to compute Jacobians
+      */
+    int num_threads() const { return num_threads_; }
+    void set_num_threads(int val) { num_threads_ = val; }
+
+    /** Pass the value reported to a callback to warm start a minimization of a similar
+      * problem.
+      *
+      * \return Decimal logarithm of the initial Levenberg-Marquardt damping
+      */
+    int damping_lg10() const { return damping_lg10_; }
+    void set_damping_lg10(int val) { damping_lg10_ = val; }
+
+    /** Minimization stops when a step decreases the squared error by less than this
+      * fraction. Zero disables the check.
+      *
+      * \return Minimal relative cost decrease
+      */
+    double min_rel_cost_decrease() const { return min_rel_cost_decrease_; }
+    void set_min_rel_cost_decrease(double val) { min_rel_cost_decrease_ = val; }
+
+    /** Between full computations the Jacobian is corrected with Broyden's rank-one updates
+      * after accepted steps. It's recomputed every this number of iterations or when an
+      * updated Jacobian stalls (needs more damping or meets termination criteria), so
+      * minimization always stops on an exact Jacobian. Used by the dense Levenberg-Marquardt
+      * solver only.
+      *
+      * \return Number of iterations between full Jacobian computations, 1 disables updates
+      */
+    int jacobian_recompute_period() const { return jacobian_recompute_period_; }
+    void set_jacobian_recompute_period(int val) { jacobian_recompute_period_ = val; }
+
+    /** In mixed precision residuals and closed-form Jacobian entries are evaluated in float
+      * with vector instructions, while normal equations are accumulated and solved in double.
+      * Keypoint coordinates are floats already, so only the model is rounded. Residuals then
+      * have absolute error up to 1e-3 pixels (see float SymEpipDist2()), which shifts the
+      * optimum by a small fraction of the keypoint localization noise: on
+      * synthetic stereo shots the final RMS error matches the double precision one within
+      * 1e-3 pixels and focal lengths within 0.1 pixels. Numeric Jacobians of float residuals
+      * are inaccurate, so use it with the analytic Jacobian. Supported by
+      * RefineStereoCamera(), others always use double.
+      *
+      * \return Evaluation precision
+      * \see Precision
+      */
+    int precision() const { return precision_; }
+    void set_precision(int val) { precision_ = val; }
+
+    /** \return Per-iteration callback, may be empty */
+    const cv::Ptr<MinimizeCallback>& callback() const { return callback_; }
+    void set_callback(const cv::Ptr<MinimizeCallback> &val) { callback_ = val; }
+
+    /** Statistics of each minimization are accumulated in this object if it isn't null.
+      * The object must outlive minimizations.
+      *
+      * \return Minimization statistics
+      */
+    MinimizeStats* stats() const { return stats_; }
+    void set_stats(MinimizeStats *val) { stats_ = val; }
+
 private:
     void Init(cv::TermCriteria term_crit, int verbose) {
         crit_ = term_crit;
         verbose_ = verbose;
+        method_ = METHOD_LEVMARQ;
+        jacobian_method_ = JACOBIAN_ANALYTIC;
+        linear_solver_ = LINEAR_SOLVER_DENSE;
+        num_threads_ = 1;
+        precision_ = PRECISION_DOUBLE;
+        damping_lg10_ = -3;
+        min_rel_cost_decrease_ = 0;
+        jacobian_recompute_period_ = 1;
+        stats_ = 0;
     }
 
     cv::TermCriteria crit_;
     int verbose_;
+    int method_;
+    int jacobian_method_;
+    int linear_solver_;
+    int num_threads_;
+    int precision_;
+    int damping_lg10_;
+    double min_rel_cost_decrease_;
+    int jacobian_recompute_period_;
+    cv::Ptr<MinimizeCallback> callback_;
+    MinimizeStats *stats_;
 };
 
 
 /** Minimizes a function using the Levenberg-Marquardt algorithm.
+  *
+  * The function must provide dimension(), operator()(arg, err) and Jacobian(arg, jac).
+  * The argument is updated in place, the error and Jacobian buffers are allocated once.
   *
   * \param func Function to be minimized
   * \param arg Function arguments
@@ -244,6 +497,224 @@ template <typename Func>
 double MinimizeLevMarq(Func func, cv::InputOutputArray arg, MinimizeOpts opts = MinimizeOpts());
 
 
+/** Minimizes a function using Powell's dogleg trust region method.
+  *
+  * The function must provide the same interface as for MinimizeLevMarq().
+  *
+  * \param func Function to be minimized
+  * \param arg Function arguments
+  * \param opts Minimization method options
+  * \return L2 norm of optimal value
+  * \see MinimizeOpts
+  */
+template <typename Func>
+double MinimizeDogleg(Func func, cv::InputOutputArray arg, MinimizeOpts opts = MinimizeOpts());
+
+
+/** Minimizes a function using the method selected in the options.
+  *
+  * \see MinimizeLevMarq(), MinimizeDogleg(), MinimizeOpts::method()
+  */
+template <typename Func>
+double Minimize(Func func, cv::InputOutputArray arg, MinimizeOpts opts = MinimizeOpts());
+
+
+/** Group of function residuals which depend on a subset of the arguments only. */
+struct ResidualBlock {
+    ResidualBlock(int row = 0, int num_rows = 0) : row(row), num_rows(num_rows) {}
+
+    /** Index of the first residual */
+    int row;
+
+    /** Number of residuals */
+    int num_rows;
+
+    /** Indices of arguments the residuals depend on */
+    std::vector<int> args;
+};
+
+
+/** Layout of an argument vector made of common parameters followed by equally sized
+  * parameter blocks of items (e.g. frames). Fixed blocks, like the reference frame one,
+  * take no arguments, so solvers neither see nor allocate them.
+  *
+  * \tparam NumCommon Number of common parameters
+  * \tparam BlockSize Number of parameters in a block
+  */
+template <int NumCommon, int BlockSize>
+class ParamBlockLayout {
+public:
+    enum { NUM_COMMON = NumCommon, BLOCK_SIZE = BlockSize };
+
+    ParamBlockLayout() : num_free_blocks_(0) {}
+
+    /** Adds a block of an item. Free blocks are placed in the order they are added.
+      *
+      * \param id Item index
+      * \param fixed Whether the block parameters are held constant
+      */
+    void AddBlock(int id, bool fixed = false) {
+        CV_Assert(id >= 0 && !Contains(id));
+        if (id >= (int)offsets_.size())
+            offsets_.resize(id + 1, ABSENT);
+        offsets_[id] = fixed ? FIXED : NumCommon + BlockSize * num_free_blocks_++;
+    }
+
+    /** \return true if the item has a block, either free or fixed */
+    bool Contains(int id) const {
+        return id >= 0 && id < (int)offsets_.size() && offsets_[id] != ABSENT;
+    }
+
+    /** \return Index of the first block argument, or -1 if the block is fixed or absent */
+    int Offset(int id) const { return Contains(id) ? offsets_[id] : -1; }
+
+    int num_free_blocks() const { return num_free_blocks_; }
+
+    /** \return Number of arguments */
+    int num_args() const { return NumCommon + BlockSize * num_free_blocks_; }
+
+private:
+    enum { FIXED = -1, ABSENT = -2 };
+
+    std::vector<int> offsets_;
+    int num_free_blocks_;
+};
+
+
+/** Computes the Jacobian using central differences. When an argument is perturbed
+  * only the residual blocks depending on it are recomputed. Jacobian columns of
+  * arguments no block depends on are zero.
+  *
+  * The function must provide residual_blocks() returning non-overlapping blocks
+  * (see ResidualBlock) and CalcResidualBlock(arg, block_idx, err) which computes
+  * residuals of the block into the err array.
+  *
+  * \param func Function
+  * \param arg Function arguments
+  * \param jac Jacobian
+  * \param step Differentiation step
+  * \param num_threads Number of parallel jobs. If it's greater than one, residual blocks
+  *                    must be safe to compute concurrently.
+  */
+template <typename Func>
+void CalcJacobianBlockwise(Func &func, const cv::Mat &arg, cv::Mat &jac, double step,
+                           int num_threads = 1);
+
+
+/** Computes the exact Jacobian using forward-mode automatic differentiation, see
+  * autodiff::Jet. Each residual block is evaluated once per N arguments it depends on.
+  *
+  * The function must provide residual_blocks() (see CalcJacobianBlockwise()) and
+  * a template CalcResidualBlock(const T *arg, int block_idx, T *err) where T is either
+  * double or autodiff::Jet<N>.
+  *
+  * \param func Function
+  * \param arg Function arguments
+  * \param jac Jacobian
+  */
+template <int N, typename Func>
+void CalcJacobianAutoDiff(Func &func, const cv::Mat &arg, cv::Mat &jac);
+
+
+/** Sample consensus statistics. */
+struct SampleConsensusStats {
+    SampleConsensusStats() : num_iters(0), num_rejected(0), num_inliers(0) {}
+
+    /** Number of generated hypotheses */
+    int num_iters;
+
+    /** Number of hypotheses rejected by the sequential probability ratio test */
+    int num_rejected;
+
+    /** Number of inliers of the best hypothesis */
+    int num_inliers;
+};
+
+
+/** Sample consensus options. */
+class SampleConsensusOpts {
+public:
+
+    /** Strategy of drawing samples. */
+    enum Sampling {
+        SAMPLING_UNIFORM = 0,
+        SAMPLING_PROSAC = 1
+    };
+
+    SampleConsensusOpts()
+        : num_threads_(1), confidence_(0.99), sampling_(SAMPLING_UNIFORM), sprt_(false), rng_(0),
+          stats_(0) {}
+
+    /** Hypotheses are generated in rounds of this number, each one drawing samples from
+      * its own random numbers stream and run by the OpenCV thread pool (see
+      * cv::setNumThreads()). Results depend on the number of threads, but not on threads
+      * scheduling.
+      *
+      * \return Number of threads used to generate and score hypotheses
+      */
+    int num_threads() const { return num_threads_; }
+    void set_num_threads(int val) { num_threads_ = val; }
+
+    /** After each round of hypotheses the number of iterations is reduced to the one which
+      * draws at least one outliers free sample with this probability, estimated from the
+      * inliers ratio of the best hypothesis. The given number of iterations stays the
+      * maximum. One disables adaptive termination.
+      *
+      * \return Probability of finding the correct model, in (0, 1]
+      */
+    double confidence() const { return confidence_; }
+    void set_confidence(double val) { confidence_ = val; }
+
+    /** PROSAC draws samples from progressively growing sets of the best ranked
+      * correspondences (see Chum O., Matas J., "Matching with PROSAC - Progressive Sample
+      * Consensus", CVPR 2005), so it finds good hypotheses early when match quality
+      * correlates with being an inlier. It also stops as soon as the best hypothesis
+      * explains a non-random share of the best ranked correspondences. It needs
+      * correspondence quality, uniform sampling is used otherwise.
+      *
+      * \return Sampling strategy
+      * \see Sampling
+      */
+    int sampling() const { return sampling_; }
+    void set_sampling(int val) { sampling_ = val; }
+
+    /** Randomized RANSAC checks points of each hypothesis in random order and rejects it
+      * as soon as Wald's sequential probability ratio test finds it worse than the best one
+      * (see Matas J., Chum O., "Randomized RANSAC with Sequential Probability Ratio Test",
+      * ICCV 2005), so bad hypotheses cost a few point checks instead of all of them. Good
+      * hypotheses are rejected with small probability, which adaptive termination takes
+      * into account.
+      *
+      * \return true if the sequential probability ratio test is used, false otherwise
+      */
+    bool sprt() const { return sprt_; }
+    void set_sprt(bool val) { sprt_ = val; }
+
+    /** Per-thread random numbers streams are seeded from this generator, so a generator
+      * with a fixed state makes results reproducible.
+      *
+      * \return Random numbers generator, cv::theRNG() is used if it's null
+      */
+    cv::RNG* rng() const { return rng_; }
+    void set_rng(cv::RNG *val) { rng_ = val; }
+
+    /** Statistics of the last estimation are stored in this object if it isn't null.
+      *
+      * \return Sample consensus statistics
+      */
+    SampleConsensusStats* stats() const { return stats_; }
+    void set_stats(SampleConsensusStats *val) { stats_ = val; }
+
+private:
+    int num_threads_;
+    double confidence_;
+    int sampling_;
+    bool sprt_;
+    cv::RNG *rng_;
+    SampleConsensusStats *stats_;
+};
+
+
 //============================================================================
 // Rotation model camera autocalibration
 
@@ -287,12 +758,14 @@ enum RefineFlag {
   * \param features Features collection
   * \param matches Matches collection
   * \param params_to_refine Flags indicating parameters which should be refined
+  * \param opts Minimization method options
   * \return Reprojection RMS error
-  * \see RefineFlag
+  * \see RefineFlag, MinimizeOpts
   */
 double RefineRigidCamera(cv::InputOutputArray K, AbsoluteRotationMats Rs,
                          const FeaturesCollection &features, const MatchesCollection &matches,
-                         int params_to_refine = REFINE_FLAG_K_ALL);
+                         int params_to_refine = REFINE_FLAG_K_ALL,
+                         const MinimizeOpts &opts = MinimizeOpts(MinimizeOpts::VERBOSE_SUMMARY));
 
 
 //============================================================================
@@ -324,6 +797,7 @@ inline bool BothAreLeft(int index1, int index2) {
   * \param matches_lr0 Matches between left and right images of the first pair
   * \param matches_lr1 Matches between left and right images of the second pair
   * \param matches_ll Matches between left images of two pairs
+  * \param dists_ll Descriptor distances of matches between left images the common points come from
   * \return Two point clouds: i'th point of the 1st cloud corresponds to the i'th point of the 2nd cloud.
             Number of points are the same.
   */
@@ -333,7 +807,8 @@ std::pair<cv::Mat, cv::Mat> ReconstructPointClouds(
     cv::InputOutputArray xy_l1, cv::InputOutputArray xy_r1,
     const cv::Ptr<std::vector<cv::DMatch> > &matches_lr0,
     const cv::Ptr<std::vector<cv::DMatch> > &matches_lr1,
-    const cv::Ptr<std::vector<cv::DMatch> > &matches_ll);
+    const cv::Ptr<std::vector<cv::DMatch> > &matches_ll,
+    cv::OutputArray dists_ll = cv::noArray());
 
 
 /** Upgrades a projective point cloud to the affine one.
@@ -371,6 +846,7 @@ void AffineRectify(
   * \param thresh Error threshold of H estimation
   * \param xyzw0 First pair point cloud
   * \param xyzw1 Second pair point cloud
+  * \param opts H estimation options, PROSAC ranks points by matches_ll distances
   * \return true if it succeded, false otherwise
   */
 bool AffineRectifyStereoCameraByTwoShots(
@@ -380,14 +856,39 @@ bool AffineRectifyStereoCameraByTwoShots(
         const cv::Ptr<std::vector<cv::DMatch> > &matches_lr0, const cv::Ptr<std::vector<cv::DMatch> > &matches_lr1,
         const cv::Ptr<std::vector<cv::DMatch> > &matches_ll,
         int num_iters, int subset_size, double thresh,
-        cv::OutputArray H01, cv::OutputArray xyzw0, cv::OutputArray xyzw1);
+        cv::OutputArray H01, cv::OutputArray xyzw0, cv::OutputArray xyzw1,
+        const SampleConsensusOpts &opts = SampleConsensusOpts());
 
 
 /** Computes the symmetric point-to-epipolar distance.
   *
   * See details in Hartey R., Zisserman A., "Multiple View Geometry", 2nd ed., p. 287
   */
-double SymEpipDist2(double x1, double y1, const cv::Mat F12, double x2, double y2);
+double SymEpipDist2(double x1, double y1, const cv::Mat &F12, double x2, double y2);
+
+
+/** Computes the symmetric point-to-epipolar distance for many correspondences at once.
+  *
+  * Uses SSE2 or AVX instructions when the CPU supports them.
+  *
+  * \param x1 First image points x coordinates
+  * \param y1 First image points y coordinates
+  * \param F12 Fundamental matrix
+  * \param x2 Second image points x coordinates
+  * \param y2 Second image points y coordinates
+  * \param count Number of correspondences
+  * \param dist Output distances, the same as SymEpipDist2() gives for each correspondence
+  */
+void SymEpipDist2(const double *x1, const double *y1, const cv::Mat &F12,
+                  const double *x2, const double *y2, int count, double *dist);
+
+
+/** Same as above, but in single precision, which doubles the vector width. The fundamental
+  * matrix is rounded to float, so distances of a few pixels have absolute error up to
+  * 2e-4 pixels for 640x480 images and up to 1e-3 pixels for 4000x3000 ones.
+  */
+void SymEpipDist2(const float *x1, const float *y1, const cv::Mat &F12,
+                  const float *x2, const float *y2, int count, float *dist);
 
 
 /** Refines a stereo camera parameters.
@@ -397,11 +898,13 @@ double SymEpipDist2(double x1, double y1, const cv::Mat F12, double x2, double y
   * \param matches Matches between left frames of stereo pairs and between
                    left and right frames of stereo pairs
   * \param params_to_refine Flags indicating parameters which should be refined
+  * \param opts Minimization method options
   * \return Epipolar distance error
-  * \see RefineFlag
+  * \see RefineFlag, MinimizeOpts
   */
 double RefineStereoCamera(RigidCamera &cam, const FeaturesCollection &features,
-                          const MatchesCollection &matches, int params_to_refine = REFINE_FLAG_K_ALL);
+                          const MatchesCollection &matches, int params_to_refine = REFINE_FLAG_K_ALL,
+                          const MinimizeOpts &opts = MinimizeOpts(MinimizeOpts::VERBOSE_SUMMARY));
 
 
 /** Refines a stereo camera parameters.
@@ -413,13 +916,109 @@ double RefineStereoCamera(RigidCamera &cam, const FeaturesCollection &features,
                    left and right frames of stereo pairs
   * \param params_to_refine Flags indicating parameters which should be refined
   * \param rel_conf Matches relative confidences
+  * \param opts Minimization method options
   * \return Epipolar distance error
-  * \see RefineFlag
+  * \see RefineFlag, MinimizeOpts
   */
 double RefineStereoCamera(RigidCamera &cam, AbsoluteMotions &motions,
                           const FeaturesCollection &features, const MatchesCollection &matches,
                           int params_to_refine = REFINE_FLAG_K_ALL,
-                          const RelativeConfidences &rel_confs = RelativeConfidences());
+                          const RelativeConfidences &rel_confs = RelativeConfidences(),
+                          const MinimizeOpts &opts = MinimizeOpts(MinimizeOpts::VERBOSE_SUMMARY));
+
+
+/** Refines a stereo camera parameters starting from several perturbed intrinsics
+  * concurrently.
+  *
+  * Each start except the first one multiplies focal lengths and principal point coordinates
+  * by random factors from [1 - perturbation, 1 + perturbation] and runs RefineStereoCamera().
+  * Once some start gives acceptable skew and error the others are interrupted.
+  *
+  * \param cam Stereo camera parameters, the best result is written here
+  * \param motions Absolute motions (R,T) of stereo pairs, the best result is written here
+  * \param features Frames features
+  * \param matches Matches between left frames of stereo pairs and between
+                   left and right frames of stereo pairs
+  * \param params_to_refine Flags indicating parameters which should be refined
+  * \param rel_conf Matches relative confidences
+  * \param num_starts Number of starts
+  * \param max_skew Maximum acceptable absolute skew
+  * \param max_rms_error Maximum acceptable epipolar distance error
+  * \param rng Random number generator used to perturb intrinsics
+  * \param K_norm Transformation which was applied to features coordinates (if any).
+  *               Skew is checked and intrinsics are perturbed in the original coordinates.
+  * \param perturbation Maximum relative perturbation of intrinsics
+  * \param opts Minimization method options. Starts call the callback one at a time, so
+  *             it needn't be reentrant, though calls of different starts interleave.
+  * \return Epipolar distance error of the best result
+  * \see RefineStereoCamera()
+  */
+double RefineStereoCameraMultiStart(
+        RigidCamera &cam, AbsoluteMotions &motions,
+        const FeaturesCollection &features, const MatchesCollection &matches,
+        int params_to_refine, const RelativeConfidences &rel_confs,
+        int num_starts, double max_skew, double max_rms_error, cv::RNG &rng,
+        const cv::Mat &K_norm = cv::Mat(), double perturbation = 0.2,
+        const MinimizeOpts &opts = MinimizeOpts(MinimizeOpts::VERBOSE_SUMMARY));
+
+
+namespace internal {
+
+/** Function with residuals grouped into blocks, see CalcJacobianBlockwise(). Exposes
+  * functions minimized by camera refinement to tests and benchmarks.
+  */
+class BlockwiseFunc {
+public:
+    virtual ~BlockwiseFunc() {}
+
+    /** Computes all the residuals. */
+    virtual void operator()(const cv::Mat &arg, cv::Mat &err) = 0;
+
+    /** Computes the Jacobian with the method of the creation options. The numeric one
+      * also caches intermediate matrices at the argument.
+      */
+    virtual void Jacobian(const cv::Mat &arg, cv::Mat &jac) = 0;
+
+    virtual const std::vector<ResidualBlock>& residual_blocks() const = 0;
+
+    /** Computes residuals of a block, reusing matrices cached by the last numeric Jacobian
+      * unless arguments they depend on have changed.
+      */
+    virtual void CalcResidualBlock(const cv::Mat &arg, int block_idx, double *err) const = 0;
+
+    /** Same as above, but computes everything from scratch. */
+    virtual void CalcResidualBlockUncached(const cv::Mat &arg, int block_idx,
+                                           double *err) const = 0;
+
+    virtual int dimension() const = 0;
+};
+
+
+/** Creates the function RefineRigidCamera() minimizes. Features and matches must outlive it.
+  *
+  * \param arg Initial arguments: refined intrinsics (fx, skew, ppx, fy, ppy order), followed
+  *            by rotation vectors of frames but the first one
+  */
+cv::Ptr<BlockwiseFunc> CreateRigidCameraFunc(
+        const cv::Mat &K, const AbsoluteRotationMats &Rs, const FeaturesCollection &features,
+        const MatchesCollection &matches, int params_to_refine, const MinimizeOpts &opts,
+        cv::Mat &arg);
+
+
+/** Creates the function RefineStereoCamera() minimizes. Features and matches must outlive
+  * it.
+  *
+  * \param arg Initial arguments: refined intrinsics (fx, skew, ppx, fy, ppy order), rotation
+  *            vector and translation of the right camera relative to the left one, followed
+  *            by motions of stereo pairs but the first one
+  */
+cv::Ptr<BlockwiseFunc> CreateStereoCameraFunc(
+        const RigidCamera &cam, const AbsoluteMotions &motions,
+        const FeaturesCollection &features, const MatchesCollection &matches,
+        int params_to_refine, const RelativeConfidences &rel_confs, const MinimizeOpts &opts,
+        cv::Mat &arg);
+
+} // namespace internal
 
 
 //============================================================================
@@ -558,9 +1157,12 @@ cv::Mat CameraMatFromFundamentalMat(cv::InputArray F);
   * \param matches_lr2 Second stereo pair matches
   * \param matches_ll Matches between left images of stereo pairs
   * \param indices Matches indices pairs vector
+  * \param ll_indices Indices of matches between left images the pairs come from, aren't
+  *                   computed if null
   */
 void Intersect(const std::vector<cv::DMatch> &matches_lr1, const std::vector<cv::DMatch> &matches_lr2,
-               const std::vector<cv::DMatch> &matches_ll, std::vector<std::pair<int, int> > &indices);
+               const std::vector<cv::DMatch> &matches_ll, std::vector<std::pair<int, int> > &indices,
+               std::vector<int> *ll_indices = 0);
 
 
 /** Triangulation method base class. */
@@ -672,9 +1274,13 @@ double CalcRmsEpipolarDistance(cv::InputArray xy1, cv::InputArray xy2, cv::Input
   *
   * \param xyzw1 First point cloud
   * \param xyzw2 Second point cloud
+  * \param fixed_size_solver Whether clouds of up to 10 points are solved by the fixed-size
+  *                          QR based solver, which is several times faster than SVD. It falls
+  *                          back to SVD for nearly degenerate clouds.
   * \return 3D projective space homography mapping xyzw1 into xyzw2
   */
-cv::Mat FindHomographyP3Linear(cv::InputArray xyzw1, cv::InputArray xyzw2);
+cv::Mat FindHomographyP3Linear(cv::InputArray xyzw1, cv::InputArray xyzw2,
+                               bool fixed_size_solver = true);
 
 
 /** Finds the 3D projective space homography using MSAC procedure.
@@ -685,14 +1291,18 @@ cv::Mat FindHomographyP3Linear(cv::InputArray xyzw1, cv::InputArray xyzw2);
   * \param P2 Second camera matrix
   * \param xy_l2 First image keypoints
   * \param xy_r2 Second image keypoints
-  * \param num_iters Number of iterations
+  * \param num_iters Maximum number of iterations
   * \param subset_size Size of point subset used for estimation
   * \param err_thresh Error threshold for inliers classification
+  * \param match_dists Descriptor distances of correspondences (lower is better) used to rank
+  *                    them for PROSAC, may be empty
+  * \param opts Sample consensus options
   * \return 3D projective space homography mapping xyzw1 into xyzw2
   */
 cv::Mat FindHomographyP3Robust(cv::InputArray xyzw1, cv::InputArray xyzw2, cv::InputArray P1, cv::InputArray P2,
                                cv::InputArray xy_l2, cv::InputArray xy_r2, int num_iters = 100, int subset_size = 10,
-                               double err_thresh = 3.0);
+                               double err_thresh = 3.0, cv::InputArray match_dists = cv::noArray(),
+                               const SampleConsensusOpts &opts = SampleConsensusOpts());
 
 
 /** Refines 3D projective space homography.
@@ -703,10 +1313,12 @@ cv::Mat FindHomographyP3Robust(cv::InputArray xyzw1, cv::InputArray xyzw2, cv::I
   * \param P2 Right camera matrix (must be applied to mapped cloud)
   * \param xy1 Left image keypoints (images of mapped points)
   * \param xy2 Right image keypoints (images of mapped points)
+  * \param opts Minimization method options
   * \return RMS reprojection error
   */
 double RefineHomographyP3(cv::InputOutputArray H, cv::InputArray xyzw, cv::InputArray P1, cv::InputArray P2,
-                          cv::InputArray xy1, cv::InputArray xy2);
+                          cv::InputArray xy1, cv::InputArray xy2,
+                          const MinimizeOpts &opts = MinimizeOpts(MinimizeOpts::VERBOSE_SUMMARY));
 
 
 /** Calculates a plane-at-infinity coordinates from a homography.
@@ -1,69 +1,537 @@
 #ifndef AUTOCALIB_CORE_INL_H_
 #define AUTOCALIB_CORE_INL_H_
 
-#include <opencv2/calib3d/calib3d.hpp>
-#include <opencv2/core/core_c.h>
+#include <opencv2/core/core.hpp>
 #include "core.h"
+#include "jet.h"
 
 namespace autocalib {
 
+namespace internal {
+
+/** Dense normal equations of the Levenberg-Marquardt method. J^T * J is computed once per
+  * Jacobian and reused to try different damping values.
+  *
+  * The equations can be set from the whole Jacobian or accumulated from Jacobian rows
+  * streamed in groups depending on the same arguments, so that the Jacobian is never
+  * stored.
+  */
+class DenseNormalEquations {
+public:
+    explicit DenseNormalEquations(int num_args = 0)
+        : num_args_(num_args), err_norm2_(0), cols_(0) {}
+
+    /** Computes J^T * J and J^T * err. */
+    void Set(const cv::Mat &jac, const cv::Mat &err);
+
+    /** Resets the equations before streaming Jacobian rows. */
+    void Clear();
+
+    /** Starts a group of rows depending on the given arguments only. */
+    void BeginBlock(const std::vector<int> &cols);
+
+    /** Adds a Jacobian row.
+      *
+      * \param row Row index
+      * \param err Residual
+      * \param derivs Residual derivatives with respect to the block arguments
+      */
+    void AddRow(int row, double err, const double *derivs);
+
+    void EndBlock();
+
+    /** \return Sum of squared errors */
+    double err_norm2() const { return err_norm2_; }
+
+    /** \return J^T * err (column vector) */
+    const cv::Mat& JtErr() const { return JtErr_; }
+
+    /** \return v^T * J^T * J * v */
+    double QuadraticForm(const cv::Mat &v) const;
+
+    /** Solves (J^T * J + lambda * diag(J^T * J)) * delta = J^T * err. Arguments
+      * no residual depends on are kept fixed.
+      *
+      * \param lambda Damping
+      * \param delta Step (row vector), the argument must be decremented by it
+      * \return true if succeeded, false otherwise
+      */
+    bool Solve(double lambda, cv::Mat &delta);
+
+private:
+    int num_args_;
+    cv::Mat JtJ_;
+    cv::Mat JtErr_;
+    double err_norm2_;
+    std::vector<int> free_args_;
+
+    const std::vector<int> *cols_;
+    std::vector<double> JtJ_block_;
+    std::vector<double> JtErr_block_;
+};
+
+
+/** Updates the Jacobian with Broyden's rank-one formula after a step.
+  *
+  * \param jac Jacobian at the step start
+  * \param arg_step Argument change (row vector)
+  * \param err_step Error change (column vector)
+  */
+void UpdateJacobianBroyden(cv::Mat &jac, const cv::Mat &arg_step, const cv::Mat &err_step);
+
+
+/** Interprets termination criteria the same way CvLevMarq does. */
+inline void GetTermCriteria(const cv::TermCriteria &crit, int &max_iters, double &eps) {
+    max_iters = crit.type & cv::TermCriteria::MAX_ITER ? std::max(crit.maxCount, 1) : 30;
+    eps = crit.type & cv::TermCriteria::EPS ? std::max(crit.epsilon, 0.)
+                                            : std::numeric_limits<double>::epsilon();
+}
+
+
+/** \return Seconds elapsed since the given tick count */
+inline double SecondsSince(int64 start) {
+    return (cv::getTickCount() - start) / cv::getTickFrequency();
+}
+
+
+/** Evaluates the function error and updates statistics. */
+template <typename Func>
+void EvalError(Func &func, const cv::Mat &arg, cv::Mat &err, MinimizeStats &stats) {
+    int64 start = cv::getTickCount();
+    func(arg, err);
+    stats.residual_time += SecondsSince(start);
+    stats.num_residual_evals++;
+}
+
+
+/** Solves normal equations and updates statistics. */
+template <typename NormalEquations>
+bool SolveNormalEquations(NormalEquations &eqs, double lambda, cv::Mat &delta,
+                          MinimizeStats &stats)
+{
+    int64 start = cv::getTickCount();
+    bool ok = eqs.Solve(lambda, delta);
+    stats.solve_time += SecondsSince(start);
+    stats.num_factorizations++;
+    return ok;
+}
+
+
+/** Checks whether an accepted step meets the termination criteria.
+  *
+  * \return Termination reason, MinimizeStats::TERMINATION_NONE to proceed
+  */
+inline int CheckAcceptedStep(double step_norm, double arg_norm, double err_norm2,
+                             double err_norm2_prev, double eps, const MinimizeOpts &opts)
+{
+    if (step_norm < eps * arg_norm)
+        return MinimizeStats::TERMINATION_SMALL_STEP;
+    if (err_norm2_prev - err_norm2 < opts.min_rel_cost_decrease() * err_norm2_prev)
+        return MinimizeStats::TERMINATION_SMALL_COST_DECREASE;
+    return MinimizeStats::TERMINATION_NONE;
+}
+
+
+/** Records an iteration, prints it and calls the user callback.
+  *
+  * \return false if the callback asks to stop, true otherwise
+  */
+inline bool ReportIteration(const MinimizeOpts &opts, int iter, const cv::Mat &arg,
+                            double rms_err, int damping_lg10, MinimizeStats &stats)
+{
+    stats.iter_rms_errors.push_back(rms_err);
+    stats.iter_damping_lg10.push_back(damping_lg10);
+
+    if (opts.verbose() & MinimizeOpts::VERBOSE_ITER)
+        std::cout << "iter = " << iter << ", RMS error = " << rms_err << std::endl;
+
+    return opts.callback().empty() || (*opts.callback())(iter, arg, rms_err, damping_lg10);
+}
+
+
+/** Prints the summary and passes statistics to the user. */
+inline void FinishMinimization(const MinimizeOpts &opts, double init_rms_err, double rms_err,
+                               int num_iters, MinimizeStats &stats)
+{
+    if (opts.verbose() & MinimizeOpts::VERBOSE_SUMMARY)
+        std::cout << "start RMS error = " << init_rms_err
+                  << ", final RMS error = " << rms_err
+                  << ", num iters = " << num_iters << std::endl;
+
+    stats.num_iters = num_iters;
+    if (stats.termination == MinimizeStats::TERMINATION_NONE)
+        stats.termination = MinimizeStats::TERMINATION_MAX_ITERS;
+
+    if (opts.stats())
+        *opts.stats() += stats;
+}
+
+} // namespace internal
+
+
 template <typename Func>
 double MinimizeLevMarq(Func func, cv::InputOutputArray arg, MinimizeOpts opts) {
     cv::Mat arg_ = arg.getMatRef();
     CV_Assert(arg_.type() == CV_64F && arg_.rows == 1 && arg_.isContinuous());
 
-    int err_dim = func.dimension();
-    int arg_dim = arg_.cols;
+    int max_iters;
+    double eps;
+    internal::GetTermCriteria(opts.crit(), max_iters, eps);
+
+    MinimizeStats stats;
+    internal::DenseNormalEquations eqs;
+    cv::Mat err(func.dimension(), 1, CV_64F);
+    cv::Mat jac(func.dimension(), arg_.cols, CV_64F);
+    cv::Mat arg_prev(arg_.size(), CV_64F);
+    cv::Mat err_prev(func.dimension(), 1, CV_64F);
+    cv::Mat delta;
+
+    internal::EvalError(func, arg_, err, stats);
+    double err_norm2 = err.dot(err);
+    double init_rms_err = std::sqrt(err_norm2 / func.dimension());
+
+    int damping_lg10 = opts.damping_lg10();
+
+    int recompute_period = std::max(opts.jacobian_recompute_period(), 1);
+    int num_jac_updates = recompute_period;
+
+    int num_iters = 0;
+    while (stats.termination == MinimizeStats::TERMINATION_NONE && num_iters < max_iters) {
+        int64 start = cv::getTickCount();
+        if (num_jac_updates + 1 >= recompute_period) {
+            func.Jacobian(arg_, jac);
+            stats.num_jacobian_evals++;
+            num_jac_updates = 0;
+        }
+        else {
+            internal::UpdateJacobianBroyden(jac, arg_ - arg_prev, err - err_prev);
+            stats.num_jacobian_updates++;
+            num_jac_updates++;
+        }
+        stats.jacobian_time += internal::SecondsSince(start);
+        bool exact_jac = num_jac_updates == 0;
+
+        start = cv::getTickCount();
+        eqs.Set(jac, err);
+        stats.solve_time += internal::SecondsSince(start);
+
+        arg_.copyTo(arg_prev);
+        err.copyTo(err_prev);
+        num_iters++;
+
+        double err_norm2_prev = err_norm2;
+        int damping_lg10_prev = damping_lg10;
+        bool accepted = false;
+
+        for (; damping_lg10 <= 16; ++damping_lg10) {
+            if (!internal::SolveNormalEquations(eqs, std::pow(10., damping_lg10), delta, stats))
+                continue;
+
+            cv::subtract(arg_prev, delta, arg_);
+            internal::EvalError(func, arg_, err, stats);
+            err_norm2 = err.dot(err);
+
+            if (err_norm2 <= err_norm2_prev) {
+                accepted = true;
+                break;
+            }
+        }
+
+        if (accepted) {
+            damping_lg10 = std::max(damping_lg10 - 1, -16);
+            stats.termination = internal::CheckAcceptedStep(
+                    cv::norm(arg_, arg_prev), cv::norm(arg_prev), err_norm2, err_norm2_prev, eps, opts);
+        }
+        else {
+            // No damping decreases the error, so we're at the minimum
+            arg_prev.copyTo(arg_);
+            err_prev.copyTo(err);
+            err_norm2 = err_norm2_prev;
+            damping_lg10 = 16;
+            stats.termination = MinimizeStats::TERMINATION_NO_PROGRESS;
+        }
+
+        // An updated Jacobian stalls, so recompute it before deciding anything
+        if (!exact_jac && (stats.termination != MinimizeStats::TERMINATION_NONE ||
+                           damping_lg10 >= damping_lg10_prev)) {
+            stats.termination = MinimizeStats::TERMINATION_NONE;
+            damping_lg10 = damping_lg10_prev;
+            num_jac_updates = recompute_period;
+        }
+
+        double rms_err = std::sqrt(err_norm2 / func.dimension());
+
+        if (!internal::ReportIteration(opts, num_iters, arg_, rms_err, damping_lg10, stats) &&
+            stats.termination == MinimizeStats::TERMINATION_NONE)
+            stats.termination = MinimizeStats::TERMINATION_CALLBACK;
+    }
+
+    double rms_err = std::sqrt(err_norm2 / func.dimension());
+    internal::FinishMinimization(opts, init_rms_err, rms_err, num_iters, stats);
+
+    return rms_err;
+}
+
+
+template <typename Func>
+double MinimizeDogleg(Func func, cv::InputOutputArray arg, MinimizeOpts opts) {
+    cv::Mat arg_ = arg.getMatRef();
+    CV_Assert(arg_.type() == CV_64F && arg_.rows == 1 && arg_.isContinuous());
+
+    int max_iters;
+    double eps;
+    internal::GetTermCriteria(opts.crit(), max_iters, eps);
 
-    CvLevMarq solver(arg_dim, err_dim, opts.crit());
-    CvMat arg_c = arg_.reshape(0, arg_dim);
-    cvCopy(&arg_c, solver.param);
+    MinimizeStats stats;
+    internal::DenseNormalEquations eqs;
+    cv::Mat err(func.dimension(), 1, CV_64F);
+    cv::Mat jac(func.dimension(), arg_.cols, CV_64F);
+    cv::Mat arg_prev(arg_.size(), CV_64F);
+    cv::Mat delta_gn, delta_sd, delta;
 
-    double rms_err;
-    cv::Mat err(err_dim, 1, CV_64F);
-    cv::Mat jac(err_dim, arg_dim, CV_64F);
+    internal::EvalError(func, arg_, err, stats);
+    double err_norm2 = err.dot(err);
+    double init_rms_err = std::sqrt(err_norm2 / func.dimension());
 
-    func(arg_, err);
-    double init_rms_err = sqrt(err.dot(err) / func.dimension());
+    // Trust region radius, it's initialized with the first Gauss-Newton step length
+    double radius = -1;
 
     int num_iters = 0;
-    while (true) {
-        const CvMat *solver_param = 0;
-        CvMat *solver_err = 0;
-        CvMat *solver_jac = 0;
+    while (stats.termination == MinimizeStats::TERMINATION_NONE && num_iters < max_iters) {
+        int64 start = cv::getTickCount();
+        func.Jacobian(arg_, jac);
+        stats.jacobian_time += internal::SecondsSince(start);
+        stats.num_jacobian_evals++;
 
-        bool proceed = solver.update(solver_param, solver_jac, solver_err);
-        cvCopy(solver_param, &arg_c);
+        start = cv::getTickCount();
+        eqs.Set(jac, err);
+        stats.solve_time += internal::SecondsSince(start);
 
-        if (!proceed || !solver_err)
+        // Steepest descent step minimizing the quadratic model along the gradient
+        cv::Mat grad = eqs.JtErr().reshape(0, 1);
+        double grad_norm2 = grad.dot(grad);
+        double grad_curv = eqs.QuadraticForm(grad);
+        if (!(grad_norm2 > 0 && grad_curv > 0)) {
+            // No step is made, so the iteration isn't counted and reported
+            stats.termination = MinimizeStats::TERMINATION_NO_PROGRESS;
             break;
+        }
+
+        arg_.copyTo(arg_prev);
+        num_iters++;
+
+        double err_norm2_prev = err_norm2;
+        bool accepted = false;
+
+        delta_sd = grad * (grad_norm2 / grad_curv);
+        double sd_norm = cv::norm(delta_sd);
+
+        // Gauss-Newton step, it's the only system solved within the iteration
+        bool has_gn = internal::SolveNormalEquations(eqs, 0, delta_gn, stats);
+        double gn_norm = has_gn ? cv::norm(delta_gn) : 0;
+
+        if (radius < 0)
+            radius = has_gn ? gn_norm : sd_norm;
+
+        while (radius > eps * (cv::norm(arg_prev) + eps)) {
+            if (has_gn && gn_norm <= radius) {
+                delta_gn.copyTo(delta);
+            }
+            else if (!has_gn || sd_norm >= radius) {
+                delta = delta_sd * std::min(radius / sd_norm, 1.);
+            }
+            else {
+                // Go from the steepest descent step towards the Gauss-Newton one
+                // until the trust region boundary
+                cv::Mat dir = delta_gn - delta_sd;
+                double a = dir.dot(dir);
+                double b = delta_sd.dot(dir);
+                double c = sd_norm * sd_norm - radius * radius;
+                double beta = (-b + std::sqrt(b * b - a * c)) / a;
+                delta = delta_sd + dir * beta;
+            }
+
+            // Decrease of the half sum of squared errors predicted by the quadratic model
+            double pred_decrease = grad.dot(delta) - 0.5 * eqs.QuadraticForm(delta);
+
+            cv::subtract(arg_prev, delta, arg_);
+            internal::EvalError(func, arg_, err, stats);
+            err_norm2 = err.dot(err);
 
-        if (solver_err) {
-            func(arg_, err);
-            CvMat tmp = err;
-            cvCopy(&tmp, solver_err);
-            rms_err = sqrt(err.dot(err) / func.dimension());
+            double ratio = pred_decrease > 0 ? 0.5 * (err_norm2_prev - err_norm2) / pred_decrease : 0;
+            double delta_norm = cv::norm(delta);
+            if (ratio > 0.75)
+                radius = std::max(radius, 3 * delta_norm);
+            else if (ratio < 0.25)
+                radius = 0.5 * delta_norm;
+
+            if (err_norm2 <= err_norm2_prev) {
+                accepted = true;
+                break;
+            }
         }
 
-        if (solver_jac) {
-            func.Jacobian(arg_, jac);
-            CvMat tmp = jac;
-            cvCopy(&tmp, solver_jac);
-            num_iters++;
-            if (opts.verbose() & MinimizeOpts::VERBOSE_ITER)
-                std::cout << "iter = " << num_iters
-                          << ", RMS error = " << rms_err << std::endl;
+        if (accepted) {
+            stats.termination = internal::CheckAcceptedStep(
+                    cv::norm(arg_, arg_prev), cv::norm(arg_prev), err_norm2, err_norm2_prev, eps, opts);
+        }
+        else {
+            // The trust region has collapsed, so we're at the minimum
+            arg_prev.copyTo(arg_);
+            err_norm2 = err_norm2_prev;
+            stats.termination = MinimizeStats::TERMINATION_NO_PROGRESS;
         }
+
+        double rms_err = std::sqrt(err_norm2 / func.dimension());
+        int radius_lg10 = cvRound(std::log10(radius + std::numeric_limits<double>::min()));
+
+        if (!internal::ReportIteration(opts, num_iters, arg_, rms_err, radius_lg10, stats) &&
+            stats.termination == MinimizeStats::TERMINATION_NONE)
+            stats.termination = MinimizeStats::TERMINATION_CALLBACK;
     }
 
-    if (opts.verbose() & MinimizeOpts::VERBOSE_SUMMARY)
-        std::cout << "start RMS error = " << init_rms_err
-                  << ", final RMS error = " << rms_err
-                  << ", num iters = " << num_iters << std::endl;
+    double rms_err = std::sqrt(err_norm2 / func.dimension());
+    internal::FinishMinimization(opts, init_rms_err, rms_err, num_iters, stats);
 
     return rms_err;
 }
 
+
+template <typename Func>
+double Minimize(Func func, cv::InputOutputArray arg, MinimizeOpts opts) {
+    if (opts.method() == MinimizeOpts::METHOD_DOGLEG)
+        return MinimizeDogleg(func, arg, opts);
+    return MinimizeLevMarq(func, arg, opts);
+}
+
+
+namespace internal {
+
+/** Computes interleaved Jacobian columns, see CalcJacobianBlockwise(). */
+template <typename Func>
+class CalcJacobianBlockwiseBody : public cv::ParallelLoopBody {
+public:
+    CalcJacobianBlockwiseBody(Func &func, const cv::Mat &arg,
+                              const std::vector<std::vector<int> > &arg_blocks,
+                              double step, int num_stripes, cv::Mat &jac)
+        : func_(&func), arg_(arg), arg_blocks_(&arg_blocks), step_(step),
+          num_stripes_(num_stripes), jac_(jac) {}
+
+    void operator()(const cv::Range &range) const {
+        const std::vector<ResidualBlock> &blocks = func_->residual_blocks();
+
+        // Each stripe has its own scratch buffers
+        cv::Mat_<double> arg(arg_.clone());
+        std::vector<double> err_plus, err_minus;
+
+        for (int stripe = range.start; stripe < range.end; ++stripe) {
+            for (int i = stripe; i < arg.cols; i += num_stripes_) {
+                double val = arg(0, i);
+                const std::vector<int> &arg_blocks = (*arg_blocks_)[i];
+
+                for (size_t j = 0; j < arg_blocks.size(); ++j) {
+                    const ResidualBlock &block = blocks[arg_blocks[j]];
+                    err_plus.resize(block.num_rows);
+                    err_minus.resize(block.num_rows);
+
+                    arg(0, i) = val + step_;
+                    func_->CalcResidualBlock(arg, arg_blocks[j], &err_plus[0]);
+
+                    arg(0, i) = val - step_;
+                    func_->CalcResidualBlock(arg, arg_blocks[j], &err_minus[0]);
+
+                    for (int k = 0; k < block.num_rows; ++k)
+                        jac_(block.row + k, i) = (err_plus[k] - err_minus[k]) / (2 * step_);
+                }
+
+                arg(0, i) = val;
+            }
+        }
+    }
+
+private:
+    Func *func_;
+    cv::Mat_<double> arg_;
+    const std::vector<std::vector<int> > *arg_blocks_;
+    double step_;
+    int num_stripes_;
+    mutable cv::Mat_<double> jac_;
+};
+
+} // namespace internal
+
+
+template <typename Func>
+void CalcJacobianBlockwise(Func &func, const cv::Mat &arg, cv::Mat &jac, double step,
+                           int num_threads)
+{
+    CV_Assert(arg.type() == CV_64F && arg.rows == 1);
+    const std::vector<ResidualBlock> &blocks = func.residual_blocks();
+
+    jac.create(func.dimension(), arg.cols, CV_64F);
+    jac.setTo(0);
+
+    // Find blocks depending on each argument
+    std::vector<std::vector<int> > arg_blocks(arg.cols);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (blocks[i].num_rows > 0) {
+            for (size_t j = 0; j < blocks[i].args.size(); ++j)
+                arg_blocks[blocks[i].args[j]].push_back((int)i);
+        }
+    }
+
+    // Columns are interleaved between stripes to balance the load
+    int num_stripes = std::max(1, std::min(num_threads, arg.cols));
+    internal::CalcJacobianBlockwiseBody<Func> body(func, arg, arg_blocks, step, num_stripes, jac);
+
+    if (num_stripes > 1)
+        cv::parallel_for_(cv::Range(0, num_stripes), body, num_stripes);
+    else
+        body(cv::Range(0, 1));
+}
+
+
+template <int N, typename Func>
+void CalcJacobianAutoDiff(Func &func, const cv::Mat &arg, cv::Mat &jac) {
+    CV_Assert(arg.type() == CV_64F && arg.rows == 1);
+    const std::vector<ResidualBlock> &blocks = func.residual_blocks();
+
+    jac.create(func.dimension(), arg.cols, CV_64F);
+    jac.setTo(0);
+    cv::Mat_<double> jac_(jac);
+
+    std::vector<autodiff::Jet<N> > arg_(arg.cols);
+    for (int i = 0; i < arg.cols; ++i)
+        arg_[i] = autodiff::Jet<N>(arg.at<double>(0, i));
+
+    std::vector<autodiff::Jet<N> > err;
+
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        const ResidualBlock &block = blocks[i];
+        if (block.num_rows == 0)
+            continue;
+
+        err.resize(block.num_rows);
+
+        // Seed up to N arguments per pass
+        for (size_t first = 0; first < block.args.size(); first += N) {
+            size_t last = std::min(first + N, block.args.size());
+
+            for (size_t j = first; j < last; ++j)
+                arg_[block.args[j]].grad[j - first] = 1;
+
+            func.CalcResidualBlock(&arg_[0], (int)i, &err[0]);
+
+            for (size_t j = first; j < last; ++j)
+                arg_[block.args[j]].grad[j - first] = 0;
+
+            for (int k = 0; k < block.num_rows; ++k)
+                for (size_t j = first; j < last; ++j)
+                    jac_(block.row + k, block.args[j]) = err[k].grad[j - first];
+        }
+    }
+}
+
 } // namespace autocalib
 
 #endif // AUTOCALIB_CORE_INL_H_
@@ -0,0 +1,258 @@
+#ifndef AUTOCALIB_JET_H_
+#define AUTOCALIB_JET_H_
+
+#include <cmath>
+#include <limits>
+
+namespace autocalib {
+
+/** Forward-mode automatic differentiation.
+  *
+  * Functions written as templates over the scalar type can be evaluated with Jet
+  * arguments to obtain exact derivatives in a single pass. Mathematical functions
+  * must be called unqualified (with std ones brought in via using-declarations),
+  * so that the overloads below are found by argument-dependent lookup.
+  */
+namespace autodiff {
+
+/** Dual number holding a value and its partial derivatives with respect to N arguments. */
+template <int N>
+class Jet {
+public:
+    Jet() : val(0) { SetZeroGrad(); }
+
+    /** Constructs a constant. */
+    Jet(double val) : val(val) { SetZeroGrad(); }
+
+    /** Constructs a variable, i.e. the k-th argument. */
+    Jet(double val, int k) : val(val) {
+        SetZeroGrad();
+        grad[k] = 1;
+    }
+
+    Jet& operator +=(const Jet &b) {
+        val += b.val;
+        for (int i = 0; i < N; ++i) grad[i] += b.grad[i];
+        return *this;
+    }
+
+    Jet& operator -=(const Jet &b) {
+        val -= b.val;
+        for (int i = 0; i < N; ++i) grad[i] -= b.grad[i];
+        return *this;
+    }
+
+    Jet& operator *=(const Jet &b) {
+        for (int i = 0; i < N; ++i) grad[i] = grad[i] * b.val + val * b.grad[i];
+        val *= b.val;
+        return *this;
+    }
+
+    Jet& operator /=(const Jet &b) {
+        double inv = 1 / b.val;
+        val *= inv;
+        for (int i = 0; i < N; ++i) grad[i] = (grad[i] - val * b.grad[i]) * inv;
+        return *this;
+    }
+
+    Jet& operator +=(double b) { val += b; return *this; }
+    Jet& operator -=(double b) { val -= b; return *this; }
+
+    Jet& operator *=(double b) {
+        val *= b;
+        for (int i = 0; i < N; ++i) grad[i] *= b;
+        return *this;
+    }
+
+    Jet& operator /=(double b) { return *this *= 1 / b; }
+
+    double val;
+    double grad[N];
+
+private:
+    void SetZeroGrad() {
+        for (int i = 0; i < N; ++i) grad[i] = 0;
+    }
+};
+
+
+template <int N> inline Jet<N> operator +(const Jet<N> &a) { return a; }
+template <int N> inline Jet<N> operator -(const Jet<N> &a) { return Jet<N>(a) *= -1.; }
+
+template <int N> inline Jet<N> operator +(const Jet<N> &a, const Jet<N> &b) { return Jet<N>(a) += b; }
+template <int N> inline Jet<N> operator -(const Jet<N> &a, const Jet<N> &b) { return Jet<N>(a) -= b; }
+template <int N> inline Jet<N> operator *(const Jet<N> &a, const Jet<N> &b) { return Jet<N>(a) *= b; }
+template <int N> inline Jet<N> operator /(const Jet<N> &a, const Jet<N> &b) { return Jet<N>(a) /= b; }
+
+template <int N> inline Jet<N> operator +(const Jet<N> &a, double b) { return Jet<N>(a) += b; }
+template <int N> inline Jet<N> operator -(const Jet<N> &a, double b) { return Jet<N>(a) -= b; }
+template <int N> inline Jet<N> operator *(const Jet<N> &a, double b) { return Jet<N>(a) *= b; }
+template <int N> inline Jet<N> operator /(const Jet<N> &a, double b) { return Jet<N>(a) /= b; }
+
+template <int N> inline Jet<N> operator +(double a, const Jet<N> &b) { return Jet<N>(b) += a; }
+template <int N> inline Jet<N> operator -(double a, const Jet<N> &b) { return -b += a; }
+template <int N> inline Jet<N> operator *(double a, const Jet<N> &b) { return Jet<N>(b) *= a; }
+template <int N> inline Jet<N> operator /(double a, const Jet<N> &b) { return Jet<N>(a) /= b; }
+
+template <int N> inline bool operator <(const Jet<N> &a, const Jet<N> &b) { return a.val < b.val; }
+template <int N> inline bool operator >(const Jet<N> &a, const Jet<N> &b) { return a.val > b.val; }
+template <int N> inline bool operator <(const Jet<N> &a, double b) { return a.val < b; }
+template <int N> inline bool operator >(const Jet<N> &a, double b) { return a.val > b; }
+template <int N> inline bool operator <(double a, const Jet<N> &b) { return a < b.val; }
+template <int N> inline bool operator >(double a, const Jet<N> &b) { return a > b.val; }
+
+
+template <int N>
+inline Jet<N> sqrt(const Jet<N> &a) {
+    Jet<N> res(std::sqrt(a.val));
+    double mult = 0.5 / res.val;
+    for (int i = 0; i < N; ++i) res.grad[i] = a.grad[i] * mult;
+    return res;
+}
+
+
+template <int N>
+inline Jet<N> abs(const Jet<N> &a) {
+    return a.val < 0 ? -a : a;
+}
+
+
+template <int N>
+inline Jet<N> sin(const Jet<N> &a) {
+    Jet<N> res(std::sin(a.val));
+    double mult = std::cos(a.val);
+    for (int i = 0; i < N; ++i) res.grad[i] = a.grad[i] * mult;
+    return res;
+}
+
+
+template <int N>
+inline Jet<N> cos(const Jet<N> &a) {
+    Jet<N> res(std::cos(a.val));
+    double mult = -std::sin(a.val);
+    for (int i = 0; i < N; ++i) res.grad[i] = a.grad[i] * mult;
+    return res;
+}
+
+
+/** \return Value of a plain number */
+inline double Value(double a) { return a; }
+
+/** \return Value of a jet */
+template <int N>
+inline double Value(const Jet<N> &a) { return a.val; }
+
+
+/** Row-major 3x3 matrix of plain numbers or jets. */
+template <typename T>
+class Matrix33 {
+public:
+    /** Constructs zero matrix. */
+    Matrix33() {
+        for (int i = 0; i < 9; ++i) val_[i] = T(0);
+    }
+
+    static Matrix33 eye() {
+        Matrix33 res;
+        res(0, 0) = res(1, 1) = res(2, 2) = T(1);
+        return res;
+    }
+
+    T& operator ()(int row, int col) { return val_[3 * row + col]; }
+    const T& operator ()(int row, int col) const { return val_[3 * row + col]; }
+
+    Matrix33 t() const {
+        Matrix33 res;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                res(i, j) = (*this)(j, i);
+        return res;
+    }
+
+private:
+    T val_[9];
+};
+
+
+template <typename T>
+Matrix33<T> operator *(const Matrix33<T> &a, const Matrix33<T> &b) {
+    Matrix33<T> res;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            res(i, j) = a(i, 0) * b(0, j) + a(i, 1) * b(1, j) + a(i, 2) * b(2, j);
+    return res;
+}
+
+
+template <typename T>
+Matrix33<T> operator +(const Matrix33<T> &a, const Matrix33<T> &b) {
+    Matrix33<T> res;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            res(i, j) = a(i, j) + b(i, j);
+    return res;
+}
+
+
+template <typename T>
+Matrix33<T> operator -(const Matrix33<T> &a, const Matrix33<T> &b) {
+    Matrix33<T> res;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            res(i, j) = a(i, j) - b(i, j);
+    return res;
+}
+
+
+/** \return Skew-symmetric matrix representing cross product with the 3-vector */
+template <typename T>
+Matrix33<T> CrossProductMatrix33(const T *vec) {
+    Matrix33<T> res;
+    res(0, 1) = -vec[2]; res(0, 2) = vec[1];
+    res(1, 0) = vec[2]; res(1, 2) = -vec[0];
+    res(2, 0) = -vec[1]; res(2, 1) = vec[0];
+    return res;
+}
+
+
+/** Converts a rotation vector into a rotation matrix, like cv::Rodrigues() does.
+  *
+  * \param rvec Rotation vector (3 elements)
+  * \return Rotation matrix
+  */
+template <typename T>
+Matrix33<T> RodriguesToMatrix33(const T *rvec) {
+    using std::sqrt;
+    using std::sin;
+    using std::cos;
+
+    T theta2 = rvec[0] * rvec[0] + rvec[1] * rvec[1] + rvec[2] * rvec[2];
+
+    // Use the first order approximation near zero, it keeps derivatives exact there
+    if (!(theta2 > std::numeric_limits<double>::epsilon()))
+        return Matrix33<T>::eye() + CrossProductMatrix33(rvec);
+
+    T theta = sqrt(theta2);
+    T c = cos(theta);
+    T s = sin(theta);
+    T k[] = {rvec[0] / theta, rvec[1] / theta, rvec[2] / theta};
+
+    Matrix33<T> res;
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            res(i, j) = (1. - c) * k[i] * k[j];
+    for (int i = 0; i < 3; ++i)
+        res(i, i) += c;
+
+    res(0, 1) -= s * k[2]; res(0, 2) += s * k[1];
+    res(1, 0) += s * k[2]; res(1, 2) -= s * k[0];
+    res(2, 0) -= s * k[1]; res(2, 1) += s * k[0];
+
+    return res;
+}
+
+} // namespace autodiff
+
+} // namespace autocalib
+
+#endif // AUTOCALIB_JET_H_
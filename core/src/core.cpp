@@ -1,4 +1,5 @@
 #include "precomp.h"
+#include "simd.h"
 #include <include/core.h>
 
 using namespace std;
@@ -192,91 +193,1196 @@ Mat CalibRotationalCameraLinearNoSkew(const HomographiesP2 &Hs, double *residual
 }
 
 
+namespace internal {
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> MatrixXdRowMajor;
+
+void DenseNormalEquations::Set(const Mat &jac, const Mat &err) {
+    CV_Assert(jac.type() == CV_64F && jac.isContinuous());
+    CV_Assert(err.type() == CV_64F && err.isContinuous() && (int)err.total() == jac.rows);
+
+    Eigen::Map<const MatrixXdRowMajor> J(jac.ptr<double>(), jac.rows, jac.cols);
+    Eigen::Map<const Eigen::VectorXd> e(err.ptr<double>(), jac.rows);
+
+    JtJ_.create(jac.cols, jac.cols, CV_64F);
+    JtErr_.create(jac.cols, 1, CV_64F);
+    Eigen::Map<MatrixXdRowMajor> JtJ(JtJ_.ptr<double>(), jac.cols, jac.cols);
+    Eigen::Map<Eigen::VectorXd> JtErr(JtErr_.ptr<double>(), jac.cols);
+
+    // Only the lower triangle is used
+    JtJ.setZero();
+    JtJ.selfadjointView<Eigen::Lower>().rankUpdate(J.transpose());
+    JtErr.noalias() = J.transpose() * e;
+
+    num_args_ = jac.cols;
+    free_args_.clear();
+    err_norm2_ = e.squaredNorm();
+}
+
+
+void DenseNormalEquations::Clear() {
+    JtJ_.create(num_args_, num_args_, CV_64F);
+    JtJ_.setTo(0);
+    JtErr_.create(num_args_, 1, CV_64F);
+    JtErr_.setTo(0);
+    free_args_.clear();
+    err_norm2_ = 0;
+}
+
+
+void DenseNormalEquations::BeginBlock(const vector<int> &cols) {
+    cols_ = &cols;
+    JtJ_block_.assign(cols.size() * cols.size(), 0.);
+    JtErr_block_.assign(cols.size(), 0.);
+}
+
+
+void DenseNormalEquations::AddRow(int /*row*/, double err, const double *derivs) {
+    int num_cols = (int)cols_->size();
+    for (int i = 0; i < num_cols; ++i) {
+        double *JtJ_row = &JtJ_block_[i * num_cols];
+        for (int j = 0; j <= i; ++j)
+            JtJ_row[j] += derivs[i] * derivs[j];
+        JtErr_block_[i] += derivs[i] * err;
+    }
+    err_norm2_ += err * err;
+}
+
+
+void DenseNormalEquations::EndBlock() {
+    const vector<int> &cols = *cols_;
+    int num_cols = (int)cols.size();
+
+    // Columns of a block aren't necessarily sorted, while only the lower triangle is used
+    for (int i = 0; i < num_cols; ++i) {
+        for (int j = 0; j <= i; ++j) {
+            int row = std::max(cols[i], cols[j]);
+            int col = std::min(cols[i], cols[j]);
+            JtJ_.at<double>(row, col) += JtJ_block_[i * num_cols + j];
+        }
+        JtErr_.at<double>(cols[i], 0) += JtErr_block_[i];
+    }
+}
+
+
+double DenseNormalEquations::QuadraticForm(const Mat &v) const {
+    CV_Assert(v.type() == CV_64F && v.isContinuous() && (int)v.total() == JtJ_.rows);
+
+    Eigen::Map<const MatrixXdRowMajor> JtJ(JtJ_.ptr<double>(), JtJ_.rows, JtJ_.cols);
+    Eigen::Map<const Eigen::VectorXd> v_(v.ptr<double>(), JtJ_.rows);
+    return v_.dot(JtJ.selfadjointView<Eigen::Lower>() * v_);
+}
+
+
+void UpdateJacobianBroyden(Mat &jac, const Mat &arg_step, const Mat &err_step) {
+    CV_Assert(arg_step.type() == CV_64F && arg_step.rows == 1 && arg_step.cols == jac.cols);
+    CV_Assert(err_step.type() == CV_64F && err_step.cols == 1 && err_step.rows == jac.rows);
+
+    double step_norm2 = arg_step.dot(arg_step);
+    if (!(step_norm2 > 0))
+        return;
+
+    // Make the Jacobian predict the observed error change along the step
+    Mat pred_error = err_step - jac * arg_step.t();
+    jac += pred_error * arg_step * (1. / step_norm2);
+}
+
+
+bool DenseNormalEquations::Solve(double lambda, Mat &delta) {
+    // Find free arguments once per Jacobian
+    if (free_args_.empty()) {
+        for (int i = 0; i < JtJ_.rows; ++i) {
+            if (JtJ_.at<double>(i, i) > 0)
+                free_args_.push_back(i);
+        }
+    }
+
+    int num_free = (int)free_args_.size();
+
+    Eigen::MatrixXd A(num_free, num_free);
+    Eigen::VectorXd b(num_free);
+    for (int i = 0; i < num_free; ++i) {
+        const double *row = JtJ_.ptr<double>(free_args_[i]);
+        for (int j = 0; j <= i; ++j)
+            A(i, j) = row[free_args_[j]];
+        A(i, i) *= 1 + lambda;
+        b(i) = JtErr_.at<double>(free_args_[i], 0);
+    }
+
+    Eigen::VectorXd x;
+    Eigen::LDLT<Eigen::MatrixXd> ldlt(A);
+    if (ldlt.info() == Eigen::Success && ldlt.isPositive())
+        x = ldlt.solve(b);
+
+    // Fall back to the pseudo-inverse, as CvLevMarq uses
+    if (x.size() != num_free || !x.allFinite()) {
+        Eigen::MatrixXd A_full = A.selfadjointView<Eigen::Lower>();
+        x = A_full.jacobiSvd(Eigen::ComputeThinU | Eigen::ComputeThinV).solve(b);
+        if (!x.allFinite())
+            return false;
+    }
+
+    delta.create(1, JtJ_.cols, CV_64F);
+    delta.setTo(0);
+    for (int i = 0; i < num_free; ++i)
+        delta.at<double>(0, free_args_[i]) = x(i);
+
+    return true;
+}
+
+} // namespace internal
+
+
 namespace {
 
+/** Writes Jacobian rows streamed by an error function into a dense matrix. */
+class DenseJacobianWriter {
+public:
+    explicit DenseJacobianWriter(Mat &jac) : jac_(jac), cols_(0) {}
+
+    void BeginBlock(const vector<int> &cols) { cols_ = &cols; }
+
+    void AddRow(int row, double /*err*/, const double *derivs) {
+        for (size_t i = 0; i < cols_->size(); ++i)
+            jac_(row, (*cols_)[i]) = derivs[i];
+    }
+
+    void EndBlock() {}
+
+private:
+    Mat_<double> jac_;
+    const vector<int> *cols_;
+};
+
+
+/** Normal equations of a least squares problem which arguments are a few common
+  * parameters followed by equally sized parameter blocks, e.g. stereo rig parameters
+  * followed by per-shot motions. Block-block terms are stored sparsely, so the blocks
+  * can be eliminated via the Schur complement.
+  *
+  * Jacobian rows are streamed in groups depending on the same arguments, see
+  * DenseJacobianWriter.
+  */
+class BlockNormalEquations {
+public:
+    BlockNormalEquations(int num_common, int block_size, int num_blocks)
+        : num_common_(num_common), block_size_(block_size), num_blocks_(num_blocks), cols_(0)
+    {
+        Clear();
+    }
+
+    void Clear();
+
+    void BeginBlock(const vector<int> &cols);
+    void AddRow(int row, double err, const double *derivs);
+    void EndBlock();
+
+    /** \return Sum of squared errors of the streamed rows */
+    double err_norm2() const { return err_norm2_; }
+
+    /** Solves (JtJ + lambda * diag(JtJ)) * delta = Jte. Arguments nothing depends
+      * on are kept fixed.
+      *
+      * \return True if the system isn't degenerate
+      */
+    bool Solve(double lambda, Mat &delta) const;
+
+private:
+    int num_common_;
+    int block_size_;
+    int num_blocks_;
+
+    Eigen::MatrixXd U_;
+    Eigen::MatrixXd W_;
+    map<pair<int, int>, Eigen::MatrixXd> V_;
+    Eigen::VectorXd g_;
+    double err_norm2_;
+
+    const vector<int> *cols_;
+    Eigen::MatrixXd JtJ_block_;
+    Eigen::VectorXd g_block_;
+};
+
+
+void BlockNormalEquations::Clear() {
+    U_.setZero(num_common_, num_common_);
+    W_.setZero(num_common_, block_size_ * num_blocks_);
+    V_.clear();
+    g_.setZero(num_common_ + block_size_ * num_blocks_);
+    err_norm2_ = 0;
+}
+
+
+void BlockNormalEquations::BeginBlock(const vector<int> &cols) {
+    cols_ = &cols;
+    JtJ_block_.setZero(cols.size(), cols.size());
+    g_block_.setZero(cols.size());
+}
+
+
+void BlockNormalEquations::AddRow(int /*row*/, double err, const double *derivs) {
+    Eigen::Map<const Eigen::VectorXd> d(derivs, cols_->size());
+    JtJ_block_.noalias() += d * d.transpose();
+    g_block_ += d * err;
+    err_norm2_ += err * err;
+}
+
+
+void BlockNormalEquations::EndBlock() {
+    const vector<int> &cols = *cols_;
+
+    for (size_t i = 0; i < cols.size(); ++i) {
+        g_(cols[i]) += g_block_(i);
+
+        for (size_t j = 0; j < cols.size(); ++j) {
+            int row = cols[i];
+            int col = cols[j];
+
+            if (row < num_common_) {
+                if (col < num_common_)
+                    U_(row, col) += JtJ_block_(i, j);
+                else
+                    W_(row, col - num_common_) += JtJ_block_(i, j);
+            }
+            else if (col >= num_common_) {
+                row -= num_common_;
+                col -= num_common_;
+
+                // Only the upper block triangle is stored
+                if (row / block_size_ <= col / block_size_) {
+                    Eigen::MatrixXd &V = V_[make_pair(row / block_size_, col / block_size_)];
+                    if (V.size() == 0)
+                        V.setZero(block_size_, block_size_);
+                    V(row % block_size_, col % block_size_) += JtJ_block_(i, j);
+                }
+            }
+        }
+    }
+}
+
+
+bool BlockNormalEquations::Solve(double lambda, Mat &delta) const {
+    int num_block_params = block_size_ * num_blocks_;
+
+    Eigen::MatrixXd U = U_;
+    Eigen::VectorXd g = g_;
+
+    for (int i = 0; i < num_common_; ++i) {
+        if (U(i, i) > 0)
+            U(i, i) *= 1 + lambda;
+        else {
+            U(i, i) = 1;
+            g(i) = 0;
+        }
+    }
+
+    // Assemble the lower triangle of the damped block-block part
+
+    vector<Eigen::Triplet<double> > triplets;
+    Eigen::VectorXd V_diag = Eigen::VectorXd::Zero(num_block_params);
+
+    for (map<pair<int, int>, Eigen::MatrixXd>::const_iterator iter = V_.begin();
+         iter != V_.end(); ++iter)
+    {
+        const Eigen::MatrixXd &V = iter->second;
+        for (int r = 0; r < block_size_; ++r) {
+            for (int c = 0; c < block_size_; ++c) {
+                int row = iter->first.second * block_size_ + c;
+                int col = iter->first.first * block_size_ + r;
+                if (row == col)
+                    V_diag(row) = V(r, c);
+                else if (row > col && V(r, c) != 0)
+                    triplets.push_back(Eigen::Triplet<double>(row, col, V(r, c)));
+            }
+        }
+    }
+    for (int i = 0; i < num_block_params; ++i) {
+        if (V_diag(i) > 0)
+            triplets.push_back(Eigen::Triplet<double>(i, i, V_diag(i) * (1 + lambda)));
+        else {
+            triplets.push_back(Eigen::Triplet<double>(i, i, 1));
+            g(num_common_ + i) = 0;
+        }
+    }
+
+    Eigen::SparseMatrix<double> V(num_block_params, num_block_params);
+    V.setFromTriplets(triplets.begin(), triplets.end());
+
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > V_ldlt(V);
+    if (V_ldlt.info() != Eigen::Success)
+        return false;
+
+    // Eliminate the blocks, solve for the common parameters, then back-substitute
+
+    Eigen::MatrixXd V_inv_Wt = V_ldlt.solve(Eigen::MatrixXd(W_.transpose()));
+    Eigen::VectorXd V_inv_g = V_ldlt.solve(Eigen::VectorXd(g.tail(num_block_params)));
+
+    Eigen::MatrixXd S = U - W_ * V_inv_Wt;
+    Eigen::VectorXd delta_common = S.ldlt().solve(g.head(num_common_) - W_ * V_inv_g);
+    Eigen::VectorXd delta_blocks = V_inv_g - V_inv_Wt * delta_common;
+
+    if (!delta_common.allFinite() || !delta_blocks.allFinite())
+        return false;
+
+    delta.create(1, num_common_ + num_block_params, CV_64F);
+    Mat_<double> delta_(delta);
+    for (int i = 0; i < num_common_; ++i)
+        delta_(0, i) = delta_common(i);
+    for (int i = 0; i < num_block_params; ++i)
+        delta_(0, num_common_ + i) = delta_blocks(i);
+
+    return true;
+}
+
+
+/** Normal equations solved inexactly by conjugate gradients preconditioned with the block
+  * diagonal of JtJ. Only Jacobian rows are stored and JtJ is applied as two Jacobian-vector
+  * products, so memory and time of an iteration are linear in the number of residuals.
+  *
+  * Arguments are split into blocks as in BlockNormalEquations. Jacobian rows are streamed
+  * the same way too.
+  */
+class BlockJacobiPcgEquations {
+public:
+    BlockJacobiPcgEquations(int num_common, int block_size, int num_blocks,
+                            int max_iters = 100, double rel_tol = 1e-6)
+        : num_common_(num_common), block_size_(block_size), num_blocks_(num_blocks),
+          max_iters_(max_iters), rel_tol_(rel_tol)
+    {
+        Clear();
+    }
+
+    void Clear();
+
+    void BeginBlock(const vector<int> &cols);
+    void AddRow(int row, double err, const double *derivs);
+    void EndBlock() {}
+
+    /** \return Sum of squared errors of the streamed rows */
+    double err_norm2() const { return err_norm2_; }
+
+    /** Solves (JtJ + lambda * diag(JtJ)) * delta = Jte approximately. Arguments nothing
+      * depends on are kept fixed.
+      *
+      * \return True if the system isn't degenerate
+      */
+    bool Solve(double lambda, Mat &delta) const;
+
+private:
+    int num_args() const { return num_common_ + block_size_ * num_blocks_; }
+
+    /** \return Preconditioner block index, the common arguments form the first block */
+    int BlockIdx(int arg) const {
+        return arg < num_common_ ? 0 : 1 + (arg - num_common_) / block_size_;
+    }
+
+    int BlockStart(int block_idx) const {
+        return block_idx == 0 ? 0 : num_common_ + (block_idx - 1) * block_size_;
+    }
+
+    /** Computes JtJ * v as Jt * (J * v). */
+    void MultiplyJtJ(const Eigen::VectorXd &v, Eigen::VectorXd &res) const;
+
+    int num_common_;
+    int block_size_;
+    int num_blocks_;
+    int max_iters_;
+    double rel_tol_;
+
+    /** Jacobian rows depending on the same arguments. */
+    struct RowGroup {
+        int cols_start;
+        int num_cols;
+        int values_start;
+        int num_rows;
+    };
+
+    vector<RowGroup> groups_;
+    vector<int> cols_;
+    vector<double> values_;
+
+    vector<Eigen::MatrixXd> diag_blocks_;
+    Eigen::VectorXd g_;
+    double err_norm2_;
+
+    // Preconditioner block and position inside it of each column of the current group
+    vector<int> col_blocks_;
+    vector<int> col_offsets_;
+};
+
+
+void BlockJacobiPcgEquations::Clear() {
+    groups_.clear();
+    cols_.clear();
+    values_.clear();
+
+    diag_blocks_.resize(num_blocks_ + 1);
+    diag_blocks_[0].setZero(num_common_, num_common_);
+    for (int i = 1; i <= num_blocks_; ++i)
+        diag_blocks_[i].setZero(block_size_, block_size_);
+
+    g_.setZero(num_args());
+    err_norm2_ = 0;
+}
+
+
+void BlockJacobiPcgEquations::BeginBlock(const vector<int> &cols) {
+    RowGroup group;
+    group.cols_start = (int)cols_.size();
+    group.num_cols = (int)cols.size();
+    group.values_start = (int)values_.size();
+    group.num_rows = 0;
+    groups_.push_back(group);
+
+    cols_.insert(cols_.end(), cols.begin(), cols.end());
+
+    col_blocks_.resize(cols.size());
+    col_offsets_.resize(cols.size());
+    for (size_t i = 0; i < cols.size(); ++i) {
+        col_blocks_[i] = BlockIdx(cols[i]);
+        col_offsets_[i] = cols[i] - BlockStart(col_blocks_[i]);
+    }
+}
+
+
+void BlockJacobiPcgEquations::AddRow(int /*row*/, double err, const double *derivs) {
+    RowGroup &group = groups_.back();
+    const int *cols = &cols_[group.cols_start];
+
+    values_.insert(values_.end(), derivs, derivs + group.num_cols);
+    group.num_rows++;
+
+    for (int i = 0; i < group.num_cols; ++i) {
+        g_(cols[i]) += derivs[i] * err;
+
+        Eigen::MatrixXd &block = diag_blocks_[col_blocks_[i]];
+        for (int j = 0; j < group.num_cols; ++j) {
+            if (col_blocks_[j] == col_blocks_[i])
+                block(col_offsets_[i], col_offsets_[j]) += derivs[i] * derivs[j];
+        }
+    }
+
+    err_norm2_ += err * err;
+}
+
+
+void BlockJacobiPcgEquations::MultiplyJtJ(const Eigen::VectorXd &v, Eigen::VectorXd &res) const {
+    res.setZero(v.size());
+
+    for (size_t i = 0; i < groups_.size(); ++i) {
+        const RowGroup &group = groups_[i];
+        const int *cols = &cols_[group.cols_start];
+        const double *derivs = group.num_rows > 0 ? &values_[group.values_start] : 0;
+
+        for (int r = 0; r < group.num_rows; ++r, derivs += group.num_cols) {
+            double Jv = 0;
+            for (int j = 0; j < group.num_cols; ++j)
+                Jv += derivs[j] * v(cols[j]);
+            for (int j = 0; j < group.num_cols; ++j)
+                res(cols[j]) += derivs[j] * Jv;
+        }
+    }
+}
+
+
+bool BlockJacobiPcgEquations::Solve(double lambda, Mat &delta) const {
+    int n = num_args();
+
+    // Damped preconditioner blocks, arguments nothing depends on are fixed
+
+    Eigen::VectorXd damping = Eigen::VectorXd::Zero(n);
+    Eigen::VectorXd is_free = Eigen::VectorXd::Zero(n);
+    vector<Eigen::LDLT<Eigen::MatrixXd> > precond(diag_blocks_.size());
+
+    for (size_t b = 0; b < diag_blocks_.size(); ++b) {
+        Eigen::MatrixXd M = diag_blocks_[b];
+        int start = BlockStart((int)b);
+
+        for (int i = 0; i < M.rows(); ++i) {
+            if (M(i, i) > 0) {
+                damping(start + i) = lambda * M(i, i);
+                is_free(start + i) = 1;
+                M(i, i) *= 1 + lambda;
+            }
+            else {
+                M.row(i).setZero();
+                M.col(i).setZero();
+                M(i, i) = 1;
+            }
+        }
+
+        precond[b].compute(M);
+        if (precond[b].info() != Eigen::Success)
+            return false;
+    }
+
+    Eigen::VectorXd g = g_.cwiseProduct(is_free);
+    Eigen::VectorXd x = Eigen::VectorXd::Zero(n);
+    Eigen::VectorXd r = g;
+    Eigen::VectorXd z(n), p(n), Ap(n);
+
+    for (size_t b = 0; b < precond.size(); ++b) {
+        int start = BlockStart((int)b);
+        int size = (int)diag_blocks_[b].rows();
+        z.segment(start, size) = precond[b].solve(r.segment(start, size));
+    }
+    p = z;
+    double rz = r.dot(z);
+    double tol2 = rel_tol_ * rel_tol_ * g.squaredNorm();
+
+    for (int iter = 0; iter < max_iters_ && r.squaredNorm() > tol2; ++iter) {
+        MultiplyJtJ(p, Ap);
+        Ap = (Ap + damping.cwiseProduct(p)).cwiseProduct(is_free);
+
+        double pAp = p.dot(Ap);
+        if (!(pAp > 0))
+            break;
+
+        double alpha = rz / pAp;
+        x += alpha * p;
+        r -= alpha * Ap;
+
+        for (size_t b = 0; b < precond.size(); ++b) {
+            int start = BlockStart((int)b);
+            int size = (int)diag_blocks_[b].rows();
+            z.segment(start, size) = precond[b].solve(r.segment(start, size));
+        }
+
+        double rz_new = r.dot(z);
+        p = z + (rz_new / rz) * p;
+        rz = rz_new;
+    }
+
+    if (!x.allFinite())
+        return false;
+
+    delta.create(1, n, CV_64F);
+    Mat_<double> delta_(delta);
+    for (int i = 0; i < n; ++i)
+        delta_(0, i) = x(i);
+
+    return true;
+}
+
+
+/** Constructs the intrinsics matrix.
+  *
+  * \param K Intrinsic parameters (fx, skew, ppx, fy, ppy order)
+  */
+template <typename T>
+autodiff::Matrix33<T> Intrinsics(const T *K) {
+    autodiff::Matrix33<T> res;
+    res(0, 0) = K[0];
+    res(0, 1) = K[1];
+    res(0, 2) = K[2];
+    res(1, 1) = K[3];
+    res(1, 2) = K[4];
+    res(2, 2) = T(1);
+    return res;
+}
+
+
+/** Computes inverse of the intrinsics matrix.
+  *
+  * \param K Intrinsic parameters (fx, skew, ppx, fy, ppy order)
+  */
+template <typename T>
+autodiff::Matrix33<T> IntrinsicsInv(const T *K) {
+    autodiff::Matrix33<T> K_inv;
+    K_inv(0, 0) = 1. / K[0];
+    K_inv(0, 1) = -K[1] / (K[0] * K[3]);
+    K_inv(0, 2) = (K[1] * K[4] - K[2] * K[3]) / (K[0] * K[3]);
+    K_inv(1, 1) = 1. / K[3];
+    K_inv(1, 2) = -K[4] / K[3];
+    K_inv(2, 2) = T(1);
+    return K_inv;
+}
+
+
+/** \return Refine flag of an intrinsic parameter (fx, skew, ppx, fy, ppy order) */
+inline int IntrinsicRefineFlag(int i) {
+    static const int flags_tbl[] = {REFINE_FLAG_K_FX, REFINE_FLAG_K_SKEW, REFINE_FLAG_K_PPX,
+                                    REFINE_FLAG_K_FY, REFINE_FLAG_K_PPY};
+    return flags_tbl[i];
+}
+
+
+/** \return Derivative of the intrinsics matrix with respect to an intrinsic parameter
+  *         (fx, skew, ppx, fy, ppy order)
+  */
+inline autodiff::Matrix33<double> IntrinsicsDeriv(int i) {
+    static const int pos_tbl[][2] = {{0, 0}, {0, 1}, {0, 2}, {1, 1}, {1, 2}};
+    autodiff::Matrix33<double> dK;
+    dK(pos_tbl[i][0], pos_tbl[i][1]) = 1;
+    return dK;
+}
+
+
+/** Converts a rotation vector into a rotation matrix and its derivatives.
+  *
+  * \param dR Rotation matrix derivatives with respect to the rotation vector
+  */
+inline void RodriguesToMatrix33(const double *rvec, autodiff::Matrix33<double> &R,
+                                autodiff::Matrix33<double> dR[3])
+{
+    autodiff::Jet<3> rvec_[3];
+    for (int i = 0; i < 3; ++i)
+        rvec_[i] = autodiff::Jet<3>(rvec[i], i);
+    autodiff::Matrix33<autodiff::Jet<3> > R_ = autodiff::RodriguesToMatrix33(rvec_);
+
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            R(i, j) = R_(i, j).val;
+            for (int k = 0; k < 3; ++k)
+                dR[k](i, j) = R_(i, j).grad[k];
+        }
+    }
+}
+
+
+/** Marks functions checking the refine flags passed at runtime. */
+const int REFINE_FLAGS_RUNTIME = -1;
+
+
+/** Layout of intrinsic parameters in the argument vector under refine flags known at
+  * compile time. Only refined intrinsics take arguments, in the fx, skew, ppx, fy, ppy
+  * order, while fixed ones are held by the function. So functions instantiated for a mask
+  * neither check flags nor carry fixed parameters.
+  */
+template <int Flags>
+struct IntrinsicsLayout {
+    enum {
+        FX = (Flags & REFINE_FLAG_K_FX) != 0,
+        SKEW = (Flags & REFINE_FLAG_K_SKEW) != 0,
+        PPX = (Flags & REFINE_FLAG_K_PPX) != 0,
+        FY = (Flags & REFINE_FLAG_K_FY) != 0,
+        PPY = (Flags & REFINE_FLAG_K_PPY) != 0
+    };
+
+    /** Number of intrinsic arguments */
+    enum { NUM_ARGS = FX + SKEW + PPX + FY + PPY };
+
+    /** Argument indices of intrinsic parameters, meaningful for refined ones only */
+    enum {
+        FX_ARG = 0,
+        SKEW_ARG = FX,
+        PPX_ARG = FX + SKEW,
+        FY_ARG = FX + SKEW + PPX,
+        PPY_ARG = FX + SKEW + PPX + FY
+    };
+
+    /** \return true if an intrinsic argument is refined */
+    static bool IsRefined(int /*arg_idx*/, int /*flags*/) { return true; }
+
+    /** \return Intrinsic parameter (fx, skew, ppx, fy, ppy order) of an intrinsic argument */
+    static int Param(int arg_idx) {
+        if (FX && arg_idx == FX_ARG) return 0;
+        if (SKEW && arg_idx == SKEW_ARG) return 1;
+        if (PPX && arg_idx == PPX_ARG) return 2;
+        if (FY && arg_idx == FY_ARG) return 3;
+        return 4;
+    }
+
+    /** Gathers intrinsic parameters (fx, skew, ppx, fy, ppy order) from arguments.
+      *
+      * \param K_fixed Values of fixed intrinsic parameters
+      */
+    template <typename T>
+    static void Unpack(const T *arg, const double *K_fixed, T *K) {
+        K[0] = FX ? arg[FX_ARG] : T(K_fixed[0]);
+        K[1] = SKEW ? arg[SKEW_ARG] : T(K_fixed[1]);
+        K[2] = PPX ? arg[PPX_ARG] : T(K_fixed[2]);
+        K[3] = FY ? arg[FY_ARG] : T(K_fixed[3]);
+        K[4] = PPY ? arg[PPY_ARG] : T(K_fixed[4]);
+    }
+
+    /** Scatters refined intrinsic parameters (fx, skew, ppx, fy, ppy order) to arguments. */
+    static void Pack(const double *K, double *arg) {
+        for (int i = 0; i < NUM_ARGS; ++i)
+            arg[i] = K[Param(i)];
+    }
+};
+
+
+/** Same as above, but for refine flags known at runtime only. All the intrinsic parameters
+  * take arguments, while no residuals depend on fixed ones, so they never change.
+  */
+template <>
+struct IntrinsicsLayout<REFINE_FLAGS_RUNTIME> {
+    enum { NUM_ARGS = 5 };
+
+    static bool IsRefined(int arg_idx, int flags) {
+        return (flags & IntrinsicRefineFlag(arg_idx)) != 0;
+    }
+
+    static int Param(int arg_idx) { return arg_idx; }
+
+    template <typename T>
+    static void Unpack(const T *arg, const double * /*K_fixed*/, T *K) {
+        std::copy(arg, arg + NUM_ARGS, K);
+    }
+
+    static void Pack(const double *K, double *arg) { std::copy(K, K + NUM_ARGS, arg); }
+};
+
+
+/** Computes the symmetric point-to-epipolar distance, i.e. square root of SymEpipDist2(). */
+template <typename T>
+T SymEpipDist(double x1, double y1, const autodiff::Matrix33<T> &F12, double x2, double y2) {
+    using std::abs;
+    using std::sqrt;
+
+    T x2_ = F12(0, 0) * x2 + F12(0, 1) * y2 + F12(0, 2);
+    T y2_ = F12(1, 0) * x2 + F12(1, 1) * y2 + F12(1, 2);
+    T z2_ = F12(2, 0) * x2 + F12(2, 1) * y2 + F12(2, 2);
+
+    T x1_ = F12(0, 0) * x1 + F12(1, 0) * y1 + F12(2, 0);
+    T y1_ = F12(0, 1) * x1 + F12(1, 1) * y1 + F12(2, 1);
+
+    return abs(x1 * x2_ + y1 * y2_ + z2_) * sqrt(1. / (x1_ * x1_ + y1_ * y1_) +
+                                                 1. / (x2_ * x2_ + y2_ * y2_));
+}
+
+
+/** Computes weighted symmetric point-to-epipolar distances for a batch of correspondences. */
+template <typename T>
+void SymEpipDistWeighted(const double *x1, const double *y1, const autodiff::Matrix33<T> &F12,
+                         const double *x2, const double *y2, const double *weights, int count,
+                         T *dist)
+{
+    for (int i = 0; i < count; ++i)
+        dist[i] = SymEpipDist(x1[i], y1[i], F12, x2[i], y2[i]) * weights[i];
+}
+
+
+/** Same as above, but vectorized via batched SymEpipDist2(). */
+inline void SymEpipDistWeighted(const double *x1, const double *y1,
+                                const autodiff::Matrix33<double> &F12,
+                                const double *x2, const double *y2, const double *weights,
+                                int count, double *dist)
+{
+    SymEpipDist2(x1, y1, Mat(3, 3, CV_64F, const_cast<double*>(&F12(0, 0))), x2, y2, count, dist);
+    for (int i = 0; i < count; ++i)
+        dist[i] = sqrt(dist[i]) * weights[i];
+}
+
+
+/** Minimizes a function using the Levenberg-Marquardt algorithm. Unlike MinimizeLevMarq()
+  * it never builds the dense Jacobian, but accumulates normal equations from Jacobian rows
+  * streamed by the function via EvalJacobian(arg, eqs).
+  *
+  * \param eqs Normal equations, e.g. BlockNormalEquations or internal::DenseNormalEquations
+  */
+template <typename Func, typename NormalEquations>
+double MinimizeLevMarqStreamed(Func &func, InputOutputArray arg, NormalEquations &eqs,
+                               const MinimizeOpts &opts)
+{
+    Mat arg_ = arg.getMatRef();
+    CV_Assert(arg_.type() == CV_64F && arg_.rows == 1 && arg_.isContinuous());
+
+    int max_iters;
+    double eps;
+    internal::GetTermCriteria(opts.crit(), max_iters, eps);
+
+    MinimizeStats stats;
+    Mat err(func.dimension(), 1, CV_64F);
+    Mat arg_new, delta;
+
+    internal::EvalError(func, arg_, err, stats);
+    double err_norm2 = err.dot(err);
+    double init_rms_err = sqrt(err_norm2 / func.dimension());
+
+    // Same damping schedule as MinimizeLevMarq()
+    int lambda_lg10 = opts.damping_lg10();
+
+    int num_iters = 0;
+    while (stats.termination == MinimizeStats::TERMINATION_NONE && num_iters < max_iters) {
+        int64 start = getTickCount();
+        eqs.Clear();
+        func.EvalJacobian(arg_, eqs);
+        stats.jacobian_time += internal::SecondsSince(start);
+        stats.num_jacobian_evals++;
+        num_iters++;
+
+        stats.termination = MinimizeStats::TERMINATION_NO_PROGRESS;
+        for (; lambda_lg10 <= 16; ++lambda_lg10) {
+            if (!internal::SolveNormalEquations(eqs, pow(10., lambda_lg10), delta, stats))
+                continue;
+
+            arg_new = arg_ - delta;
+            internal::EvalError(func, arg_new, err, stats);
+            double err_norm2_new = err.dot(err);
+
+            if (err_norm2_new <= err_norm2) {
+                stats.termination = internal::CheckAcceptedStep(
+                        norm(delta), norm(arg_), err_norm2_new, err_norm2, eps, opts);
+                arg_new.copyTo(arg_);
+                err_norm2 = err_norm2_new;
+                lambda_lg10 = std::max(lambda_lg10 - 1, -16);
+                break;
+            }
+        }
+        lambda_lg10 = std::min(lambda_lg10, 16);
+
+        double rms_err = sqrt(err_norm2 / func.dimension());
+
+        if (!internal::ReportIteration(opts, num_iters, arg_, rms_err, lambda_lg10, stats) &&
+            stats.termination == MinimizeStats::TERMINATION_NONE)
+            stats.termination = MinimizeStats::TERMINATION_CALLBACK;
+    }
+
+    double rms_err = sqrt(err_norm2 / func.dimension());
+    internal::FinishMinimization(opts, init_rms_err, rms_err, num_iters, stats);
+
+    return rms_err;
+}
+
+
+/** Same as MinimizeLevMarqStreamed(), but eliminates parameter blocks via the Schur
+  * complement, so each step costs about linear time in the number of blocks when they
+  * are sparsely coupled.
+  *
+  * \param num_common Number of leading arguments shared by all residuals
+  * \param block_size Size of each parameter block following the common arguments
+  */
+template <typename Func>
+double MinimizeLevMarqSchur(Func &func, InputOutputArray arg, int num_common, int block_size,
+                            const MinimizeOpts &opts)
+{
+    int num_args = arg.getMat().cols;
+    CV_Assert(num_args >= num_common && (num_args - num_common) % block_size == 0);
+
+    BlockNormalEquations eqs(num_common, block_size, (num_args - num_common) / block_size);
+    return MinimizeLevMarqStreamed(func, arg, eqs, opts);
+}
+
+} // namespace
+
+
+namespace {
+
+/** Reprojection errors of a rotational camera. Arguments are refined intrinsics followed by
+  * rotation vectors of frames.
+  *
+  * \tparam Flags Refine flags the intrinsics layout is specialized for, see IntrinsicsLayout
+  */
+template <int Flags>
 class ReprojError_KR {
 public:
+    typedef IntrinsicsLayout<Flags> KLayout;
+
+    /** Refined intrinsics followed by rotation vectors of frames. */
+    typedef ParamBlockLayout<KLayout::NUM_ARGS, 3> Layout;
+
+    /** \param K Intrinsic parameters (fx, skew, ppx, fy, ppy order), fixed ones keep these
+      *          values
+      */
     ReprojError_KR(const FeaturesCollection &features,
                              const MatchesCollection &matches,
                              int params_to_refine,
-                             const vector<int> &Rs_indices)
+                             const double *K,
+                             const Layout &layout,
+                             int jacobian_method = MinimizeOpts::JACOBIAN_ANALYTIC,
+                             int num_threads = 1)
             : features_(&features),
               matches_(&matches),
               params_to_refine_(params_to_refine),
+              jacobian_method_(jacobian_method),
+              num_threads_(num_threads),
+              layout_(layout),
               step_(1e-4)
     {
+        std::copy(K, K + 5, K_fixed_);
+
         num_matches_ = 0;
         for (MatchesCollection::const_iterator view = matches_->begin();
              view != matches_->end(); ++view)
-            num_matches_ += (int)view->second->size();
+        {
+            ResidualBlock block(num_matches_ * 2, (int)view->second->size() * 2);
+
+            for (int i = 0; i < KLayout::NUM_ARGS; ++i) {
+                if (KLayout::IsRefined(i, params_to_refine_))
+                    block.args.push_back(i);
+            }
 
-        Rs_indices_inv_.assign(*max_element(Rs_indices.begin(), Rs_indices.end()) + 1, -1);
-        for (size_t i = 0; i < Rs_indices.size(); ++i)
-            Rs_indices_inv_[Rs_indices[i]] = i;
+            int imgs[] = {view->first.first, view->first.second};
+            for (int i = 0; i < 2; ++i) {
+                int offset = layout_.Offset(imgs[i]);
+                if (offset != -1) {
+                    for (int j = 0; j < Layout::BLOCK_SIZE; ++j)
+                        block.args.push_back(offset + j);
+                }
+            }
+
+            blocks_.push_back(block);
+            views_.push_back(view);
+            num_matches_ += (int)view->second->size();
+        }
     }
 
     void operator()(const Mat &arg, Mat &err);
     void Jacobian(const Mat &arg, Mat &jac);
 
+    /** Each residual block corresponds to a view. */
+    const vector<ResidualBlock>& residual_blocks() const { return blocks_; }
+
+    void CalcResidualBlock(const Mat &arg, int block_idx, double *err) {
+        CalcResidualBlock(arg.ptr<double>(), block_idx, err);
+    }
+
+    template <typename T>
+    void CalcResidualBlock(const T *arg, int block_idx, T *err) const;
+
+    /** Same as above, but reuses intrinsics cached by Jacobian() when the intrinsic
+      * arguments coincide with the cached ones.
+      */
+    void CalcResidualBlock(const double *arg, int block_idx, double *err) const;
+
     int dimension() const { return num_matches_ * 2; }
 
+    /** Streams closed-form Jacobian rows grouped by views, see DenseJacobianWriter. */
+    template <typename Writer>
+    void EvalJacobian(const Mat &arg, Writer &writer) const;
+
 private:
+    /** Gathers intrinsic parameters (fx, skew, ppx, fy, ppy order) from the arguments. */
+    template <typename T>
+    void UnpackIntrinsics(const T *arg, T *K) const { KLayout::Unpack(arg, K_fixed_, K); }
+
+    /** Caches intrinsics, so perturbing a rotation while computing the numeric Jacobian
+      * doesn't rebuild and invert them.
+      */
+    void UpdateCache(const Mat &arg);
+
+    /** Extracts a frame rotation from the argument vector.
+      *
+      * \param dR Rotation matrix derivatives with respect to the rotation vector
+      * \return Index of the first rotation parameter in the argument vector,
+      *         or -1 if the rotation is fixed (the reference frame)
+      */
+    int ExtractRotation(const double *arg, int img_idx, autodiff::Matrix33<double> &R,
+                        autodiff::Matrix33<double> dR[3]) const;
+
+    /** Same as above, but doesn't compute derivatives nor allocate memory. */
+    template <typename T>
+    autodiff::Matrix33<T> ExtractRotation(const T *arg, int img_idx) const;
+
+    template <typename T>
+    void CalcViewErr(const T *arg, const autodiff::Matrix33<T> &K,
+                     const autodiff::Matrix33<T> &K_inv, int view_idx, T *err) const;
+
     const FeaturesCollection *features_;
     const MatchesCollection *matches_;
+    vector<MatchesCollection::const_iterator> views_;
     int num_matches_;
     int params_to_refine_;
-    vector<int> Rs_indices_inv_;
+    int jacobian_method_;
+    int num_threads_;
+    Layout layout_;
+    vector<ResidualBlock> blocks_;
+
+    // Values of fixed intrinsics
+    double K_fixed_[5];
+
+    // Intrinsics at the argument of the last numeric Jacobian
+    vector<double> cached_K_args_;
+    autodiff::Matrix33<double> cached_K_;
+    autodiff::Matrix33<double> cached_K_inv_;
 
     const double step_;
-    Mat_<double> err_;
 };
 
 
-void ReprojError_KR::operator()(const Mat &arg, Mat &err) {
-    Mat_<double> arg_(arg);
+template <int Flags>
+void ReprojError_KR<Flags>::operator()(const Mat &arg, Mat &err) {
+    CV_Assert(arg.isContinuous());
+    const double *arg_ = arg.ptr<double>();
 
     err.create(dimension(), 1, CV_64F);
-    Mat_<double> err_(err);
+    CV_Assert(err.isContinuous());
+    double *err_ = err.ptr<double>();
+
+    double K_params[5];
+    UnpackIntrinsics(arg_, K_params);
+    autodiff::Matrix33<double> K = Intrinsics(K_params);
+    autodiff::Matrix33<double> K_inv = IntrinsicsInv(K_params);
+
+    for (size_t i = 0; i < views_.size(); ++i) {
+        if (blocks_[i].num_rows > 0)
+            CalcViewErr(arg_, K, K_inv, (int)i, err_ + blocks_[i].row);
+    }
+}
 
-    Mat_<double> K = Mat::eye(3, 3, CV_64F);
-    K(0, 0) = arg_(0, 0);
-    K(0, 1) = arg_(0, 1);
-    K(0, 2) = arg_(0, 2);
-    K(1, 1) = arg_(0, 3);
-    K(1, 2) = arg_(0, 4);
-    Mat K_inv = K.inv();
+
+template <int Flags>
+template <typename T>
+void ReprojError_KR<Flags>::CalcResidualBlock(const T *arg, int block_idx, T *err) const {
+    T K[5];
+    UnpackIntrinsics(arg, K);
+    CalcViewErr(arg, Intrinsics(K), IntrinsicsInv(K), block_idx, err);
+}
+
+
+template <int Flags>
+void ReprojError_KR<Flags>::CalcResidualBlock(const double *arg, int block_idx,
+                                              double *err) const
+{
+    bool same_K = !cached_K_args_.empty();
+    for (int i = 0; same_K && i < KLayout::NUM_ARGS; ++i)
+        same_K = arg[i] == cached_K_args_[i];
+
+    if (same_K)
+        CalcViewErr(arg, cached_K_, cached_K_inv_, block_idx, err);
+    else
+        CalcResidualBlock<double>(arg, block_idx, err);
+}
+
+
+template <int Flags>
+void ReprojError_KR<Flags>::UpdateCache(const Mat &arg) {
+    CV_Assert(arg.isContinuous());
+    const double *arg_ = arg.ptr<double>();
+
+    double K[5];
+    UnpackIntrinsics(arg_, K);
+    cached_K_args_.assign(arg_, arg_ + KLayout::NUM_ARGS);
+    cached_K_ = Intrinsics(K);
+    cached_K_inv_ = IntrinsicsInv(K);
+}
+
+
+template <int Flags>
+template <typename T>
+void ReprojError_KR<Flags>::CalcViewErr(const T *arg, const autodiff::Matrix33<T> &K,
+                                        const autodiff::Matrix33<T> &K_inv, int view_idx,
+                                        T *err) const
+{
+    MatchesCollection::const_iterator view = views_[view_idx];
+
+    int img_from = view->first.first;
+    int img_to = view->first.second;
+    const vector<KeyPoint> &kps_from = features_->find(img_from)->second->keypoints;
+    const vector<KeyPoint> &kps_to = features_->find(img_to)->second->keypoints;
+
+    autodiff::Matrix33<T> M = K * ExtractRotation(arg, img_from) *
+                              ExtractRotation(arg, img_to).t() * K_inv;
+
+    const vector<DMatch> &matches = *(view->second);
+    for (size_t i = 0; i < matches.size(); ++i) {
+        const Point2f &p1 = kps_from[matches[i].queryIdx].pt;
+        const Point2f &p2 = kps_to[matches[i].trainIdx].pt;
+        T x = M(0, 0) * p2.x + M(0, 1) * p2.y + M(0, 2);
+        T y = M(1, 0) * p2.x + M(1, 1) * p2.y + M(1, 2);
+        T z = M(2, 0) * p2.x + M(2, 1) * p2.y + M(2, 2);
+        err[2 * i] = p1.x - x / z;
+        err[2 * i + 1] = p1.y - y / z;
+    }
+}
+
+
+template <int Flags>
+void ReprojError_KR<Flags>::Jacobian(const Mat &arg, Mat &jac) {
+    if (jacobian_method_ == MinimizeOpts::JACOBIAN_NUMERIC) {
+        UpdateCache(arg);
+        CalcJacobianBlockwise(*this, arg, jac, step_, num_threads_);
+    }
+    else {
+        jac.create(dimension(), arg.cols, CV_64F);
+        jac.setTo(0);
+        DenseJacobianWriter writer(jac);
+        EvalJacobian(arg, writer);
+    }
+}
+
+
+template <int Flags>
+int ReprojError_KR<Flags>::ExtractRotation(const double *arg, int img_idx,
+                                           autodiff::Matrix33<double> &R,
+                                           autodiff::Matrix33<double> dR[3]) const
+{
+    int offset = layout_.Offset(img_idx);
+    if (offset == -1) {
+        R = autodiff::Matrix33<double>::eye();
+        return -1;
+    }
+
+    RodriguesToMatrix33(arg + offset, R, dR);
+    return offset;
+}
+
+
+template <int Flags>
+template <typename T>
+autodiff::Matrix33<T> ReprojError_KR<Flags>::ExtractRotation(const T *arg, int img_idx) const {
+    int offset = layout_.Offset(img_idx);
+    if (offset == -1)
+        return autodiff::Matrix33<T>::eye();
+    return autodiff::RodriguesToMatrix33(arg + offset);
+}
+
+
+template <int Flags>
+template <typename Writer>
+void ReprojError_KR<Flags>::EvalJacobian(const Mat &arg, Writer &writer) const {
+    typedef autodiff::Matrix33<double> Matrix33d;
+
+    // Intrinsics and rotations of both frames, though one of them can be fixed
+    enum { MAX_VIEW_ARGS = KLayout::NUM_ARGS + 6 };
+
+    CV_Assert(arg.isContinuous());
+    const double *arg_ = arg.ptr<double>();
+
+    double K_params[5];
+    UnpackIntrinsics(arg_, K_params);
+    Matrix33d K = Intrinsics(K_params);
+    Matrix33d K_inv = IntrinsicsInv(K_params);
+
+    // Products dK * K_inv, where dK is the intrinsics matrix derivative
+    Matrix33d dK_K_inv[KLayout::NUM_ARGS];
+    for (int j = 0; j < KLayout::NUM_ARGS; ++j)
+        dK_K_inv[j] = IntrinsicsDeriv(KLayout::Param(j)) * K_inv;
+
+    Matrix33d dM[MAX_VIEW_ARGS];
+    double derivs_x[MAX_VIEW_ARGS], derivs_y[MAX_VIEW_ARGS];
 
     int pos = 0;
-    for (MatchesCollection::const_iterator view = matches_->begin();
-         view != matches_->end(); ++view)
-    {
-        int img_from = view->first.first;
-        const vector<KeyPoint> &kps_from = features_->find(img_from)->second->keypoints;
-        Mat_<double> rvec_from(1, 3);
-        if (Rs_indices_inv_[img_from] > 0) {
-            rvec_from(0, 0) = arg_(0, 5 + 3 * (Rs_indices_inv_[img_from] - 1));
-            rvec_from(0, 1) = arg_(0, 5 + 3 * (Rs_indices_inv_[img_from] - 1) + 1);
-            rvec_from(0, 2) = arg_(0, 5 + 3 * (Rs_indices_inv_[img_from] - 1) + 2);
-        }
-        else
-            rvec_from.setTo(0);
-        Mat R_from;
-        Rodrigues(rvec_from, R_from);
+    for (size_t v = 0; v < views_.size(); ++v) {
+        MatchesCollection::const_iterator view = views_[v];
 
+        int img_from = view->first.first;
         int img_to = view->first.second;
+        const vector<KeyPoint> &kps_from = features_->find(img_from)->second->keypoints;
         const vector<KeyPoint> &kps_to = features_->find(img_to)->second->keypoints;
-        Mat_<double> rvec_to(1, 3);
-        if (Rs_indices_inv_[img_to] > 0) {
-            rvec_to(0, 0) = arg_(0, 5 + 3 * (Rs_indices_inv_[img_to] - 1));
-            rvec_to(0, 1) = arg_(0, 5 + 3 * (Rs_indices_inv_[img_to] - 1) + 1);
-            rvec_to(0, 2) = arg_(0, 5 + 3 * (Rs_indices_inv_[img_to] - 1) + 2);
+
+        Matrix33d R_from, dR_from[3], R_to, dR_to[3];
+        int offset_from = ExtractRotation(arg_, img_from, R_from, dR_from);
+        int offset_to = ExtractRotation(arg_, img_to, R_to, dR_to);
+
+        Matrix33d M = K * R_from * R_to.t() * K_inv;
+
+        // Derivatives of M = K * R_from * R_to.t() * K.inv() with respect to the view
+        // parameters, in the order of the residual block arguments
+
+        int num_cols = 0;
+        for (int j = 0; j < KLayout::NUM_ARGS; ++j) {
+            if (KLayout::IsRefined(j, params_to_refine_))
+                dM[num_cols++] = dK_K_inv[j] * M - M * dK_K_inv[j];
+        }
+        if (offset_from != -1) {
+            for (int i = 0; i < 3; ++i)
+                dM[num_cols++] = K * dR_from[i] * R_to.t() * K_inv;
+        }
+        if (offset_to != -1) {
+            for (int i = 0; i < 3; ++i)
+                dM[num_cols++] = K * R_from * dR_to[i].t() * K_inv;
         }
-        else
-            rvec_to.setTo(0);
-        Mat R_to;
-        Rodrigues(rvec_to, R_to);
 
-        Mat_<double> M = K * R_from * R_to.t() * K_inv;
+        // Rows are evaluated for the maximal number of view arguments, so the loop length
+        // is known at compile time, while the writer reads the block arguments only
+        for (int j = num_cols; j < MAX_VIEW_ARGS; ++j)
+            dM[j] = Matrix33d();
+
+        writer.BeginBlock(blocks_[v].args);
 
         const vector<DMatch> &matches = *(view->second);
         for (size_t i = 0; i < matches.size(); ++i, ++pos) {
@@ -285,101 +1391,216 @@ void ReprojError_KR::operator()(const Mat &arg, Mat &err) {
             double x = M(0, 0) * p2.x + M(0, 1) * p2.y + M(0, 2);
             double y = M(1, 0) * p2.x + M(1, 1) * p2.y + M(1, 2);
             double z = M(2, 0) * p2.x + M(2, 1) * p2.y + M(2, 2);
-            err_(2 * pos, 0) = p1.x - x / z;
-            err_(2 * pos + 1, 0) = p1.y - y / z;
-        }
-    }
-}
 
+            for (int j = 0; j < MAX_VIEW_ARGS; ++j) {
+                const Matrix33d &dM_ = dM[j];
+                double dx = dM_(0, 0) * p2.x + dM_(0, 1) * p2.y + dM_(0, 2);
+                double dy = dM_(1, 0) * p2.x + dM_(1, 1) * p2.y + dM_(1, 2);
+                double dz = dM_(2, 0) * p2.x + dM_(2, 1) * p2.y + dM_(2, 2);
+                derivs_x[j] = -(dx - x / z * dz) / z;
+                derivs_y[j] = -(dy - y / z * dz) / z;
+            }
 
-void ReprojError_KR::Jacobian(const Mat &arg, Mat &jac) {
-    Mat_<double> arg_(arg.clone());
+            writer.AddRow(2 * pos, p1.x - x / z, derivs_x);
+            writer.AddRow(2 * pos + 1, p1.y - y / z, derivs_y);
+        }
 
-    jac.create(dimension(), arg_.cols, CV_64F);
-    Mat_<double> jac_(jac);
-    jac_.setTo(0);
+        writer.EndBlock();
+    }
+}
 
-    // Maps argument index to the respective intrinsic parameter
-    static const int flags_tbl[] = {REFINE_FLAG_K_FX, REFINE_FLAG_K_SKEW, REFINE_FLAG_K_PPX,
-                                    REFINE_FLAG_K_FY, REFINE_FLAG_K_PPY};
 
-    for (int i = 0; i < arg_.cols; ++i) {
-        if (i > 4 || (params_to_refine_ & flags_tbl[i])) {
-            double val = arg_(0, i);
+/** Exposes a refinement functor via the internal interface tests and benchmarks use. */
+template <typename Func>
+class BlockwiseFuncAdapter : public internal::BlockwiseFunc {
+public:
+    explicit BlockwiseFuncAdapter(const Func &func) : func_(func) {}
 
-            arg_(0, i) += step_;
-            Mat tmp = jac_.col(i);
-            (*this)(arg_, tmp);
+    void operator()(const Mat &arg, Mat &err) { func_(arg, err); }
+    void Jacobian(const Mat &arg, Mat &jac) { func_.Jacobian(arg, jac); }
 
-            arg_(0, i) = val - step_;
-            (*this)(arg_, err_);
-            arg_(0, i) = val;
+    const vector<ResidualBlock>& residual_blocks() const { return func_.residual_blocks(); }
 
-            for (int j = 0; j < dimension(); ++j)
-                jac_(j, i) = (jac_(j, i) - err_(j, 0)) / (2 * step_);
-        }
+    void CalcResidualBlock(const Mat &arg, int block_idx, double *err) const {
+        func_.CalcResidualBlock(arg.ptr<double>(), block_idx, err);
     }
-}
 
-} // namespace
+    void CalcResidualBlockUncached(const Mat &arg, int block_idx, double *err) const {
+        func_.template CalcResidualBlock<double>(arg.ptr<double>(), block_idx, err);
+    }
 
+    int dimension() const { return func_.dimension(); }
 
-double RefineRigidCamera(InputOutputArray K, AbsoluteRotationMats Rs,
-                         const FeaturesCollection &features, const MatchesCollection &matches,
-                         int params_to_refine)
-{
-    CV_Assert(K.getMatRef().size() == Size(3, 3) && K.getMatRef().type() == CV_64F);
-    Mat_<double> K_(K.getMatRef());
+private:
+    Func func_;
+};
 
-    // Normalize rotations and compute indices
 
+/** Normalizes rotations, so the first one is the reference and stays fixed, and packs
+  * refined intrinsics followed by rotation vectors into the argument vector.
+  */
+template <int Flags>
+void PackRigidCameraArg(const double *K, AbsoluteRotationMats &Rs,
+                        typename ReprojError_KR<Flags>::Layout &layout, Mat_<double> &arg)
+{
     Mat R_norm = Rs.begin()->second.t();
-    vector<int> Rs_indices;
 
     for (AbsoluteRotationMats::iterator iter = Rs.begin(); iter != Rs.end(); ++iter) {
         CV_Assert(iter->second.size() == Size(3, 3) && iter->second.type() == CV_64F);
         iter->second = R_norm * iter->second;
-        Rs_indices.push_back(iter->first);
+        layout.AddBlock(iter->first, iter == Rs.begin());
     }
 
-    Mat_<double> arg(1, 5 + 3 * (int)Rs.size());
-    arg(0, 0) = K_(0, 0);
-    arg(0, 1) = K_(0, 1);
-    arg(0, 2) = K_(0, 2);
-    arg(0, 3) = K_(1, 1);
-    arg(0, 4) = K_(1, 2);
-    for (size_t i = 1; i < Rs_indices.size(); ++i) {
+    arg.create(1, layout.num_args());
+    ReprojError_KR<Flags>::KLayout::Pack(K, arg[0]);
+    for (AbsoluteRotationMats::iterator iter = Rs.begin(); iter != Rs.end(); ++iter) {
+        int offset = layout.Offset(iter->first);
+        if (offset == -1)
+            continue;
         Mat_<double> rvec;
-        Rodrigues(Rs.find(Rs_indices[i])->second, rvec);
-        arg(0, 5 + 3 * (i - 1)) = rvec(0, 0);
-        arg(0, 5 + 3 * (i - 1) + 1) = rvec(0, 1);
-        arg(0, 5 + 3 * (i - 1) + 2) = rvec(0, 2);
+        Rodrigues(iter->second, rvec);
+        arg(0, offset) = rvec(0, 0);
+        arg(0, offset + 1) = rvec(0, 1);
+        arg(0, offset + 2) = rvec(0, 2);
     }
+}
+
+
+/** Same as RefineRigidCamera(), but the intrinsics layout is specialized for the refine
+  * flags given at compile time.
+  */
+template <int Flags>
+double RefineRigidCameraImpl(Mat_<double> &K, AbsoluteRotationMats &Rs,
+                             const FeaturesCollection &features, const MatchesCollection &matches,
+                             int params_to_refine, const MinimizeOpts &opts)
+{
+    typedef typename ReprojError_KR<Flags>::KLayout KLayout;
+    typedef typename ReprojError_KR<Flags>::Layout Layout;
+
+    double K_params[] = {K(0, 0), K(0, 1), K(0, 2), K(1, 1), K(1, 2)};
 
-    ReprojError_KR func(features, matches, params_to_refine, Rs_indices);
-    double rms_error = MinimizeLevMarq(func, arg, MinimizeOpts::VERBOSE_SUMMARY);
+    Layout layout;
+    Mat_<double> arg;
+    PackRigidCameraArg<Flags>(K_params, Rs, layout, arg);
 
-    K_(0, 0) = arg(0, 0);
-    K_(0, 1) = arg(0, 1);
-    K_(0, 2) = arg(0, 2);
-    K_(1, 1) = arg(0, 3);
-    K_(1, 2) = arg(0, 4);
-    for (size_t i = 1; i < Rs_indices.size(); ++i) {
+    ReprojError_KR<Flags> func(features, matches, params_to_refine, K_params, layout,
+                               opts.jacobian_method(), opts.num_threads());
+
+    double rms_error;
+    if (opts.linear_solver() == MinimizeOpts::LINEAR_SOLVER_SCHUR)
+        rms_error = MinimizeLevMarqSchur(func, arg, Layout::NUM_COMMON, Layout::BLOCK_SIZE, opts);
+    else if (opts.linear_solver() == MinimizeOpts::LINEAR_SOLVER_DENSE_STREAMED) {
+        internal::DenseNormalEquations eqs(arg.cols);
+        rms_error = MinimizeLevMarqStreamed(func, arg, eqs, opts);
+    }
+    else if (opts.linear_solver() == MinimizeOpts::LINEAR_SOLVER_PCG) {
+        BlockJacobiPcgEquations eqs(Layout::NUM_COMMON, Layout::BLOCK_SIZE,
+                                    layout.num_free_blocks());
+        rms_error = MinimizeLevMarqStreamed(func, arg, eqs, opts);
+    }
+    else
+        rms_error = Minimize(func, arg, opts);
+
+    double K_refined[5];
+    KLayout::Unpack(arg[0], K_params, K_refined);
+    K(0, 0) = K_refined[0];
+    K(0, 1) = K_refined[1];
+    K(0, 2) = K_refined[2];
+    K(1, 1) = K_refined[3];
+    K(1, 2) = K_refined[4];
+    for (AbsoluteRotationMats::iterator iter = Rs.begin(); iter != Rs.end(); ++iter) {
+        int offset = layout.Offset(iter->first);
+        if (offset == -1)
+            continue;
         Mat_<double> rvec(1, 3);
-        rvec(0, 0) = arg(0, 5 + 3 * (i - 1));
-        rvec(0, 1) = arg(0, 5 + 3 * (i - 1) + 1);
-        rvec(0, 2) = arg(0, 5 + 3 * (i - 1) + 2);
-        Rodrigues(rvec, Rs.find(Rs_indices[i])->second);
+        rvec(0, 0) = arg(0, offset);
+        rvec(0, 1) = arg(0, offset + 1);
+        rvec(0, 2) = arg(0, offset + 2);
+        Rodrigues(rvec, iter->second);
     }
 
     return rms_error;
 }
 
+template <int Flags>
+Ptr<internal::BlockwiseFunc> CreateRigidCameraFuncImpl(
+        const double *K, AbsoluteRotationMats Rs, const FeaturesCollection &features,
+        const MatchesCollection &matches, int params_to_refine, const MinimizeOpts &opts,
+        Mat &arg)
+{
+    typename ReprojError_KR<Flags>::Layout layout;
+    Mat_<double> arg_;
+    PackRigidCameraArg<Flags>(K, Rs, layout, arg_);
+    arg = arg_;
+
+    return new BlockwiseFuncAdapter<ReprojError_KR<Flags> >(
+            ReprojError_KR<Flags>(features, matches, params_to_refine, K, layout,
+                                  opts.jacobian_method(), opts.num_threads()));
+}
+
+} // namespace
+
+
+double RefineRigidCamera(InputOutputArray K, AbsoluteRotationMats Rs,
+                         const FeaturesCollection &features, const MatchesCollection &matches,
+                         int params_to_refine, const MinimizeOpts &opts)
+{
+    CV_Assert(K.getMatRef().size() == Size(3, 3) && K.getMatRef().type() == CV_64F);
+    Mat_<double> K_(K.getMatRef());
+
+    // Common masks have fixed intrinsics dropped from the arguments at compile time
+    switch (params_to_refine & REFINE_FLAG_K_ALL) {
+    case REFINE_FLAG_K_ALL:
+        return RefineRigidCameraImpl<REFINE_FLAG_K_ALL>(
+                K_, Rs, features, matches, params_to_refine, opts);
+    case REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW:
+        return RefineRigidCameraImpl<REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW>(
+                K_, Rs, features, matches, params_to_refine, opts);
+    case REFINE_FLAG_K_FX | REFINE_FLAG_K_FY:
+        return RefineRigidCameraImpl<REFINE_FLAG_K_FX | REFINE_FLAG_K_FY>(
+                K_, Rs, features, matches, params_to_refine, opts);
+    default:
+        return RefineRigidCameraImpl<REFINE_FLAGS_RUNTIME>(
+                K_, Rs, features, matches, params_to_refine, opts);
+    }
+}
+
+
+namespace internal {
+
+Ptr<BlockwiseFunc> CreateRigidCameraFunc(
+        const Mat &K, const AbsoluteRotationMats &Rs, const FeaturesCollection &features,
+        const MatchesCollection &matches, int params_to_refine, const MinimizeOpts &opts,
+        Mat &arg)
+{
+    CV_Assert(K.size() == Size(3, 3) && K.type() == CV_64F);
+    Mat_<double> K_(K);
+    double K_params[] = {K_(0, 0), K_(0, 1), K_(0, 2), K_(1, 1), K_(1, 2)};
+
+    switch (params_to_refine & REFINE_FLAG_K_ALL) {
+    case REFINE_FLAG_K_ALL:
+        return CreateRigidCameraFuncImpl<REFINE_FLAG_K_ALL>(
+                K_params, Rs, features, matches, params_to_refine, opts, arg);
+    case REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW:
+        return CreateRigidCameraFuncImpl<REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW>(
+                K_params, Rs, features, matches, params_to_refine, opts, arg);
+    case REFINE_FLAG_K_FX | REFINE_FLAG_K_FY:
+        return CreateRigidCameraFuncImpl<REFINE_FLAG_K_FX | REFINE_FLAG_K_FY>(
+                K_params, Rs, features, matches, params_to_refine, opts, arg);
+    default:
+        return CreateRigidCameraFuncImpl<REFINE_FLAGS_RUNTIME>(
+                K_params, Rs, features, matches, params_to_refine, opts, arg);
+    }
+}
+
+} // namespace internal
+
 
 pair<Mat, Mat> ReconstructPointClouds(
         InputOutputArray P_l, InputOutputArray P_r,
         InputOutputArray xy_l0, InputOutputArray xy_r0, InputOutputArray xy_l1, InputOutputArray xy_r1,
-        const Ptr<vector<DMatch> > &matches_lr0, const Ptr<vector<DMatch> > &matches_lr1, const Ptr<vector<DMatch> > &matches_ll)
+        const Ptr<vector<DMatch> > &matches_lr0, const Ptr<vector<DMatch> > &matches_lr1, const Ptr<vector<DMatch> > &matches_ll,
+        OutputArray dists_ll)
 {
     CV_Assert(P_l.getMat().type() == CV_64F && P_l.getMat().size() == Size(4, 3));
     CV_Assert(P_r.getMat().type() == CV_64F && P_r.getMat().size() == Size(4, 3));
@@ -419,7 +1640,15 @@ pair<Mat, Mat> ReconstructPointClouds(
     // Leave only common part of point clouds
 
     vector<pair<int, int> > lr0_lr1_indices;
-    Intersect(*matches_lr0, *matches_lr1, *matches_ll, lr0_lr1_indices);
+    vector<int> ll_indices;
+    Intersect(*matches_lr0, *matches_lr1, *matches_ll, lr0_lr1_indices, &ll_indices);
+
+    if (dists_ll.needed()) {
+        Mat_<float> dists(1, (int)ll_indices.size());
+        for (size_t i = 0; i < ll_indices.size(); ++i)
+            dists(0, (int)i) = (*matches_ll)[ll_indices[i]].distance;
+        dists_ll.getMatRef() = dists;
+    }
 
     Mat_<double> xy_l0_buf(1, lr0_lr1_indices.size() * 2);
     Mat_<double> xy_r0_buf(1, lr0_lr1_indices.size() * 2);
@@ -509,7 +1738,8 @@ bool AffineRectifyStereoCameraByTwoShots(
         InputOutputArray xy_l0, InputOutputArray xy_r0, InputOutputArray xy_l1, InputOutputArray xy_r1,
         const Ptr<vector<DMatch> > &matches_lr0, const Ptr<vector<DMatch> > &matches_lr1, const Ptr<vector<DMatch> > &matches_ll,
         int num_iters, int subset_size, double thresh,
-        OutputArray H01, OutputArray xyzw0, OutputArray xyzw1)
+        OutputArray H01, OutputArray xyzw0, OutputArray xyzw1,
+        const SampleConsensusOpts &opts)
 {
     CV_Assert(P_l.getMat().type() == CV_64F && P_l.getMat().size() == Size(4, 3));
     CV_Assert(P_r.getMat().type() == CV_64F && P_r.getMat().size() == Size(4, 3));
@@ -520,7 +1750,8 @@ bool AffineRectifyStereoCameraByTwoShots(
     CV_Assert(xy_r1.getMat().type() == CV_64F && xy_r1.getMat().rows == 1 && xy_r1.getMat().cols % 2 == 0);
     CV_Assert(xy_l1.getMat().cols / 2 == xy_r1.getMat().cols / 2);
 
-    pair<Mat, Mat> clouds = ReconstructPointClouds(P_l, P_r, xy_l0, xy_r0, xy_l1, xy_r1, matches_lr0, matches_lr1, matches_ll);
+    Mat dists_ll;
+    pair<Mat, Mat> clouds = ReconstructPointClouds(P_l, P_r, xy_l0, xy_r0, xy_l1, xy_r1, matches_lr0, matches_lr1, matches_ll, dists_ll);
     Mat_<double> xyzw0_ = clouds.first, xyzw1_ = clouds.second;
 
     int num_points_common = xyzw0_.cols / 4;
@@ -530,7 +1761,8 @@ bool AffineRectifyStereoCameraByTwoShots(
     }
 
     AUTOCALIB_LOG(cout << "\nFinding H01 using " << num_points_common << " common points (point)...\n");       
-    Mat_<double> H01_ = FindHomographyP3Robust(xyzw0_, xyzw1_, P_l, P_r, xy_l1, xy_r1, num_iters, subset_size, thresh);
+    Mat_<double> H01_ = FindHomographyP3Robust(xyzw0_, xyzw1_, P_l, P_r, xy_l1, xy_r1, num_iters, subset_size, thresh,
+                                               dists_ll, opts);
 
     AUTOCALIB_LOG(cout << "\nFinding plane-at-infinity...\n");    
     Mat_<double> pinf = CalcPlaneAtInfinity(H01_);
@@ -547,34 +1779,113 @@ bool AffineRectifyStereoCameraByTwoShots(
 }
 
 
-double SymEpipDist2(double x1, double y1, const Mat F12, double x2, double y2) {
+double SymEpipDist2(double x1, double y1, const Mat &F12, double x2, double y2) {
     CV_Assert(F12.type() == CV_64F && F12.size() == Size(3, 3));
-    Mat_<double> F12_(F12);
+    const double *f0 = F12.ptr<double>(0);
+    const double *f1 = F12.ptr<double>(1);
+    const double *f2 = F12.ptr<double>(2);
 
-    double x2_ = F12_(0, 0) * x2 + F12_(0, 1) * y2 + F12_(0, 2);
-    double y2_ = F12_(1, 0) * x2 + F12_(1, 1) * y2 + F12_(1, 2);
-    double z2_ = F12_(2, 0) * x2 + F12_(2, 1) * y2 + F12_(2, 2);
+    double x2_ = f0[0] * x2 + f0[1] * y2 + f0[2];
+    double y2_ = f1[0] * x2 + f1[1] * y2 + f1[2];
+    double z2_ = f2[0] * x2 + f2[1] * y2 + f2[2];
 
-    double x1_ = F12_(0, 0) * x1 + F12_(1, 0) * y1 + F12_(2, 0);
-    double y1_ = F12_(0, 1) * x1 + F12_(1, 1) * y1 + F12_(2, 1);
+    double x1_ = f0[0] * x1 + f1[0] * y1 + f2[0];
+    double y1_ = f0[1] * x1 + f1[1] * y1 + f2[1];
 
     return sqr(x1 * x2_ + y1 * y2_ + z2_) * (1 / (x1_ * x1_ + y1_ * y1_) +
                                              1 / (x2_ * x2_ + y2_ * y2_));
 }
 
 
+void SymEpipDist2(const double *x1, const double *y1, const Mat &F12,
+                  const double *x2, const double *y2, int count, double *dist)
+{
+    CV_Assert(F12.type() == CV_64F && F12.size() == Size(3, 3));
+    CV_Assert(count >= 0);
+
+    double F[9];
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            F[3 * i + j] = F12.at<double>(i, j);
+
+    int i = 0;
+#ifdef AUTOCALIB_HAVE_AVX
+    if (checkHardwareSupport(CV_CPU_AVX)) {
+        i = simd::SymEpipDist2_AVX(x1, y1, F, x2, y2, count, dist);
+    }
+    else
+#endif
+    {
+#ifdef AUTOCALIB_HAVE_SSE2
+        if (checkHardwareSupport(CV_CPU_SSE2))
+            i = simd::SymEpipDist2_SSE2(x1, y1, F, x2, y2, count, dist);
+#endif
+    }
+
+    Mat F_(3, 3, CV_64F, F);
+    for (; i < count; ++i)
+        dist[i] = SymEpipDist2(x1[i], y1[i], F_, x2[i], y2[i]);
+}
+
+
+void SymEpipDist2(const float *x1, const float *y1, const Mat &F12,
+                  const float *x2, const float *y2, int count, float *dist)
+{
+    CV_Assert(F12.type() == CV_64F && F12.size() == Size(3, 3));
+    CV_Assert(count >= 0);
+
+    float F[9];
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            F[3 * i + j] = (float)F12.at<double>(i, j);
+
+    int i = 0;
+#ifdef AUTOCALIB_HAVE_AVX
+    if (checkHardwareSupport(CV_CPU_AVX)) {
+        i = simd::SymEpipDist2_AVX(x1, y1, F, x2, y2, count, dist);
+    }
+    else
+#endif
+    {
+#ifdef AUTOCALIB_HAVE_SSE2
+        if (checkHardwareSupport(CV_CPU_SSE2))
+            i = simd::SymEpipDist2_SSE2(x1, y1, F, x2, y2, count, dist);
+#endif
+    }
+
+    for (; i < count; ++i) {
+        float x2_ = F[0] * x2[i] + F[1] * y2[i] + F[2];
+        float y2_ = F[3] * x2[i] + F[4] * y2[i] + F[5];
+        float z2_ = F[6] * x2[i] + F[7] * y2[i] + F[8];
+
+        float x1_ = F[0] * x1[i] + F[3] * y1[i] + F[6];
+        float y1_ = F[1] * x1[i] + F[4] * y1[i] + F[7];
+
+        float s = x1[i] * x2_ + y1[i] * y2_ + z2_;
+        dist[i] = s * s * (1 / (x1_ * x1_ + y1_ * y1_) + 1 / (x2_ * x2_ + y2_ * y2_));
+    }
+}
+
+
 namespace {
 
+/** Number of correspondences gathered on the stack before calling batched SymEpipDist2(). */
+const int kEpipDistBatchSize = 256;
+
 class EpipError_KRT_RelativeOnly {
 public:
     EpipError_KRT_RelativeOnly(
             const FeaturesCollection &features,
             const MatchesCollection &matches,
-            int params_to_refine)
+            int params_to_refine,
+            int jacobian_method = MinimizeOpts::JACOBIAN_ANALYTIC,
+            int num_threads = 1)
         : features_(&features),
           matches_(&matches),
           step_(1e-4),
-          params_to_refine_(params_to_refine)
+          params_to_refine_(params_to_refine),
+          jacobian_method_(jacobian_method),
+          num_threads_(num_threads)
     {
         num_matches_ = 0;
         for (MatchesCollection::const_iterator iter = matches_->begin();
@@ -583,11 +1894,31 @@ public:
             if (IsLeftRightPair(iter->first.first, iter->first.second))
                 num_matches_ += (int)iter->second->size();
         }
+
+        // Maps argument index to the respective intrinsic parameter
+        static const int flags_tbl[] = {REFINE_FLAG_K_FX, REFINE_FLAG_K_SKEW, REFINE_FLAG_K_PPX,
+                                        REFINE_FLAG_K_FY, REFINE_FLAG_K_PPY};
+
+        // All residuals depend on all the arguments
+        blocks_.push_back(ResidualBlock(0, num_matches_));
+        for (int i = 0; i < 11; ++i) {
+            if (i > 4 || (params_to_refine_ & flags_tbl[i]))
+                blocks_[0].args.push_back(i);
+        }
     }
 
     void operator()(const Mat &arg, Mat &err);
     void Jacobian(const Mat &arg, Mat &jac);
 
+    const vector<ResidualBlock>& residual_blocks() const { return blocks_; }
+
+    void CalcResidualBlock(const Mat &arg, int block_idx, double *err) {
+        CalcResidualBlock(arg.ptr<double>(), block_idx, err);
+    }
+
+    template <typename T>
+    void CalcResidualBlock(const T *arg, int block_idx, T *err);
+
     int dimension() const { return num_matches_; }
 
 private:
@@ -595,39 +1926,27 @@ private:
     const MatchesCollection *matches_;
     int num_matches_;
     int params_to_refine_;
+    int jacobian_method_;
+    int num_threads_;
+    vector<ResidualBlock> blocks_;
 
     const double step_;
-    Mat_<double> err_;
 };
 
 
 void EpipError_KRT_RelativeOnly::operator()(const Mat &arg, Mat &err) {
-    Mat_<double> arg_(arg);
-
+    CV_Assert(arg.isContinuous());
     err.create(dimension(), 1, CV_64F);
-    Mat_<double> err_(err);
-
-    Mat_<double> K = Mat::eye(3, 3, CV_64F);
-    K(0, 0) = arg_(0, 0);
-    K(0, 1) = arg_(0, 1);
-    K(0, 2) = arg_(0, 2);
-    K(1, 1) = arg_(0, 3);
-    K(1, 2) = arg_(0, 4);
-    Mat K_inv = K.inv();
-
-    Mat_<double> rvec_rel(1, 3);
-    rvec_rel(0, 0) = arg_(0, 5);
-    rvec_rel(0, 1) = arg_(0, 6);
-    rvec_rel(0, 2) = arg_(0, 7);
-    Mat R_rel;
-    Rodrigues(rvec_rel, R_rel);
-
-    Mat_<double> T_rel(3, 1);
-    T_rel(0, 0) = arg_(0, 8);
-    T_rel(1, 0) = arg_(0, 9);
-    T_rel(2, 0) = arg_(0, 10);
-
-    Mat_<double> F_rel = K_inv.t() * CrossProductMat(T_rel) * R_rel * K_inv;
+    CV_Assert(err.isContinuous());
+    CalcResidualBlock(arg.ptr<double>(), 0, err.ptr<double>());
+}
+
+
+template <typename T>
+void EpipError_KRT_RelativeOnly::CalcResidualBlock(const T *arg, int /*block_idx*/, T *err) {
+    autodiff::Matrix33<T> K_inv = IntrinsicsInv(arg);
+    autodiff::Matrix33<T> R_rel = autodiff::RodriguesToMatrix33(arg + 5);
+    autodiff::Matrix33<T> F_rel = K_inv.t() * autodiff::CrossProductMatrix33(arg + 8) * R_rel * K_inv;
 
     int pos = 0;
     for (MatchesCollection::const_iterator iter = matches_->begin();
@@ -636,317 +1955,758 @@ void EpipError_KRT_RelativeOnly::operator()(const Mat &arg, Mat &err) {
         int from = iter->first.first;
         int to = iter->first.second;
 
-        const vector<KeyPoint> &kps_from = features_->find(from)->second->keypoints;
-        const vector<KeyPoint> &kps_to = features_->find(to)->second->keypoints;
+        if (IsLeftRightPair(from, to)) {
+            const vector<KeyPoint> &kps_from = features_->find(from)->second->keypoints;
+            const vector<KeyPoint> &kps_to = features_->find(to)->second->keypoints;
+
+            const vector<DMatch> &matches = *(iter->second);
+            for (size_t i = 0; i < matches.size(); ++i) {
+                const Point2f &p0 = kps_from[matches[i].queryIdx].pt;
+                const Point2f &p1 = kps_to[matches[i].trainIdx].pt;
+                err[pos++] = SymEpipDist(p1.x, p1.y, F_rel, p0.x, p0.y);
+            }
+        }
+    }
+}
+
+
+void EpipError_KRT_RelativeOnly::Jacobian(const Mat &arg, Mat &jac) {
+    if (jacobian_method_ == MinimizeOpts::JACOBIAN_NUMERIC)
+        CalcJacobianBlockwise(*this, arg, jac, step_, num_threads_);
+    else
+        CalcJacobianAutoDiff<11>(*this, arg, jac);
+}
+
+} // namespace
+
+
+double RefineStereoCamera(RigidCamera &cam, const FeaturesCollection &features,
+                          const MatchesCollection &matches, int params_to_refine,
+                          const MinimizeOpts &opts)
+{
+    Mat_<double> arg(1, 5/*K*/ + 3/*R*/ + 3/*T*/);
+
+    Mat_<double> K(cam.K());
+    arg(0, 0) = K(0, 0);
+    arg(0, 1) = K(0, 1);
+    arg(0, 2) = K(0, 2);
+    arg(0, 3) = K(1, 1);
+    arg(0, 4) = K(1, 2);
+
+    Mat_<double> rvec;
+    Rodrigues(cam.R(), rvec);
+    arg(0, 5) = rvec(0, 0);
+    arg(0, 6) = rvec(0, 1);
+    arg(0, 7) = rvec(0, 2);
+
+    Mat_<double> T(cam.T());
+    arg(0, 8) = T(0, 0);
+    arg(0, 9) = T(1, 0);
+    arg(0, 10) = T(2, 0);
+
+    EpipError_KRT_RelativeOnly func(features, matches, params_to_refine, opts.jacobian_method(),
+                                    opts.num_threads());
+    double rms_error = Minimize(func, arg, opts);
+
+    K(0, 0) = arg(0, 0);
+    K(0, 1) = arg(0, 1);
+    K(0, 2) = arg(0, 2);
+    K(1, 1) = arg(0, 3);
+    K(1, 2) = arg(0, 4);
+
+    rvec(0, 0) = arg(0, 5);
+    rvec(0, 1) = arg(0, 6);
+    rvec(0, 2) = arg(0, 7);
+
+    T(0, 0) = arg(0, 8);
+    T(1, 0) = arg(0, 9);
+    T(2, 0) = arg(0, 10);
+
+    Mat R;
+    Rodrigues(rvec, R);
+    cam = RigidCamera(K, R, T);
+
+    return rms_error;
+}
+
+
+namespace {
+
+/** Computes derivatives of the symmetric point-to-epipolar distance, i.e. square root of
+  * SymEpipDist2(), with respect to the fundamental matrix elements.
+  *
+  * \param F12 Fundamental matrix, row-major
+  * \param dF12 Output derivatives, row-major
+  * \return Symmetric point-to-epipolar distance
+  */
+template <typename T>
+T SymEpipDistDerivF(T x1, T y1, const T *F12, T x2, T y2, T *dF12) {
+    // Epipolar lines in the first and in the second images
+    T l1x = F12[0] * x2 + F12[1] * y2 + F12[2];
+    T l1y = F12[3] * x2 + F12[4] * y2 + F12[5];
+    T l1z = F12[6] * x2 + F12[7] * y2 + F12[8];
+    T l2x = F12[0] * x1 + F12[3] * y1 + F12[6];
+    T l2y = F12[1] * x1 + F12[4] * y1 + F12[7];
+
+    T n1 = l1x * l1x + l1y * l1y;
+    T n2 = l2x * l2x + l2y * l2y;
+    T s = x1 * l1x + y1 * l1y + l1z;
+
+    // dist = |s| * sqrt(w), where w = 1 / n1 + 1 / n2
+    T sqrt_w = std::sqrt(1 / n1 + 1 / n2);
+    T coef_s = s >= 0 ? sqrt_w : -sqrt_w;
+    T coef_w = std::abs(s) / sqrt_w;
+
+    const T p1[] = {x1, y1, 1};
+    const T p2[] = {x2, y2, 1};
+    const T l1[] = {l1x / (n1 * n1), l1y / (n1 * n1), 0};
+    const T l2[] = {l2x / (n2 * n2), l2y / (n2 * n2), 0};
+
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            dF12[3 * i + j] = coef_s * p1[i] * p2[j] - coef_w * (l1[i] * p2[j] + l2[j] * p1[i]);
+
+    return std::abs(s) * sqrt_w;
+}
+
+
+/** Computes the derivative of F = K_inv.t() * E * K_inv with respect to an intrinsic
+  * parameter.
+  *
+  * \param dK_K_inv Product dK * K_inv, where dK is the intrinsics matrix derivative
+  */
+inline autodiff::Matrix33<double> FundamentalMatDerivK(const autodiff::Matrix33<double> &F,
+                                                       const autodiff::Matrix33<double> &dK_K_inv)
+{
+    return autodiff::Matrix33<double>() - dK_K_inv.t() * F - F * dK_K_inv;
+}
+
+
+/** Computes product of a 3x3 matrix and a 3-vector. */
+inline void Multiply(const autodiff::Matrix33<double> &M, const double *vec, double *res) {
+    for (int i = 0; i < 3; ++i)
+        res[i] = M(i, 0) * vec[0] + M(i, 1) * vec[1] + M(i, 2) * vec[2];
+}
+
+
+/** \return Sum of element-wise products of row-major 3x3 matrices */
+template <typename T>
+inline T DotProduct3x3(const T *a, const T *b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] +
+           a[3] * b[3] + a[4] * b[4] + a[5] * b[5] +
+           a[6] * b[6] + a[7] * b[7] + a[8] * b[8];
+}
+
+
+/** Symmetric epipolar distances of a stereo camera. Arguments are refined intrinsics,
+  * rotation vector and translation of the right camera relative to the left one, followed
+  * by motions (rotation vector and translation) of stereo pairs.
+  *
+  * \tparam Flags Refine flags the intrinsics layout is specialized for, see IntrinsicsLayout
+  */
+template <int Flags>
+class EpipError_KRT {
+public:
+    typedef IntrinsicsLayout<Flags> KLayout;
+
+    /** Index of the first argument of the right camera motion relative to the left one */
+    enum { REL_MOTION_ARG = KLayout::NUM_ARGS };
+
+    /** Refined intrinsics and the relative motion followed by motions of stereo pairs. */
+    typedef ParamBlockLayout<KLayout::NUM_ARGS + 6, 6> Layout;
+
+    /** \param K Intrinsic parameters (fx, skew, ppx, fy, ppy order), fixed ones keep these
+      *          values
+      */
+    EpipError_KRT(
+            const FeaturesCollection &features,
+            const MatchesCollection &matches,
+            const RelativeConfidences &rel_confs,
+            const double *K,
+            const Layout &layout,
+            int params_to_refine,
+            int jacobian_method = MinimizeOpts::JACOBIAN_ANALYTIC,
+            int num_threads = 1,
+            int precision = MinimizeOpts::PRECISION_DOUBLE)
+        : layout_(layout),
+          params_to_refine_(params_to_refine),
+          jacobian_method_(jacobian_method),
+          num_threads_(num_threads),
+          precision_(precision),
+          step_(1e-4)
+    {
+        std::copy(K, K + 5, K_fixed_);
+
+        vector<int> args_K;
+        for (int i = 0; i < KLayout::NUM_ARGS; ++i) {
+            if (KLayout::IsRefined(i, params_to_refine_))
+                args_K.push_back(i);
+        }
+
+        num_matches_ = 0;
+        for (MatchesCollection::const_iterator iter = matches.begin(); iter != matches.end(); ++iter) {
+            int from = iter->first.first;
+            int to = iter->first.second;
+
+            ResidualBlock block(num_matches_, (int)iter->second->size());
+            block.args = args_K;
+            View view;
+
+            if (BothAreLeft(from, to) && layout_.Contains(from / 2) && layout_.Contains(to / 2)) {
+                view.from_pair = from / 2;
+                view.to_pair = to / 2;
+
+                int pairs[] = {from / 2, to / 2};
+                for (int i = 0; i < 2; ++i) {
+                    int offset = layout_.Offset(pairs[i]);
+                    if (offset != -1) {
+                        for (int j = 0; j < Layout::BLOCK_SIZE; ++j)
+                            block.args.push_back(offset + j);
+                    }
+                }
+            }
+            else if (IsLeftRightPair(from, to)) {
+                view.from_pair = view.to_pair = -1;
+                for (int i = 0; i < 6; ++i)
+                    block.args.push_back(REL_MOTION_ARG + i);
+            }
+            else
+                continue;
+
+            double conf = 1;
+            if (!rel_confs.empty()) {
+                RelativeConfidences::const_iterator conf_iter = rel_confs.find(iter->first);
+                CV_Assert(conf_iter != rel_confs.end());
+                conf = std::max(0., conf_iter->second);
+            }
+
+            // Flatten correspondences, so residuals are computed without any lookups
+
+            const vector<KeyPoint> &kps_from = features.find(from)->second->keypoints;
+            const vector<KeyPoint> &kps_to = features.find(to)->second->keypoints;
+
+            const vector<DMatch> &view_matches = *(iter->second);
+            for (size_t i = 0; i < view_matches.size(); ++i) {
+                const Point2f &p0 = kps_from[view_matches[i].queryIdx].pt;
+                const Point2f &p1 = kps_to[view_matches[i].trainIdx].pt;
+                x0_.push_back(p0.x);
+                y0_.push_back(p0.y);
+                x1_.push_back(p1.x);
+                y1_.push_back(p1.y);
+                weights_.push_back(conf);
+            }
+
+            views_.push_back(view);
+            blocks_.push_back(block);
+            num_matches_ += block.num_rows;
+        }
+
+        // Keypoints are floats, so these are exact copies
+        if (precision_ == MinimizeOpts::PRECISION_MIXED) {
+            x0f_.assign(x0_.begin(), x0_.end());
+            y0f_.assign(y0_.begin(), y0_.end());
+            x1f_.assign(x1_.begin(), x1_.end());
+            y1f_.assign(y1_.begin(), y1_.end());
+        }
+    }
+
+    void operator()(const Mat &arg, Mat &err);
+    void Jacobian(const Mat &arg, Mat &jac);
+
+    /** Streams closed-form Jacobian rows grouped by views, see DenseJacobianWriter. */
+    template <typename Writer>
+    void EvalJacobian(const Mat &arg, Writer &writer) const;
+
+    /** Each residual block corresponds to a view. */
+    const vector<ResidualBlock>& residual_blocks() const { return blocks_; }
+
+    void CalcResidualBlock(const Mat &arg, int block_idx, double *err) {
+        CalcResidualBlock(arg.ptr<double>(), block_idx, err);
+    }
+
+    template <typename T>
+    void CalcResidualBlock(const T *arg, int block_idx, T *err) const;
+
+    /** Same as above, but reuses per-view matrices cached by Jacobian() when the view
+      * arguments coincide with the cached ones.
+      */
+    void CalcResidualBlock(const double *arg, int block_idx, double *err) const;
+
+    int dimension() const { return num_matches_; }
+
+private:
+    /** Gathers intrinsic parameters (fx, skew, ppx, fy, ppy order) from the arguments. */
+    template <typename T>
+    void UnpackIntrinsics(const T *arg, T *K) const { KLayout::Unpack(arg, K_fixed_, K); }
+
+    /** Computes the essential matrix of a view. It doesn't depend on intrinsics. */
+    template <typename T>
+    autodiff::Matrix33<T> CalcEssentialMat(const T *arg, int view_idx) const;
+
+    /** Caches per-view matrices, so perturbing an argument while computing the numeric
+      * Jacobian recomputes only what depends on it.
+      */
+    void UpdateCache(const Mat &arg);
+
+    /** Extracts a stereo pair motion from the argument vector.
+      *
+      * \param dR Rotation matrix derivatives with respect to the rotation vector
+      * \return Index of the first motion parameter in the argument vector,
+      *         or -1 if the motion is fixed (the reference pair)
+      */
+    int ExtractMotion(const double *arg, int pair_idx, autodiff::Matrix33<double> &R,
+                      autodiff::Matrix33<double> dR[3], double *tvec) const;
+
+    /** Same as above, but doesn't compute derivatives. */
+    template <typename T>
+    void ExtractMotion(const T *arg, int pair_idx, autodiff::Matrix33<T> &R, T *tvec) const;
+
+    template <typename T>
+    void CalcViewErr(const autodiff::Matrix33<T> &F, int view_idx, T *err) const;
+
+    /** Same as above, but evaluates distances in float when mixed precision is enabled. */
+    void CalcViewErr(const autodiff::Matrix33<double> &F, int view_idx, double *err) const;
+
+    /** Streams Jacobian rows of a view in the precision the function is configured with.
+      *
+      * \tparam NumCols Number of derivatives evaluated per row, it's known at compile time
+      *                 and isn't less than the number of the block arguments
+      * \param F Fundamental matrix of the view
+      * \param dF Fundamental matrix derivatives with respect to the view arguments,
+      *           zero ones pad them up to NumCols
+      */
+    template <int NumCols, typename Writer>
+    void EvalViewRows(const autodiff::Matrix33<double> &F, const autodiff::Matrix33<double> *dF,
+                      int view_idx, Writer &writer) const;
+
+    /** Same as above, but in precision T. */
+    template <int NumCols, typename T, typename Writer>
+    void EvalViewRows(const autodiff::Matrix33<double> &F, const autodiff::Matrix33<double> *dF,
+                      int view_idx, const T *x0, const T *y0, const T *x1, const T *y1,
+                      Writer &writer) const;
+
+    /** Pair of matched frames. */
+    struct View {
+        /** Stereo pair indices of a left-left view, -1 for a left-right one */
+        int from_pair;
+        int to_pair;
+    };
+
+    int num_matches_;
+    Layout layout_;
+    int params_to_refine_;
+    int jacobian_method_;
+    int num_threads_;
+    int precision_;
+
+    vector<View> views_;
+    vector<ResidualBlock> blocks_;
+
+    // Values of fixed intrinsics
+    double K_fixed_[5];
+
+    // Correspondences of all the views in the residuals order
+    vector<double> x0_, y0_;
+    vector<double> x1_, y1_;
+    vector<double> weights_;
+
+    // Single precision copies of the above correspondences, used in mixed precision only
+    vector<float> x0f_, y0f_;
+    vector<float> x1f_, y1f_;
+
+    // Matrices at the argument of the last numeric Jacobian
+    vector<double> cached_arg_;
+    vector<autodiff::Matrix33<double> > cached_E_;
+    vector<autodiff::Matrix33<double> > cached_F_;
+
+    const double step_;
+};
+
+
+template <int Flags>
+void EpipError_KRT<Flags>::operator()(const Mat &arg, Mat &err) {
+    CV_Assert(arg.isContinuous());
+    const double *arg_ = arg.ptr<double>();
+
+    err.create(dimension(), 1, CV_64F);
+    CV_Assert(err.isContinuous());
+    double *err_ = err.ptr<double>();
+
+    double K[5];
+    UnpackIntrinsics(arg_, K);
+    autodiff::Matrix33<double> K_inv = IntrinsicsInv(K);
+    autodiff::Matrix33<double> R_rel = autodiff::RodriguesToMatrix33(arg_ + REL_MOTION_ARG);
+    autodiff::Matrix33<double> F_rel = K_inv.t() *
+                                       autodiff::CrossProductMatrix33(arg_ + REL_MOTION_ARG + 3) *
+                                       R_rel * K_inv;
+
+    for (size_t i = 0; i < views_.size(); ++i) {
+        if (blocks_[i].num_rows == 0)
+            continue;
+        if (views_[i].from_pair == -1)
+            CalcViewErr(F_rel, (int)i, err_ + blocks_[i].row);
+        else
+            CalcViewErr(K_inv.t() * CalcEssentialMat(arg_, (int)i) * K_inv, (int)i,
+                        err_ + blocks_[i].row);
+    }
+}
+
+
+template <int Flags>
+template <typename T>
+void EpipError_KRT<Flags>::CalcResidualBlock(const T *arg, int block_idx, T *err) const {
+    T K[5];
+    UnpackIntrinsics(arg, K);
+    autodiff::Matrix33<T> K_inv = IntrinsicsInv(K);
+    CalcViewErr(K_inv.t() * CalcEssentialMat(arg, block_idx) * K_inv, block_idx, err);
+}
+
+
+template <int Flags>
+void EpipError_KRT<Flags>::CalcResidualBlock(const double *arg, int block_idx,
+                                             double *err) const
+{
+    if (cached_arg_.empty()) {
+        CalcResidualBlock<double>(arg, block_idx, err);
+        return;
+    }
+
+    bool same_K = true;
+    for (int i = 0; i < KLayout::NUM_ARGS; ++i)
+        same_K = same_K && arg[i] == cached_arg_[i];
+
+    bool same_E = true;
+    const vector<int> &args = blocks_[block_idx].args;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] >= KLayout::NUM_ARGS)
+            same_E = same_E && arg[args[i]] == cached_arg_[args[i]];
+    }
+
+    if (same_K && same_E) {
+        CalcViewErr(cached_F_[block_idx], block_idx, err);
+        return;
+    }
+
+    double K[5];
+    UnpackIntrinsics(arg, K);
+    autodiff::Matrix33<double> K_inv = IntrinsicsInv(K);
+    autodiff::Matrix33<double> E = same_E ? cached_E_[block_idx]
+                                          : CalcEssentialMat(arg, block_idx);
+    CalcViewErr(K_inv.t() * E * K_inv, block_idx, err);
+}
 
-        if (IsLeftRightPair(from, to)) {
-            const vector<DMatch> &matches = *(iter->second);
-            for (size_t i = 0; i < matches.size(); ++i) {
-                const Point2f &p0 = kps_from[matches[i].queryIdx].pt;
-                const Point2f &p1 = kps_to[matches[i].trainIdx].pt;
-                err_(pos++, 0) = sqrt(SymEpipDist2(p1.x, p1.y, F_rel, p0.x, p0.y));
-            }
-        }
+
+template <int Flags>
+void EpipError_KRT<Flags>::UpdateCache(const Mat &arg) {
+    CV_Assert(arg.isContinuous());
+    const double *arg_ = arg.ptr<double>();
+
+    cached_arg_.assign(arg_, arg_ + arg.cols);
+    cached_E_.resize(views_.size());
+    cached_F_.resize(views_.size());
+
+    double K[5];
+    UnpackIntrinsics(arg_, K);
+    autodiff::Matrix33<double> K_inv = IntrinsicsInv(K);
+    for (size_t i = 0; i < views_.size(); ++i) {
+        cached_E_[i] = CalcEssentialMat(arg_, (int)i);
+        cached_F_[i] = K_inv.t() * cached_E_[i] * K_inv;
     }
 }
 
 
-void EpipError_KRT_RelativeOnly::Jacobian(const Mat &arg, Mat &jac) {
-    Mat_<double> arg_(arg.clone());
+template <int Flags>
+template <typename T>
+autodiff::Matrix33<T> EpipError_KRT<Flags>::CalcEssentialMat(const T *arg, int view_idx) const {
+    const View &view = views_[view_idx];
 
-    jac.create(dimension(), arg_.cols, CV_64F);
-    Mat_<double> jac_(jac);
-    jac_.setTo(0);
+    if (view.from_pair == -1) {
+        autodiff::Matrix33<T> R_rel = autodiff::RodriguesToMatrix33(arg + REL_MOTION_ARG);
+        return autodiff::CrossProductMatrix33(arg + REL_MOTION_ARG + 3) * R_rel;
+    }
 
-    // Maps argument index to the respective intrinsic parameter
-    static const int flags_tbl[] = {REFINE_FLAG_K_FX, REFINE_FLAG_K_SKEW, REFINE_FLAG_K_PPX,
-                                    REFINE_FLAG_K_FY, REFINE_FLAG_K_PPY};
+    autodiff::Matrix33<T> R_from, R_to;
+    T T_from[3], T_to[3];
+    ExtractMotion(arg, view.from_pair, R_from, T_from);
+    ExtractMotion(arg, view.to_pair, R_to, T_to);
 
-    for (int i = 0; i < arg_.cols; ++i) {
-        if (i > 4 || (params_to_refine_ & flags_tbl[i])) {
-            double val = arg_(0, i);
+    // E = [R * T_from - T_to]x * R, where R = R_to * R_from.t()
+    autodiff::Matrix33<T> R = R_to * R_from.t();
+    T tvec[3];
+    for (int i = 0; i < 3; ++i)
+        tvec[i] = R(i, 0) * T_from[0] + R(i, 1) * T_from[1] + R(i, 2) * T_from[2] - T_to[i];
 
-            arg_(0, i) += step_;
-            Mat tmp = jac_.col(i);
-            (*this)(arg_, tmp);
+    return autodiff::CrossProductMatrix33(tvec) * R;
+}
 
-            arg_(0, i) = val - step_;
-            (*this)(arg_, err_);
-            arg_(0, i) = val;
 
-            for (int j = 0; j < dimension(); ++j)
-                jac_(j, i) = (jac_(j, i) - err_(j, 0)) / (2 * step_);
-        }
+template <int Flags>
+template <typename T>
+void EpipError_KRT<Flags>::ExtractMotion(const T *arg, int pair_idx, autodiff::Matrix33<T> &R,
+                                         T *tvec) const
+{
+    int offset = layout_.Offset(pair_idx);
+    if (offset == -1) {
+        R = autodiff::Matrix33<T>::eye();
+        tvec[0] = tvec[1] = tvec[2] = T(0);
+        return;
     }
-}
 
-} // namespace
+    const T *motion = arg + offset;
+    R = autodiff::RodriguesToMatrix33(motion);
+    tvec[0] = motion[3];
+    tvec[1] = motion[4];
+    tvec[2] = motion[5];
+}
 
 
-double RefineStereoCamera(RigidCamera &cam, const FeaturesCollection &features,
-                          const MatchesCollection &matches, int params_to_refine)
+template <int Flags>
+int EpipError_KRT<Flags>::ExtractMotion(const double *arg, int pair_idx,
+                                        autodiff::Matrix33<double> &R,
+                                        autodiff::Matrix33<double> dR[3], double *tvec) const
 {
-    Mat_<double> arg(1, 5/*K*/ + 3/*R*/ + 3/*T*/);
+    int offset = layout_.Offset(pair_idx);
+    if (offset == -1) {
+        R = autodiff::Matrix33<double>::eye();
+        tvec[0] = tvec[1] = tvec[2] = 0;
+        return -1;
+    }
 
-    Mat_<double> K(cam.K());
-    arg(0, 0) = K(0, 0);
-    arg(0, 1) = K(0, 1);
-    arg(0, 2) = K(0, 2);
-    arg(0, 3) = K(1, 1);
-    arg(0, 4) = K(1, 2);
+    const double *motion = arg + offset;
+    RodriguesToMatrix33(motion, R, dR);
+    tvec[0] = motion[3];
+    tvec[1] = motion[4];
+    tvec[2] = motion[5];
 
-    Mat_<double> rvec;
-    Rodrigues(cam.R(), rvec);
-    arg(0, 5) = rvec(0, 0);
-    arg(0, 6) = rvec(0, 1);
-    arg(0, 7) = rvec(0, 2);
+    return offset;
+}
 
-    Mat_<double> T(cam.T());
-    arg(0, 8) = T(0, 0);
-    arg(0, 9) = T(1, 0);
-    arg(0, 10) = T(2, 0);
 
-    EpipError_KRT_RelativeOnly func(features, matches, params_to_refine);
-    double rms_error = MinimizeLevMarq(func, arg, MinimizeOpts::VERBOSE_SUMMARY);
+template <int Flags>
+template <typename T>
+void EpipError_KRT<Flags>::CalcViewErr(const autodiff::Matrix33<T> &F, int view_idx,
+                                       T *err) const
+{
+    const ResidualBlock &block = blocks_[view_idx];
+    const double *x0 = &x0_[block.row], *y0 = &y0_[block.row];
+    const double *x1 = &x1_[block.row], *y1 = &y1_[block.row];
+    const double *weights = &weights_[block.row];
 
-    K(0, 0) = arg(0, 0);
-    K(0, 1) = arg(0, 1);
-    K(0, 2) = arg(0, 2);
-    K(1, 1) = arg(0, 3);
-    K(1, 2) = arg(0, 4);
+    SymEpipDistWeighted(x1, y1, F, x0, y0, weights, block.num_rows, err);
+}
 
-    rvec(0, 0) = arg(0, 5);
-    rvec(0, 1) = arg(0, 6);
-    rvec(0, 2) = arg(0, 7);
 
-    T(0, 0) = arg(0, 8);
-    T(1, 0) = arg(0, 9);
-    T(2, 0) = arg(0, 10);
+template <int Flags>
+void EpipError_KRT<Flags>::CalcViewErr(const autodiff::Matrix33<double> &F, int view_idx,
+                                       double *err) const
+{
+    if (precision_ != MinimizeOpts::PRECISION_MIXED) {
+        CalcViewErr<double>(F, view_idx, err);
+        return;
+    }
 
-    Mat R;
-    Rodrigues(rvec, R);
-    cam = RigidCamera(K, R, T);
+    const ResidualBlock &block = blocks_[view_idx];
+    Mat F_(3, 3, CV_64F, const_cast<double*>(&F(0, 0)));
+    float dist[kEpipDistBatchSize];
 
-    return rms_error;
+    for (int start = 0; start < block.num_rows; start += kEpipDistBatchSize) {
+        int pos = block.row + start;
+        int count = std::min(kEpipDistBatchSize, block.num_rows - start);
+        SymEpipDist2(&x1f_[pos], &y1f_[pos], F_, &x0f_[pos], &y0f_[pos], count, dist);
+        for (int i = 0; i < count; ++i)
+            err[start + i] = sqrt((double)dist[i]) * weights_[pos + i];
+    }
 }
 
 
-namespace {
-
-class EpipError_KRT {
-public:
-    EpipError_KRT(
-            const FeaturesCollection &features,
-            const MatchesCollection &matches,
-            const RelativeConfidences &rel_confs,
-            const vector<int> &motions_indices,
-            int params_to_refine)
-        : features_(&features),
-          matches_(&matches),
-          rel_confs_(&rel_confs),
-          step_(1e-4),
-          params_to_refine_(params_to_refine)
-    {
-        motions_indices_inv_.assign(*max_element(motions_indices.begin(), motions_indices.end()) + 1, -1);
-        for (size_t i = 0; i < motions_indices.size(); ++i)
-            motions_indices_inv_[motions_indices[i]] = i;
-
-        num_matches_ = 0;
-        for (MatchesCollection::const_iterator iter = matches_->begin(); iter != matches_->end(); ++iter) {
-            if ((BothAreLeft(iter->first.first, iter->first.second) &&
-                 iter->first.first / 2 < motions_indices_inv_.size() && motions_indices_inv_[iter->first.first / 2] != -1 &&
-                 iter->first.second / 2 < motions_indices_inv_.size() && motions_indices_inv_[iter->first.second / 2] != -1) ||
-                IsLeftRightPair(iter->first.first, iter->first.second))
-            {
-                num_matches_ += (int)iter->second->size();
-            }
-        }
+template <int Flags>
+void EpipError_KRT<Flags>::Jacobian(const Mat &arg, Mat &jac) {
+    if (jacobian_method_ == MinimizeOpts::JACOBIAN_NUMERIC) {
+        UpdateCache(arg);
+        CalcJacobianBlockwise(*this, arg, jac, step_, num_threads_);
+    }
+    else {
+        jac.create(dimension(), arg.cols, CV_64F);
+        jac.setTo(0);
+        DenseJacobianWriter writer(jac);
+        EvalJacobian(arg, writer);
     }
+}
 
-    void operator()(const Mat &arg, Mat &err);
-    void Jacobian(const Mat &arg, Mat &jac);
 
-    int dimension() const { return num_matches_; }
+template <int Flags>
+template <typename Writer>
+void EpipError_KRT<Flags>::EvalJacobian(const Mat &arg, Writer &writer) const {
+    typedef autodiff::Matrix33<double> Matrix33d;
 
-private:
-    const FeaturesCollection *features_;
-    const MatchesCollection *matches_;
-    const RelativeConfidences *rel_confs_;
-    int num_matches_;
-    vector<int> motions_indices_inv_;
-    int params_to_refine_;
+    // Left-right views depend on the intrinsics and the relative motion only, while
+    // left-left ones on the intrinsics and motions of both pairs, one can be fixed though
+    enum {
+        MAX_REL_VIEW_ARGS = KLayout::NUM_ARGS + 6,
+        MAX_VIEW_ARGS = KLayout::NUM_ARGS + 12
+    };
 
-    const double step_;
-    Mat_<double> err_;
-};
+    static const double unit_vecs[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
 
+    CV_Assert(arg.isContinuous());
+    const double *arg_ = arg.ptr<double>();
 
-void EpipError_KRT::operator()(const Mat &arg, Mat &err) {
-    Mat_<double> arg_(arg);
+    double K[5];
+    UnpackIntrinsics(arg_, K);
+    Matrix33d K_inv = IntrinsicsInv(K);
+    Matrix33d K_inv_t = K_inv.t();
 
-    err.create(dimension(), 1, CV_64F);
-    Mat_<double> err_(err);
-
-    Mat_<double> K = Mat::eye(3, 3, CV_64F);
-    K(0, 0) = arg_(0, 0);
-    K(0, 1) = arg_(0, 1);
-    K(0, 2) = arg_(0, 2);
-    K(1, 1) = arg_(0, 3);
-    K(1, 2) = arg_(0, 4);
-    Mat K_inv = K.inv();
-
-    Mat_<double> rvec_rel(1, 3);
-    rvec_rel(0, 0) = arg_(0, 5);
-    rvec_rel(0, 1) = arg_(0, 6);
-    rvec_rel(0, 2) = arg_(0, 7);
-    Mat R_rel;
-    Rodrigues(rvec_rel, R_rel);
-
-    Mat_<double> T_rel(3, 1);
-    T_rel(0, 0) = arg_(0, 8);
-    T_rel(1, 0) = arg_(0, 9);
-    T_rel(2, 0) = arg_(0, 10);
-
-    Mat_<double> F_rel = K_inv.t() * CrossProductMat(T_rel) * R_rel * K_inv;
+    // Products dK * K_inv, where dK is the intrinsics matrix derivative
+    Matrix33d dK_K_inv[KLayout::NUM_ARGS];
+    for (int j = 0; j < KLayout::NUM_ARGS; ++j)
+        dK_K_inv[j] = IntrinsicsDeriv(KLayout::Param(j)) * K_inv;
 
-    int pos = 0;
-    for (MatchesCollection::const_iterator iter = matches_->begin(); iter != matches_->end(); ++iter)
-    {
-        int from = iter->first.first;
-        int to = iter->first.second;
+    Matrix33d R_rel, dR_rel[3];
+    RodriguesToMatrix33(arg_ + REL_MOTION_ARG, R_rel, dR_rel);
+    Matrix33d T_rel = autodiff::CrossProductMatrix33(arg_ + REL_MOTION_ARG + 3);
+    Matrix33d F_rel = K_inv_t * T_rel * R_rel * K_inv;
 
-        const vector<KeyPoint> &kps_from = features_->find(from)->second->keypoints;
-        const vector<KeyPoint> &kps_to = features_->find(to)->second->keypoints;
+    // Derivatives are in the order of the residual block arguments, the rest are zero
 
-        double conf = 1;
-        if (!rel_confs_->empty()) {
-            RelativeConfidences::const_iterator conf_iter = rel_confs_->find(iter->first);
-            CV_Assert(conf_iter != rel_confs_->end());
-            conf = std::max(0., conf_iter->second);
-        }
+    Matrix33d dF_rel[MAX_REL_VIEW_ARGS];
+    int num_cols = 0;
+    for (int j = 0; j < KLayout::NUM_ARGS; ++j) {
+        if (KLayout::IsRefined(j, params_to_refine_))
+            dF_rel[num_cols++] = FundamentalMatDerivK(F_rel, dK_K_inv[j]);
+    }
+    for (int i = 0; i < 3; ++i)
+        dF_rel[num_cols++] = K_inv_t * T_rel * dR_rel[i] * K_inv;
+    for (int i = 0; i < 3; ++i)
+        dF_rel[num_cols++] = K_inv_t * autodiff::CrossProductMatrix33(unit_vecs[i]) * R_rel * K_inv;
 
-        if (BothAreLeft(iter->first.first, iter->first.second) &&
-            iter->first.first / 2 < motions_indices_inv_.size() && motions_indices_inv_[iter->first.first / 2] != -1 &&
-            iter->first.second / 2 < motions_indices_inv_.size() && motions_indices_inv_[iter->first.second / 2] != -1)
-        {
-            int from_ = from / 2;
-            int to_ = to / 2;
-
-            Mat_<double> rvec_from(1, 3);
-            if (motions_indices_inv_[from_] > 0) {
-                rvec_from(0, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[from_] - 1));
-                rvec_from(0, 1) = arg_(0, 11 + 6 * (motions_indices_inv_[from_] - 1) + 1);
-                rvec_from(0, 2) = arg_(0, 11 + 6 * (motions_indices_inv_[from_] - 1) + 2);
-            }
-            else
-                rvec_from.setTo(0);
-            Mat R_from;
-            Rodrigues(rvec_from, R_from);
-
-            Mat_<double> rvec_to(1, 3);
-            if (motions_indices_inv_[to_] > 0) {
-                rvec_to(0, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[to_] - 1));
-                rvec_to(0, 1) = arg_(0, 11 + 6 * (motions_indices_inv_[to_] - 1) + 1);
-                rvec_to(0, 2) = arg_(0, 11 + 6 * (motions_indices_inv_[to_] - 1) + 2);
-            }
-            else
-                rvec_to.setTo(0);
-            Mat R_to;
-            Rodrigues(rvec_to, R_to);
-
-            Mat_<double> T_from(3, 1);
-            if (motions_indices_inv_[from_] > 0) {
-                T_from(0, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[from_] - 1) + 3);
-                T_from(1, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[from_] - 1) + 4);
-                T_from(2, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[from_] - 1) + 5);
-            }
-            else
-                T_from.setTo(0);
+    Matrix33d dF[MAX_VIEW_ARGS];
 
-            Mat_<double> T_to(3, 1);
-            if (motions_indices_inv_[to_] > 0) {
-                T_to(0, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[to_] - 1) + 3);
-                T_to(1, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[to_] - 1) + 4);
-                T_to(2, 0) = arg_(0, 11 + 6 * (motions_indices_inv_[to_] - 1) + 5);
-            }
-            else
-                T_to.setTo(0);
+    for (size_t v = 0; v < views_.size(); ++v) {
+        const View &view = views_[v];
+        writer.BeginBlock(blocks_[v].args);
 
-            Mat R = R_to * R_from.t();
-            Mat_<double> F = K_inv.t() * CrossProductMat(R * T_from - T_to) * R * K_inv;
+        if (view.from_pair == -1) {
+            EvalViewRows<MAX_REL_VIEW_ARGS>(F_rel, dF_rel, (int)v, writer);
+            writer.EndBlock();
+            continue;
+        }
 
-            const vector<DMatch> &matches = *(iter->second);
-            for (size_t i = 0; i < matches.size(); ++i) {
-                const Point2f &p0 = kps_from[matches[i].queryIdx].pt;
-                const Point2f &p1 = kps_to[matches[i].trainIdx].pt;
-                err_(pos++, 0) = sqrt(SymEpipDist2(p1.x, p1.y, F, p0.x, p0.y)) * conf;
+        Matrix33d R_from, dR_from[3], R_to, dR_to[3];
+        double T_from[3], T_to[3];
+        int offset_from = ExtractMotion(arg_, view.from_pair, R_from, dR_from, T_from);
+        int offset_to = ExtractMotion(arg_, view.to_pair, R_to, dR_to, T_to);
+
+        // E = [R * T_from - T_to]x * R, where R = R_to * R_from.t()
+        Matrix33d R = R_to * R_from.t();
+        double T[3];
+        Multiply(R, T_from, T);
+        for (int i = 0; i < 3; ++i)
+            T[i] -= T_to[i];
+        Matrix33d T_x = autodiff::CrossProductMatrix33(T);
+        Matrix33d F = K_inv_t * T_x * R * K_inv;
+
+        num_cols = 0;
+        for (int j = 0; j < KLayout::NUM_ARGS; ++j) {
+            if (KLayout::IsRefined(j, params_to_refine_))
+                dF[num_cols++] = FundamentalMatDerivK(F, dK_K_inv[j]);
+        }
+        if (offset_from != -1) {
+            for (int i = 0; i < 3; ++i) {
+                Matrix33d dR = R_to * dR_from[i].t();
+                double dR_T_from[3];
+                Multiply(dR, T_from, dR_T_from);
+                dF[num_cols++] = K_inv_t * (autodiff::CrossProductMatrix33(dR_T_from) * R +
+                                            T_x * dR) * K_inv;
+            }
+            for (int i = 0; i < 3; ++i) {
+                double R_col[] = {R(0, i), R(1, i), R(2, i)};
+                dF[num_cols++] = K_inv_t * autodiff::CrossProductMatrix33(R_col) * R * K_inv;
             }
         }
-        else if (IsLeftRightPair(from, to)) {
-            const vector<DMatch> &matches = *(iter->second);
-            for (size_t i = 0; i < matches.size(); ++i) {
-                const Point2f &p0 = kps_from[matches[i].queryIdx].pt;
-                const Point2f &p1 = kps_to[matches[i].trainIdx].pt;
-                err_(pos++, 0) = sqrt(SymEpipDist2(p1.x, p1.y, F_rel, p0.x, p0.y)) * conf;
+        if (offset_to != -1) {
+            for (int i = 0; i < 3; ++i) {
+                Matrix33d dR = dR_to[i] * R_from.t();
+                double dR_T_from[3];
+                Multiply(dR, T_from, dR_T_from);
+                dF[num_cols++] = K_inv_t * (autodiff::CrossProductMatrix33(dR_T_from) * R +
+                                            T_x * dR) * K_inv;
+            }
+            for (int i = 0; i < 3; ++i) {
+                dF[num_cols++] = Matrix33d() - K_inv_t * autodiff::CrossProductMatrix33(unit_vecs[i]) *
+                                               R * K_inv;
             }
         }
+        for (int j = num_cols; j < MAX_VIEW_ARGS; ++j)
+            dF[j] = Matrix33d();
+
+        EvalViewRows<MAX_VIEW_ARGS>(F, dF, (int)v, writer);
+        writer.EndBlock();
     }
 }
 
 
-void EpipError_KRT::Jacobian(const Mat &arg, Mat &jac) {
-    Mat_<double> arg_(arg.clone());
-
-    jac.create(dimension(), arg_.cols, CV_64F);
-    Mat_<double> jac_(jac);
-    jac_.setTo(0);
-
-    // Maps argument index to the respective intrinsic parameter
-    static const int flags_tbl[] = {REFINE_FLAG_K_FX, REFINE_FLAG_K_SKEW, REFINE_FLAG_K_PPX,
-                                    REFINE_FLAG_K_FY, REFINE_FLAG_K_PPY};
+template <int Flags>
+template <int NumCols, typename Writer>
+void EpipError_KRT<Flags>::EvalViewRows(const autodiff::Matrix33<double> &F,
+                                        const autodiff::Matrix33<double> *dF, int view_idx,
+                                        Writer &writer) const
+{
+    if (blocks_[view_idx].num_rows == 0)
+        return;
 
-    for (int i = 0; i < arg_.cols; ++i) {
-        if (/*(i < 5 || i > 10) && (*/i > 4 || (params_to_refine_ & flags_tbl[i])/*)*/) {
-            double val = arg_(0, i);
+    if (precision_ == MinimizeOpts::PRECISION_MIXED)
+        EvalViewRows<NumCols>(F, dF, view_idx, &x0f_[0], &y0f_[0], &x1f_[0], &y1f_[0], writer);
+    else
+        EvalViewRows<NumCols>(F, dF, view_idx, &x0_[0], &y0_[0], &x1_[0], &y1_[0], writer);
+}
 
-            arg_(0, i) += step_;
-            Mat tmp = jac_.col(i);
-            (*this)(arg_, tmp);
 
-            arg_(0, i) = val - step_;
-            (*this)(arg_, err_);
-            arg_(0, i) = val;
+template <int Flags>
+template <int NumCols, typename T, typename Writer>
+void EpipError_KRT<Flags>::EvalViewRows(const autodiff::Matrix33<double> &F,
+                                        const autodiff::Matrix33<double> *dF, int view_idx,
+                                        const T *x0, const T *y0, const T *x1, const T *y1,
+                                        Writer &writer) const
+{
+    const ResidualBlock &block = blocks_[view_idx];
+
+    // Flatten the matrices, so the rows loop runs in precision T only
+    T F_[9];
+    T dF_[9 * NumCols];
+    for (int k = 0; k < 9; ++k) {
+        F_[k] = (T)F(k / 3, k % 3);
+        for (int j = 0; j < NumCols; ++j)
+            dF_[9 * j + k] = (T)dF[j](k / 3, k % 3);
+    }
 
-            for (int j = 0; j < dimension(); ++j) {
-                jac_(j, i) = (jac_(j, i) - err_(j, 0)) / (2 * step_);
-            }
-        }
+    T dist_deriv[9];
+    double derivs[NumCols];
+    for (int pos = block.row; pos < block.row + block.num_rows; ++pos) {
+        T dist = SymEpipDistDerivF(x1[pos], y1[pos], F_, x0[pos], y0[pos], dist_deriv);
+        for (int j = 0; j < NumCols; ++j)
+            derivs[j] = DotProduct3x3(dist_deriv, &dF_[9 * j]) * weights_[pos];
+        writer.AddRow(pos, dist * weights_[pos], derivs);
     }
 }
 
-} // namespace
-
 
-double RefineStereoCamera(RigidCamera &cam, AbsoluteMotions &motions,
-                          const FeaturesCollection &features, const MatchesCollection &matches,
-                          int params_to_refine, const RelativeConfidences &rel_confs)
+/** Normalizes motions, so the first one is the reference and stays fixed and the longest
+  * translation has unit length, and packs refined intrinsics, the relative motion of the
+  * right camera and motions of stereo pairs into the argument vector.
+  */
+template <int Flags>
+void PackStereoCameraArg(const double *K, const RigidCamera &cam, AbsoluteMotions &motions,
+                         typename EpipError_KRT<Flags>::Layout &layout, Mat_<double> &arg)
 {
-    if (motions.size() < 2) {
-        AUTOCALIB_LOG(cout << "Need more shots to refine stereo camera\n";);
-        return numeric_limits<double>::max();
-    }
-
-    // Normalize rotations and compute indices
+    // Normalize rotations, the first motion is the reference and stays fixed
 
     Mat R_norm = motions.begin()->second.R().clone();
     Mat T_norm = motions.begin()->second.T().clone();
 
-    vector<int> motions_indices;
-
     for (AbsoluteMotions::iterator iter = motions.begin(); iter != motions.end(); ++iter) {
         iter->second.set_T(iter->second.T() - iter->second.R() * R_norm.t() * T_norm);
         iter->second.set_R(iter->second.R() * R_norm.t());
-        motions_indices.push_back(iter->first);
+        layout.AddBlock(iter->first, iter == motions.begin());
     }
 
     // Normalize translations
@@ -961,80 +2721,377 @@ double RefineStereoCamera(RigidCamera &cam, AbsoluteMotions &motions,
         iter->second.set_T(iter->second.T() / T_mult);
     }
 
-    Mat_<double> arg(1, 5/*K*/ + 3/*R*/ + 3/*T*/ + 6 * (int)motions.size());
+    arg.create(1, layout.num_args());
+    EpipError_KRT<Flags>::KLayout::Pack(K, arg[0]);
 
-    Mat_<double> K(cam.K());
-    arg(0, 0) = K(0, 0);
-    arg(0, 1) = K(0, 1);
-    arg(0, 2) = K(0, 2);
-    arg(0, 3) = K(1, 1);
-    arg(0, 4) = K(1, 2);
+    const int rel = EpipError_KRT<Flags>::REL_MOTION_ARG;
 
     Mat_<double> rvec;
     Rodrigues(cam.R(), rvec);
-    arg(0, 5) = rvec(0, 0);
-    arg(0, 6) = rvec(0, 1);
-    arg(0, 7) = rvec(0, 2);
+    arg(0, rel) = rvec(0, 0);
+    arg(0, rel + 1) = rvec(0, 1);
+    arg(0, rel + 2) = rvec(0, 2);
 
     Mat_<double> T(cam.T());
-    arg(0, 8) = T(0, 0);
-    arg(0, 9) = T(1, 0);
-    arg(0, 10) = T(2, 0);
+    arg(0, rel + 3) = T(0, 0);
+    arg(0, rel + 4) = T(1, 0);
+    arg(0, rel + 5) = T(2, 0);
+
+    for (AbsoluteMotions::iterator iter = motions.begin(); iter != motions.end(); ++iter) {
+        int offset = layout.Offset(iter->first);
+        if (offset == -1)
+            continue;
 
-    for (size_t i = 1; i < motions_indices.size(); ++i) {
         Mat_<double> rvec_l;
-        Rodrigues(motions.find(motions_indices[i])->second.R(), rvec_l);
-        arg(0, 11 + 6 * (i - 1)) = rvec_l(0, 0);
-        arg(0, 11 + 6 * (i - 1) + 1) = rvec_l(0, 1);
-        arg(0, 11 + 6 * (i - 1) + 2) = rvec_l(0, 2);
+        Rodrigues(iter->second.R(), rvec_l);
+        arg(0, offset) = rvec_l(0, 0);
+        arg(0, offset + 1) = rvec_l(0, 1);
+        arg(0, offset + 2) = rvec_l(0, 2);
+
+        Mat_<double> T_l = iter->second.T();
+        arg(0, offset + 3) = T_l(0, 0);
+        arg(0, offset + 4) = T_l(1, 0);
+        arg(0, offset + 5) = T_l(2, 0);
+    }
+}
 
-        Mat_<double> T_l = motions.find(motions_indices[i])->second.T();
-        arg(0, 11 + 6 * (i - 1) + 3) = T_l(0, 0);
-        arg(0, 11 + 6 * (i - 1) + 4) = T_l(1, 0);
-        arg(0, 11 + 6 * (i - 1) + 5) = T_l(2, 0);
+
+/** Same as RefineStereoCamera(), but the intrinsics layout is specialized for the refine
+  * flags given at compile time.
+  */
+template <int Flags>
+double RefineStereoCameraImpl(RigidCamera &cam, AbsoluteMotions &motions,
+                              const FeaturesCollection &features, const MatchesCollection &matches,
+                              int params_to_refine, const RelativeConfidences &rel_confs,
+                              const MinimizeOpts &opts)
+{
+    typedef EpipError_KRT<Flags> Func;
+    typedef typename Func::KLayout KLayout;
+    typedef typename Func::Layout Layout;
+
+    Mat_<double> K(cam.K());
+    double K_params[] = {K(0, 0), K(0, 1), K(0, 2), K(1, 1), K(1, 2)};
+
+    Layout layout;
+    Mat_<double> arg;
+    PackStereoCameraArg<Flags>(K_params, cam, motions, layout, arg);
+
+    Func func(features, matches, rel_confs, K_params, layout, params_to_refine,
+              opts.jacobian_method(), opts.num_threads(), opts.precision());
+
+    double rms_error;
+    if (opts.linear_solver() == MinimizeOpts::LINEAR_SOLVER_SCHUR)
+        rms_error = MinimizeLevMarqSchur(func, arg, Layout::NUM_COMMON, Layout::BLOCK_SIZE, opts);
+    else if (opts.linear_solver() == MinimizeOpts::LINEAR_SOLVER_DENSE_STREAMED) {
+        internal::DenseNormalEquations eqs(arg.cols);
+        rms_error = MinimizeLevMarqStreamed(func, arg, eqs, opts);
+    }
+    else if (opts.linear_solver() == MinimizeOpts::LINEAR_SOLVER_PCG) {
+        BlockJacobiPcgEquations eqs(Layout::NUM_COMMON, Layout::BLOCK_SIZE,
+                                    layout.num_free_blocks());
+        rms_error = MinimizeLevMarqStreamed(func, arg, eqs, opts);
     }
+    else
+        rms_error = Minimize(func, arg, opts);
 
-    EpipError_KRT func(features, matches, rel_confs, motions_indices, params_to_refine);
-    double rms_error = MinimizeLevMarq(func, arg, MinimizeOpts::VERBOSE_SUMMARY);
+    double K_refined[5];
+    KLayout::Unpack(arg[0], K_params, K_refined);
+    K(0, 0) = K_refined[0];
+    K(0, 1) = K_refined[1];
+    K(0, 2) = K_refined[2];
+    K(1, 1) = K_refined[3];
+    K(1, 2) = K_refined[4];
 
-    K(0, 0) = arg(0, 0);
-    K(0, 1) = arg(0, 1);
-    K(0, 2) = arg(0, 2);
-    K(1, 1) = arg(0, 3);
-    K(1, 2) = arg(0, 4);
+    const int rel = Func::REL_MOTION_ARG;
 
-    rvec(0, 0) = arg(0, 5);
-    rvec(0, 1) = arg(0, 6);
-    rvec(0, 2) = arg(0, 7);
+    Mat_<double> rvec(1, 3);
+    rvec(0, 0) = arg(0, rel);
+    rvec(0, 1) = arg(0, rel + 1);
+    rvec(0, 2) = arg(0, rel + 2);
 
-    T(0, 0) = arg(0, 8);
-    T(1, 0) = arg(0, 9);
-    T(2, 0) = arg(0, 10);
+    Mat_<double> T(3, 1);
+    T(0, 0) = arg(0, rel + 3);
+    T(1, 0) = arg(0, rel + 4);
+    T(2, 0) = arg(0, rel + 5);
 
     Mat R;
     Rodrigues(rvec, R);
     cam = RigidCamera(K, R, T);
 
-    for (size_t i = 1; i < motions_indices.size(); ++i) {
+    for (AbsoluteMotions::iterator iter = motions.begin(); iter != motions.end(); ++iter) {
+        int offset = layout.Offset(iter->first);
+        if (offset == -1)
+            continue;
+
         Mat_<double> rvec_l(1, 3);
-        rvec_l(0, 0) = arg(0, 11 + 6 * (i - 1));
-        rvec_l(0, 1) = arg(0, 11 + 6 * (i - 1) + 1);
-        rvec_l(0, 2) = arg(0, 11 + 6 * (i - 1) + 2);
+        rvec_l(0, 0) = arg(0, offset);
+        rvec_l(0, 1) = arg(0, offset + 1);
+        rvec_l(0, 2) = arg(0, offset + 2);
 
         Mat R_l;
         Rodrigues(rvec_l, R_l);
-        motions.find(motions_indices[i])->second.set_R(R_l);
+        iter->second.set_R(R_l);
 
         Mat_<double> T_l(3, 1);
-        T_l(0, 0) = arg(0, 11 + 6 * (i - 1) + 3);
-        T_l(1, 0) = arg(0, 11 + 6 * (i - 1) + 4);
-        T_l(2, 0) = arg(0, 11 + 6 * (i - 1) + 5);
-        motions.find(motions_indices[i])->second.set_T(T_l);
+        T_l(0, 0) = arg(0, offset + 3);
+        T_l(1, 0) = arg(0, offset + 4);
+        T_l(2, 0) = arg(0, offset + 5);
+        iter->second.set_T(T_l);
     }
 
     return rms_error;
 }
 
+template <int Flags>
+Ptr<internal::BlockwiseFunc> CreateStereoCameraFuncImpl(
+        const double *K, const RigidCamera &cam, AbsoluteMotions motions,
+        const FeaturesCollection &features, const MatchesCollection &matches,
+        int params_to_refine, const RelativeConfidences &rel_confs, const MinimizeOpts &opts,
+        Mat &arg)
+{
+    typename EpipError_KRT<Flags>::Layout layout;
+    Mat_<double> arg_;
+    PackStereoCameraArg<Flags>(K, cam, motions, layout, arg_);
+    arg = arg_;
+
+    return new BlockwiseFuncAdapter<EpipError_KRT<Flags> >(
+            EpipError_KRT<Flags>(features, matches, rel_confs, K, layout, params_to_refine,
+                                 opts.jacobian_method(), opts.num_threads(),
+                                 opts.precision()));
+}
+
+} // namespace
+
+
+double RefineStereoCamera(RigidCamera &cam, AbsoluteMotions &motions,
+                          const FeaturesCollection &features, const MatchesCollection &matches,
+                          int params_to_refine, const RelativeConfidences &rel_confs,
+                          const MinimizeOpts &opts)
+{
+    if (motions.size() < 2) {
+        AUTOCALIB_LOG(cout << "Need more shots to refine stereo camera\n";);
+        return numeric_limits<double>::max();
+    }
+
+    // Common masks have fixed intrinsics dropped from the arguments at compile time
+    switch (params_to_refine & REFINE_FLAG_K_ALL) {
+    case REFINE_FLAG_K_ALL:
+        return RefineStereoCameraImpl<REFINE_FLAG_K_ALL>(
+                cam, motions, features, matches, params_to_refine, rel_confs, opts);
+    case REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW:
+        return RefineStereoCameraImpl<REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW>(
+                cam, motions, features, matches, params_to_refine, rel_confs, opts);
+    case REFINE_FLAG_K_FX | REFINE_FLAG_K_FY:
+        return RefineStereoCameraImpl<REFINE_FLAG_K_FX | REFINE_FLAG_K_FY>(
+                cam, motions, features, matches, params_to_refine, rel_confs, opts);
+    default:
+        return RefineStereoCameraImpl<REFINE_FLAGS_RUNTIME>(
+                cam, motions, features, matches, params_to_refine, rel_confs, opts);
+    }
+}
+
+
+namespace internal {
+
+Ptr<BlockwiseFunc> CreateStereoCameraFunc(
+        const RigidCamera &cam, const AbsoluteMotions &motions,
+        const FeaturesCollection &features, const MatchesCollection &matches,
+        int params_to_refine, const RelativeConfidences &rel_confs, const MinimizeOpts &opts,
+        Mat &arg)
+{
+    CV_Assert(motions.size() >= 2);
+
+    Mat_<double> K(cam.K());
+    double K_params[] = {K(0, 0), K(0, 1), K(0, 2), K(1, 1), K(1, 2)};
+
+    switch (params_to_refine & REFINE_FLAG_K_ALL) {
+    case REFINE_FLAG_K_ALL:
+        return CreateStereoCameraFuncImpl<REFINE_FLAG_K_ALL>(
+                K_params, cam, motions, features, matches, params_to_refine, rel_confs, opts,
+                arg);
+    case REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW:
+        return CreateStereoCameraFuncImpl<REFINE_FLAG_K_ALL & ~REFINE_FLAG_K_SKEW>(
+                K_params, cam, motions, features, matches, params_to_refine, rel_confs, opts,
+                arg);
+    case REFINE_FLAG_K_FX | REFINE_FLAG_K_FY:
+        return CreateStereoCameraFuncImpl<REFINE_FLAG_K_FX | REFINE_FLAG_K_FY>(
+                K_params, cam, motions, features, matches, params_to_refine, rel_confs, opts,
+                arg);
+    default:
+        return CreateStereoCameraFuncImpl<REFINE_FLAGS_RUNTIME>(
+                K_params, cam, motions, features, matches, params_to_refine, rel_confs, opts,
+                arg);
+    }
+}
+
+} // namespace internal
+
+
+namespace {
+
+/** Interrupts minimization once another start succeeded. Forwards calls to the user
+  * callback one start at a time, so it doesn't have to be reentrant.
+  */
+class MultiStartCallback : public MinimizeCallback {
+public:
+    MultiStartCallback(int *done, const Ptr<MinimizeCallback> &callback, Mutex *callback_mutex)
+        : done_(done), callback_(callback), callback_mutex_(callback_mutex), interrupted(false) {}
+
+    bool operator()(int iter, const Mat &arg, double rms_err, int damping_lg10) {
+        if (CV_XADD(done_, 0)) {
+            interrupted = true;
+            return false;
+        }
+        if (callback_.empty())
+            return true;
+        AutoLock lock(*callback_mutex_);
+        return (*callback_)(iter, arg, rms_err, damping_lg10);
+    }
+
+private:
+    int *done_;
+    Ptr<MinimizeCallback> callback_;
+    Mutex *callback_mutex_;
+
+public:
+    bool interrupted;
+};
+
+
+class RefineStereoCameraMultiStartBody : public ParallelLoopBody {
+public:
+    RefineStereoCameraMultiStartBody(
+            const FeaturesCollection &features, const MatchesCollection &matches,
+            int params_to_refine, const RelativeConfidences &rel_confs,
+            double max_skew, double max_rms_error, const Mat &K_norm_inv,
+            const MinimizeOpts &opts, vector<RigidCamera> &cams,
+            vector<AbsoluteMotions> &motions, vector<double> &rms_errors,
+            vector<MinimizeStats> &stats, int &done, Mutex &callback_mutex)
+        : features_(&features), matches_(&matches), params_to_refine_(params_to_refine),
+          rel_confs_(&rel_confs), max_skew_(max_skew), max_rms_error_(max_rms_error),
+          K_norm_inv_(K_norm_inv), opts_(opts), cams_(&cams), motions_(&motions),
+          rms_errors_(&rms_errors), stats_(&stats), done_(&done),
+          callback_mutex_(&callback_mutex) {}
+
+    void operator()(const Range &range) const {
+        for (int i = range.start; i < range.end; ++i) {
+            if (CV_XADD(done_, 0))
+                continue;
+
+            MinimizeOpts opts(opts_);
+            MultiStartCallback *callback =
+                    new MultiStartCallback(done_, opts_.callback(), callback_mutex_);
+            opts.set_callback(Ptr<MinimizeCallback>(callback));
+            opts.set_stats(&(*stats_)[i]);
+
+            double rms_error = RefineStereoCamera((*cams_)[i], (*motions_)[i], *features_,
+                                                  *matches_, params_to_refine_, *rel_confs_, opts);
+            if (callback->interrupted)
+                continue;
+
+            (*rms_errors_)[i] = rms_error;
+            if (IsAcceptable((*cams_)[i], rms_error))
+                CV_XADD(done_, 1);
+        }
+    }
+
+    bool IsAcceptable(const RigidCamera &cam, double rms_error) const {
+        Mat_<double> K = K_norm_inv_ * cam.K();
+        return abs(K(0, 1)) < max_skew_ && rms_error < max_rms_error_;
+    }
+
+private:
+    const FeaturesCollection *features_;
+    const MatchesCollection *matches_;
+    int params_to_refine_;
+    const RelativeConfidences *rel_confs_;
+    double max_skew_;
+    double max_rms_error_;
+    Mat K_norm_inv_;
+    MinimizeOpts opts_;
+    vector<RigidCamera> *cams_;
+    vector<AbsoluteMotions> *motions_;
+    vector<double> *rms_errors_;
+    vector<MinimizeStats> *stats_;
+    int *done_;
+    Mutex *callback_mutex_;
+};
+
+} // namespace
+
+
+double RefineStereoCameraMultiStart(
+        RigidCamera &cam, AbsoluteMotions &motions,
+        const FeaturesCollection &features, const MatchesCollection &matches,
+        int params_to_refine, const RelativeConfidences &rel_confs,
+        int num_starts, double max_skew, double max_rms_error, RNG &rng,
+        const Mat &K_norm, double perturbation, const MinimizeOpts &opts)
+{
+    CV_Assert(num_starts > 0);
+    CV_Assert(K_norm.empty() || (K_norm.type() == CV_64F && K_norm.size() == Size(3, 3)));
+
+    Mat K_norm_ = K_norm.empty() ? Mat(Mat::eye(3, 3, CV_64F)) : K_norm;
+    Mat K_norm_inv = K_norm_.inv();
+
+    // Perturbations are generated beforehand to not depend on threads scheduling
+    vector<RigidCamera> cams;
+    vector<AbsoluteMotions> starts_motions(num_starts, motions);
+    for (int i = 0; i < num_starts; ++i) {
+        Mat_<double> K = K_norm_inv * cam.K();
+        if (i > 0) {
+            K(0, 0) *= rng.uniform(1 - perturbation, 1 + perturbation);
+            K(0, 2) *= rng.uniform(1 - perturbation, 1 + perturbation);
+            K(1, 1) *= rng.uniform(1 - perturbation, 1 + perturbation);
+            K(1, 2) *= rng.uniform(1 - perturbation, 1 + perturbation);
+        }
+        cams.push_back(RigidCamera(K_norm_ * K, cam.R(), cam.T()));
+    }
+
+    vector<double> rms_errors(num_starts, -1);
+    vector<MinimizeStats> stats(num_starts);
+    int done = 0;
+    Mutex callback_mutex;
+
+    RefineStereoCameraMultiStartBody body(features, matches, params_to_refine, rel_confs,
+                                          max_skew, max_rms_error, K_norm_inv, opts,
+                                          cams, starts_motions, rms_errors, stats, done,
+                                          callback_mutex);
+    parallel_for_(Range(0, num_starts), body, num_starts);
+
+    // Each start has its own counters to not share them between threads
+    if (opts.stats()) {
+        for (int i = 0; i < num_starts; ++i)
+            *opts.stats() += stats[i];
+    }
+
+    // Prefer acceptable results, then the smallest error among finished starts
+    int best = -1;
+    for (int i = 0; i < num_starts; ++i) {
+        if (rms_errors[i] < 0)
+            continue;
+        if (best == -1) {
+            best = i;
+            continue;
+        }
+        bool acceptable = body.IsAcceptable(cams[i], rms_errors[i]);
+        bool best_acceptable = body.IsAcceptable(cams[best], rms_errors[best]);
+        if ((acceptable && !best_acceptable) ||
+            (acceptable == best_acceptable && rms_errors[i] < rms_errors[best]))
+            best = i;
+    }
+
+    CV_Assert(best != -1);
+
+    AUTOCALIB_LOG(
+        cout << "Multi-start stereo refinement: best start = " << best
+             << ", RMS error = " << rms_errors[best] << endl);
+
+    cam = cams[best];
+    motions = starts_motions[best];
+
+    return rms_errors[best];
+}
+
 
 void BestOf2NearestMatcher::match(const cv::detail::ImageFeatures &f1,
                                   const cv::detail::ImageFeatures &f2,
@@ -1070,7 +3127,8 @@ void BestOf2NearestMatcher::match(const cv::detail::ImageFeatures &f1,
 
 
 void Intersect(const vector<DMatch> &matches_lr1, const vector<DMatch> &matches_lr2,
-               const vector<DMatch> &matches_ll, vector<pair<int, int> > &indices)
+               const vector<DMatch> &matches_ll, vector<pair<int, int> > &indices,
+               vector<int> *ll_indices)
 {
     map<int, int> l1_to_lr1_idx;
     for (size_t i = 0; i < matches_lr1.size(); ++i) {
@@ -1083,11 +3141,16 @@ void Intersect(const vector<DMatch> &matches_lr1, const vector<DMatch> &matches_
     }
 
     indices.clear();
+    if (ll_indices)
+        ll_indices->clear();
     for (size_t i = 0; i < matches_ll.size(); ++i) {
         map<int, int>::iterator i1 = l1_to_lr1_idx.find(matches_ll[i].queryIdx);
         map<int, int>::iterator i2 = l2_to_lr2_idx.find(matches_ll[i].trainIdx);
-        if (i1 != l1_to_lr1_idx.end() && i2 != l2_to_lr2_idx.end())
+        if (i1 != l1_to_lr1_idx.end() && i2 != l2_to_lr2_idx.end()) {
             indices.push_back(make_pair(i1->second, i2->second));
+            if (ll_indices)
+                ll_indices->push_back((int)i);
+        }
     }
 }
 
@@ -1342,6 +3405,79 @@ Mat CalcNormalizationMat3x3(InputArray xy) {
 }
 
 
+namespace {
+
+/** Points and their images in the structure of arrays layout, so they are processed by
+  * vector instructions without shuffles.
+  */
+struct ProjectedPointsSoA {
+    /** Transposes 1x4N points and 1x2N images, optionally reordering them. */
+    ProjectedPointsSoA(const Mat_<double> &xyzw, const Mat_<double> &xy,
+                       const vector<int> *order = 0)
+    {
+        int num_points = xyzw.cols / 4;
+        x.resize(num_points); y.resize(num_points); z.resize(num_points); w.resize(num_points);
+        u.resize(num_points); v.resize(num_points);
+
+        for (int i = 0; i < num_points; ++i) {
+            int j = order ? (*order)[i] : i;
+            x[i] = xyzw(0, 4 * j);
+            y[i] = xyzw(0, 4 * j + 1);
+            z[i] = xyzw(0, 4 * j + 2);
+            w[i] = xyzw(0, 4 * j + 3);
+            u[i] = xy(0, 2 * j);
+            v[i] = xy(0, 2 * j + 1);
+        }
+    }
+
+    int size() const { return (int)x.size(); }
+
+    vector<double> x, y, z, w;
+    vector<double> u, v;
+};
+
+
+/** Number of points processed at once by the reprojection error kernels. */
+const int kReprojErrBatchSize = 256;
+
+
+/** Computes squared reprojection errors of a range of points.
+  *
+  * \param P Camera matrix, 3x4 row-major
+  * \param sq_err Output squared errors
+  */
+void CalcReprojSqErrors(const double *P, const ProjectedPointsSoA &points, int start, int count,
+                        double *sq_err)
+{
+    const double *x = &points.x[start], *y = &points.y[start];
+    const double *z = &points.z[start], *w = &points.w[start];
+    const double *u = &points.u[start], *v = &points.v[start];
+
+    int i = 0;
+#ifdef AUTOCALIB_HAVE_AVX
+    if (checkHardwareSupport(CV_CPU_AVX)) {
+        i = simd::ReprojSqError_AVX(x, y, z, w, P, u, v, count, sq_err);
+    }
+    else
+#endif
+    {
+#ifdef AUTOCALIB_HAVE_SSE2
+        if (checkHardwareSupport(CV_CPU_SSE2))
+            i = simd::ReprojSqError_SSE2(x, y, z, w, P, u, v, count, sq_err);
+#endif
+    }
+
+    for (; i < count; ++i) {
+        double a = P[0] * x[i] + P[1] * y[i] + P[2] * z[i] + P[3] * w[i];
+        double b = P[4] * x[i] + P[5] * y[i] + P[6] * z[i] + P[7] * w[i];
+        double c = P[8] * x[i] + P[9] * y[i] + P[10] * z[i] + P[11] * w[i];
+        sq_err[i] = sqr(u[i] - a / c) + sqr(v[i] - b / c);
+    }
+}
+
+} // namespace
+
+
 double CalcRmsReprojectionError(InputArray xy, InputArray P, InputArray xyzw)
 {
     CV_Assert(xy.getMat().type() == CV_64F && xy.getMat().rows == 1 && xy.getMat().cols % 2 == 0);
@@ -1349,20 +3485,22 @@ double CalcRmsReprojectionError(InputArray xy, InputArray P, InputArray xyzw)
     CV_Assert(xyzw.getMat().type() == CV_64F && xyzw.getMat().rows == 1 && xyzw.getMat().cols % 4 == 0);
     CV_Assert(xy.getMat().cols / 2 == xyzw.getMat().cols / 4);
 
-    Mat_<double> xy_ = xy.getMat();
     Mat_<double> P_ = P.getMat();
-    Mat_<double> xyzw_ = xyzw.getMat();
-    int num_points = xy_.cols / 2;
+    ProjectedPointsSoA points(xyzw.getMat(), xy.getMat());
+    int num_points = points.size();
 
-    double total_sq_error = 0;
-    double x, y, z;
+    double P_arr[12];
+    for (int k = 0; k < 12; ++k)
+        P_arr[k] = P_(k / 4, k % 4);
 
-    for (int i = 0; i < num_points; ++i) {
-        x = P_(0, 0) * xyzw_(0, 4 * i) + P_(0, 1) * xyzw_(0, 4 * i + 1) + P_(0, 2) * xyzw_(0, 4 * i + 2) + P_(0, 3) * xyzw_(0, 4 * i + 3);
-        y = P_(1, 0) * xyzw_(0, 4 * i) + P_(1, 1) * xyzw_(0, 4 * i + 1) + P_(1, 2) * xyzw_(0, 4 * i + 2) + P_(1, 3) * xyzw_(0, 4 * i + 3);
-        z = P_(2, 0) * xyzw_(0, 4 * i) + P_(2, 1) * xyzw_(0, 4 * i + 1) + P_(2, 2) * xyzw_(0, 4 * i + 2) + P_(2, 3) * xyzw_(0, 4 * i + 3);
+    double total_sq_error = 0;
+    double sq_err[kReprojErrBatchSize];
 
-        total_sq_error += sqr(xy_(0, 2 * i) - x / z) + sqr(xy_(0, 2 * i + 1) - y / z);
+    for (int start = 0; start < num_points; start += kReprojErrBatchSize) {
+        int count = std::min(kReprojErrBatchSize, num_points - start);
+        CalcReprojSqErrors(P_arr, points, start, count, sq_err);
+        for (int i = 0; i < count; ++i)
+            total_sq_error += sq_err[i];
     }
 
     return sqrt(total_sq_error / num_points);
@@ -1380,86 +3518,75 @@ double CalcRmsEpipolarDistance(InputArray xy1, InputArray xy2, InputArray F, Inp
     Mat_<double> F_ = F.getMat();
     int num_points = xy1_.cols / 2;
 
+    Mat_<uchar> mask_;
+    if (!mask.empty())
+        mask_ = mask.getMat();
+
     double total_err = 0;
     int num_measurements = 0;
 
-    if (mask.empty()) {
-        for (int i = 0; i < num_points; ++i) {
-            total_err += SymEpipDist2(xy2_(0, 2 * i), xy2_(0, 2 * i + 1), F_,
-                                      xy1_(0, 2 * i), xy1_(0, 2 * i + 1));
-        }
-        num_measurements = num_points;
-    }
-    else {
-        Mat_<uchar> mask_(mask.getMat());
-        for (int i = 0; i < num_points; ++i) {
-            if (mask_(0, i)) {
-                total_err += SymEpipDist2(xy2_(0, 2 * i), xy2_(0, 2 * i + 1), F_,
-                                          xy1_(0, 2 * i), xy1_(0, 2 * i + 1));
-                num_measurements++;
+    double x1[kEpipDistBatchSize], y1[kEpipDistBatchSize];
+    double x2[kEpipDistBatchSize], y2[kEpipDistBatchSize];
+    double dist[kEpipDistBatchSize];
+
+    for (int i = 0; i < num_points;) {
+        int count = 0;
+        for (; i < num_points && count < kEpipDistBatchSize; ++i) {
+            if (mask_.empty() || mask_(0, i)) {
+                x1[count] = xy2_(0, 2 * i);
+                y1[count] = xy2_(0, 2 * i + 1);
+                x2[count] = xy1_(0, 2 * i);
+                y2[count] = xy1_(0, 2 * i + 1);
+                count++;
             }
         }
+
+        SymEpipDist2(x1, y1, F_, x2, y2, count, dist);
+        for (int j = 0; j < count; ++j)
+            total_err += dist[j];
+        num_measurements += count;
     }
 
     return sqrt(total_err / num_measurements);
 }
 
 
-Mat FindHomographyP3Linear(InputArray xyzw1, InputArray xyzw2) {
-    CV_Assert(xyzw1.getMat().type() == CV_64F && xyzw1.getMat().rows == 1 && xyzw1.getMat().cols % 4 == 0);
-    CV_Assert(xyzw2.getMat().type() == CV_64F && xyzw2.getMat().rows == 1 && xyzw2.getMat().cols % 4 == 0);
-    CV_Assert(xyzw1.getMat().cols / 4 == xyzw2.getMat().cols / 4);
-
-    Mat_<double> xyzw1_ = xyzw1.getMat().clone();
-    Mat_<double> xyzw2_ = xyzw2.getMat().clone();
-
-    int num_points = xyzw1_.cols / 4;
-    CV_Assert(num_points >= 5);
-
-    // Normalize points
-
-    Mat_<double> max_xyzw(1, 4);
-    max_xyzw.setTo(-numeric_limits<double>::max());
-    for (int i = 0; i < num_points; ++i) {
-        max_xyzw(0, 0) = std::max(max_xyzw(0, 0), std::abs(xyzw1_(0, 4 * i)));
-        max_xyzw(0, 1) = std::max(max_xyzw(0, 1), std::abs(xyzw1_(0, 4 * i + 1)));
-        max_xyzw(0, 2) = std::max(max_xyzw(0, 2), std::abs(xyzw1_(0, 4 * i + 2)));
-        max_xyzw(0, 3) = std::max(max_xyzw(0, 3), std::abs(xyzw1_(0, 4 * i + 3)));
-    }
-    Mat_<double> norm_coef1(1, 4);
-    norm_coef1(0, 0) = 1 / max_xyzw(0, 0);
-    norm_coef1(0, 1) = 1 / max_xyzw(0, 1);
-    norm_coef1(0, 2) = 1 / max_xyzw(0, 2);
-    norm_coef1(0, 3) = 1 / max_xyzw(0, 3);
-
-    max_xyzw.setTo(-numeric_limits<double>::max());
-    for (int i = 0; i < num_points; ++i) {
-        max_xyzw(0, 0) = std::max(max_xyzw(0, 0), std::abs(xyzw2_(0, 4 * i)));
-        max_xyzw(0, 1) = std::max(max_xyzw(0, 1), std::abs(xyzw2_(0, 4 * i + 1)));
-        max_xyzw(0, 2) = std::max(max_xyzw(0, 2), std::abs(xyzw2_(0, 4 * i + 2)));
-        max_xyzw(0, 3) = std::max(max_xyzw(0, 3), std::abs(xyzw2_(0, 4 * i + 3)));
-    }
-    Mat_<double> norm_coef2(1, 4);
-    norm_coef2(0, 0) = 1 / max_xyzw(0, 0);
-    norm_coef2(0, 1) = 1 / max_xyzw(0, 1);
-    norm_coef2(0, 2) = 1 / max_xyzw(0, 2);
-    norm_coef2(0, 3) = 1 / max_xyzw(0, 3);
+namespace {
 
-    for (int i = 0; i < num_points; ++i) {
-        xyzw1_(0, 4 * i) *= norm_coef1(0, 0);
-        xyzw1_(0, 4 * i + 1) *= norm_coef1(0, 1);
-        xyzw1_(0, 4 * i + 2) *= norm_coef1(0, 2);
-        xyzw1_(0, 4 * i + 3) *= norm_coef1(0, 3);
-        xyzw2_(0, 4 * i) *= norm_coef2(0, 0);
-        xyzw2_(0, 4 * i + 1) *= norm_coef2(0, 1);
-        xyzw2_(0, 4 * i + 2) *= norm_coef2(0, 2);
-        xyzw2_(0, 4 * i + 3) *= norm_coef2(0, 3);
+/** Largest point subset solved with stack-allocated matrices. It covers the default
+  * MSAC subset size, bigger sets fall back to the dynamic solver.
+  */
+const int kMaxFixedSizeHomographyP3Points = 10;
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, 16, 0,
+                      6 * kMaxFixedSizeHomographyP3Points, 16> HomographyP3SystemFixed;
+
+
+/** Computes per-coordinate scale factors mapping a point cloud into the unit cube.
+  *
+  * \param norm_coef Output 4 scale factors
+  */
+void CalcHomographyP3NormCoefs(const double *xyzw, int num_points, double *norm_coef) {
+    for (int k = 0; k < 4; ++k) {
+        double max_abs = -numeric_limits<double>::max();
+        for (int i = 0; i < num_points; ++i)
+            max_abs = std::max(max_abs, std::abs(xyzw[4 * i + k]));
+        norm_coef[k] = 1 / max_abs;
     }
+}
 
-    // Find homography
 
-    Mat_<double> A(6 * num_points, 16);
-    A.setTo(0);
+/** Fills the linear system of the normalized point clouds, whose null vector is
+  * the row-major homography.
+  *
+  * \param A Output 6Nx16 matrix, either a dynamic map or a fixed-size one
+  */
+template <typename Matrix>
+void BuildHomographyP3System(const double *xyzw1, const double *norm_coef1,
+                             const double *xyzw2, const double *norm_coef2,
+                             int num_points, Matrix &A)
+{
+    A.setZero();
 
     /*
     Here is the Maxima script for coefficients estimation:
@@ -1483,10 +3610,11 @@ Mat FindHomographyP3Linear(InputArray xyzw1, InputArray xyzw2) {
     static const int lut[][2] = {{1, 0}, {2, 0}, {3, 0}, {2, 1}, {3, 1}, {3, 2}};
 
     for (int p = 0; p < num_points; ++p) {
-        double x[4] = {xyzw1_(0, 4 * p), xyzw1_(0, 4 * p + 1),
-                       xyzw1_(0, 4 * p + 2), xyzw1_(0, 4 * p + 3)};
-        double y[4] = {xyzw2_(0, 4 * p), xyzw2_(0, 4 * p + 1),
-                       xyzw2_(0, 4 * p + 2), xyzw2_(0, 4 * p + 3)};
+        double x[4], y[4];
+        for (int k = 0; k < 4; ++k) {
+            x[k] = xyzw1[4 * p + k] * norm_coef1[k];
+            y[k] = xyzw2[4 * p + k] * norm_coef2[k];
+        }
         for (int r = 0, c1 = 0; c1 < 3; ++c1) {
             for (int c2 = c1 + 1; c2 < 4; ++c2, ++r) {
                 for (int i = 0; i < 4; ++i) {
@@ -1497,166 +3625,630 @@ Mat FindHomographyP3Linear(InputArray xyzw1, InputArray xyzw2) {
         }
     }
 
-    for (int i = 0; i < A.rows; ++i)
-        Mat(A.row(i)) /= norm(A.row(i));
+    for (int i = 0; i < A.rows(); ++i)
+        A.row(i) /= A.row(i).norm();
+}
 
-    Mat_<double> H;
-    SVD::solveZ(A, H);
-    H = Mat::diag(norm_coef2.t()).inv() * H.reshape(4) * Mat::diag(norm_coef1.t());
-    return H / pow(abs(determinant(H)), 0.25);
+
+/** Finds the null vector of a small system, i.e. its right singular vector
+  * corresponding to the least singular value.
+  *
+  * The system is reduced to the 16x16 triangular factor R of its column pivoting QR.
+  * A minimal system has rank 15, so its null vector is found in closed form by back
+  * substitution. Otherwise it's the least eigenvector of R^T * R, whose fixed-size
+  * decomposition is several times faster than SVD of the system. Squaring the factor
+  * doesn't lose the accuracy which MSAC needs: on noisy and outlier contaminated samples
+  * the vector matches the SVD one within 1e-9.
+  *
+  * \param h Output 16-vector of unit length
+  * \return true if the system was solved, false if it's degenerate
+  */
+bool SolveHomographyP3SystemFixed(const HomographyP3SystemFixed &A, double *h) {
+    typedef Eigen::Matrix<double, 16, 16> Matrix16d;
+    typedef Eigen::Matrix<double, 16, 1> Vector16d;
+
+    Eigen::ColPivHouseholderQR<HomographyP3SystemFixed> qr(A);
+    Matrix16d R = qr.matrixR().topRows(16).triangularView<Eigen::Upper>();
+
+    // Pivoting puts the least diagonal values in the end, so the rank is known from them
+    double min_diag = numeric_limits<double>::epsilon() * std::abs(R(0, 0)) * 16;
+    if (!(std::abs(R(14, 14)) > min_diag))
+        return false;
+
+    Vector16d z;
+    if (A.rows() == 6 * 5) {
+        z(15) = 1;
+        z.head<15>() = -R.topLeftCorner<15, 15>().triangularView<Eigen::Upper>().solve(
+                R.col(15).head<15>());
+        z.normalize();
+    }
+    else {
+        Eigen::SelfAdjointEigenSolver<Matrix16d> eigen_solver(R.transpose() * R);
+        if (eigen_solver.info() != Eigen::Success)
+            return false;
+        z = eigen_solver.eigenvectors().col(0);
+    }
+
+    Vector16d v = qr.colsPermutation() * z;
+    for (int k = 0; k < 16; ++k)
+        h[k] = v(k);
+    return true;
 }
 
+} // namespace
+
 
-Mat FindHomographyP3Robust(InputArray xyzw1, InputArray xyzw2, InputArray P1, InputArray P2,
-                           InputArray xy_l2, InputArray xy_r2, int num_iters, int subset_size, double err_thresh)
-{
+Mat FindHomographyP3Linear(InputArray xyzw1, InputArray xyzw2, bool fixed_size_solver) {
     CV_Assert(xyzw1.getMat().type() == CV_64F && xyzw1.getMat().rows == 1 && xyzw1.getMat().cols % 4 == 0);
     CV_Assert(xyzw2.getMat().type() == CV_64F && xyzw2.getMat().rows == 1 && xyzw2.getMat().cols % 4 == 0);
     CV_Assert(xyzw1.getMat().cols / 4 == xyzw2.getMat().cols / 4);
-    CV_Assert(xy_l2.getMat().type() == CV_64F && xy_l2.getMat().rows == 1 && xy_l2.getMat().cols % 2 == 0);
-    CV_Assert(xy_r2.getMat().type() == CV_64F && xy_r2.getMat().rows == 1 && xy_r2.getMat().cols % 2 == 0);
-    CV_Assert(P2.getMat().type() == CV_64F && P2.getMat().size() == Size(4, 3));
-    CV_Assert(xy_l2.getMat().cols / 2 == xyzw1.getMat().cols / 4);
-    CV_Assert(xy_r2.getMat().cols / 2 == xyzw2.getMat().cols / 4);
-    CV_Assert(subset_size >= 5);
 
-    Mat_<double> xyzw1_ = xyzw1.getMat();
-    Mat_<double> xyzw2_ = xyzw2.getMat();
-    Mat_<double> P1_ = P1.getMat();
-    Mat_<double> P2_ = P2.getMat();
-    Mat_<double> xy_l2_ = xy_l2.getMat();
-    Mat_<double> xy_r2_ = xy_r2.getMat();
+    Mat xyzw1_ = xyzw1.getMat();
+    Mat xyzw2_ = xyzw2.getMat();
 
     int num_points = xyzw1_.cols / 4;
-    CV_Assert(num_points >= subset_size);
+    CV_Assert(num_points >= 5);
 
-    Mat_<double> xyzw1_subset(1, subset_size * 4);
-    Mat_<double> xyzw2_subset(1, subset_size * 4);
-    Mat_<double> xyzw1_mapped(1, num_points * 4);
+    // Normalize points
 
-    Mat_<double> H_best;
-    int num_inliers_max = numeric_limits<int>::min();
-    double total_err_min = numeric_limits<double>::max();
+    double norm_coef1[4], norm_coef2[4];
+    CalcHomographyP3NormCoefs(xyzw1_.ptr<double>(), num_points, norm_coef1);
+    CalcHomographyP3NormCoefs(xyzw2_.ptr<double>(), num_points, norm_coef2);
 
-    for (int iter = 0; iter < num_iters; ++iter) {
+    // Find homography, small subsets (the MSAC case) don't touch the heap
 
-        vector<int> subset;
-        while ((int)subset.size() < subset_size) {
-            int point = abs((int)theRNG()) % num_points;
-            bool is_new = true;
-            for (size_t i = 0; i < subset.size(); ++i) {
-                if (subset[i] == point) {
-                    is_new = false;
-                    break;
-                }
+    double h[16];
+    bool solved = false;
+
+    if (fixed_size_solver && num_points <= kMaxFixedSizeHomographyP3Points) {
+        HomographyP3SystemFixed A(6 * num_points, 16);
+        BuildHomographyP3System(xyzw1_.ptr<double>(), norm_coef1, xyzw2_.ptr<double>(), norm_coef2,
+                                num_points, A);
+
+        solved = SolveHomographyP3SystemFixed(A, h);
+    }
+
+    if (!solved) {
+        Mat_<double> A(6 * num_points, 16);
+        Eigen::Map<internal::MatrixXdRowMajor> A_(A.ptr<double>(), A.rows, A.cols);
+        BuildHomographyP3System(xyzw1_.ptr<double>(), norm_coef1, xyzw2_.ptr<double>(), norm_coef2,
+                                num_points, A_);
+
+        Mat_<double> z;
+        SVD::solveZ(A, z);
+        for (int k = 0; k < 16; ++k)
+            h[k] = z(k, 0);
+    }
+
+    Mat_<double> H(4, 4);
+    for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c)
+            H(r, c) = h[4 * r + c] / norm_coef2[r] * norm_coef1[c];
+    return H / pow(abs(determinant(H)), 0.25);
+}
+
+
+namespace {
+
+/** Composes the second camera with a homography, so points are projected at once.
+  *
+  * \param P2H Output 3x4 row-major matrix
+  */
+void ComposeCameraHomographyP3(const Mat_<double> &P2, const Mat_<double> &H, double *P2H) {
+    for (int r = 0; r < 3; ++r)
+        for (int c = 0; c < 4; ++c)
+            P2H[4 * r + c] = P2(r, 0) * H(0, c) + P2(r, 1) * H(1, c) +
+                             P2(r, 2) * H(2, c) + P2(r, 3) * H(3, c);
+}
+
+
+/** Computes the MSAC score of a 3D projective space homography, i.e. the sum of squared
+  * reprojection errors into the second image truncated by the threshold.
+  *
+  * \param points First cloud and its images in the second image
+  * \param num_inliers Number of points with errors under the threshold
+  * \param mask Inliers mask, isn't computed if null
+  * \return MSAC score
+  */
+double CalcHomographyP3MsacScore(const Mat_<double> &H, const ProjectedPointsSoA &points,
+                                 const Mat_<double> &P2, double err_thresh, int &num_inliers,
+                                 Mat_<uchar> *mask = 0)
+{
+    int num_points = points.size();
+    double sq_thresh = sqr(err_thresh);
+    double total_err = 0;
+    num_inliers = 0;
+
+    double P2H[12];
+    ComposeCameraHomographyP3(P2, H, P2H);
+    double sq_err[kReprojErrBatchSize];
+
+    for (int start = 0; start < num_points; start += kReprojErrBatchSize) {
+        int count = std::min(kReprojErrBatchSize, num_points - start);
+        CalcReprojSqErrors(P2H, points, start, count, sq_err);
+
+        for (int i = 0; i < count; ++i) {
+            if (sq_err[i] < sq_thresh) {
+                total_err += sq_err[i];
+                num_inliers++;
+                if (mask)
+                    (*mask)(0, start + i) = 255;
             }
-            if (is_new) {
-                subset.push_back(point);
+            else {
+                total_err += sq_thresh;
             }
         }
+    }
+
+    return total_err;
+}
 
-        for (size_t i = 0; i < subset.size(); ++i) {
-            xyzw1_subset(0, 4 * i) = xyzw1_(0, 4 * subset[i]);
-            xyzw1_subset(0, 4 * i + 1) = xyzw1_(0, 4 * subset[i] + 1);
-            xyzw1_subset(0, 4 * i + 2) = xyzw1_(0, 4 * subset[i] + 2);
-            xyzw1_subset(0, 4 * i + 3) = xyzw1_(0, 4 * subset[i] + 3);
 
-            xyzw2_subset(0, 4 * i) = xyzw2_(0, 4 * subset[i]);
-            xyzw2_subset(0, 4 * i + 1) = xyzw2_(0, 4 * subset[i] + 1);
-            xyzw2_subset(0, 4 * i + 2) = xyzw2_(0, 4 * subset[i] + 2);
-            xyzw2_subset(0, 4 * i + 3) = xyzw2_(0, 4 * subset[i] + 3);
+/** Model computation time in units of a point check, it's used to balance the cost of
+  * rejecting good hypotheses against checking bad ones.
+  */
+const double kSprtModelCost = 200;
+
+/** Wald's sequential probability ratio test deciding whether a hypothesis is bad.
+  *
+  * See details in Matas J., Chum O., "Randomized RANSAC with Sequential Probability Ratio
+  * Test", ICCV 2005.
+  */
+struct SprtTest {
+    /** Starts with a weak test, as nothing is known about the data. */
+    SprtTest() : eps(0.1), delta(0.01) { UpdateThreshold(); }
+
+    /** Computes the optimal likelihood ratio threshold for the current probabilities. */
+    void UpdateThreshold() {
+        if (!(eps > delta)) {
+            threshold = numeric_limits<double>::max();
+            return;
         }
 
-        Mat_<double> H = FindHomographyP3Linear(xyzw1_subset, xyzw2_subset);
+        // Average information per check of a bad hypothesis
+        double C = (1 - delta) * log((1 - delta) / (1 - eps)) + delta * log(delta / eps);
 
-        for (int i = 0; i < num_points; ++i) {
-            xyzw1_mapped(0, 4 * i) = H(0, 0) * xyzw1_(0, 4 * i) + H(0, 1) * xyzw1_(0, 4 * i + 1) +
-                                     H(0, 2) * xyzw1_(0, 4 * i + 2) + H(0, 3) * xyzw1_(0, 4 * i + 3);
+        // Solve A = kSprtModelCost * C + 1 + ln(A) by fixed point iterations
+        double A0 = kSprtModelCost * C + 1;
+        threshold = A0;
+        for (int i = 0; i < 10; ++i)
+            threshold = A0 + log(threshold);
+    }
 
-            xyzw1_mapped(0, 4 * i + 1) = H(1, 0) * xyzw1_(0, 4 * i) + H(1, 1) * xyzw1_(0, 4 * i + 1) +
-                                         H(1, 2) * xyzw1_(0, 4 * i + 2) + H(1, 3) * xyzw1_(0, 4 * i + 3);
+    /** \return Probability that a good hypothesis passes the test */
+    double AcceptProb() const { return 1 - 1 / threshold; }
 
-            xyzw1_mapped(0, 4 * i + 2) = H(2, 0) * xyzw1_(0, 4 * i) + H(2, 1) * xyzw1_(0, 4 * i + 1) +
-                                         H(2, 2) * xyzw1_(0, 4 * i + 2) + H(2, 3) * xyzw1_(0, 4 * i + 3);
+    /** Probability of a point being consistent with a good hypothesis, i.e. inliers ratio */
+    double eps;
 
-            xyzw1_mapped(0, 4 * i + 3) = H(3, 0) * xyzw1_(0, 4 * i) + H(3, 1) * xyzw1_(0, 4 * i + 1) +
-                                         H(3, 2) * xyzw1_(0, 4 * i + 2) + H(3, 3) * xyzw1_(0, 4 * i + 3);
-        }
+    /** Probability of a point being consistent with a bad hypothesis */
+    double delta;
 
-        int num_inliers = 0;
-        double total_err = 0;
+    /** Likelihood ratio which rejects a hypothesis */
+    double threshold;
+};
 
-        double x, y, z;
-        double sq_err;
 
-        for (int i = 0; i < num_points; ++i) {
-            x = P2_(0, 0) * xyzw1_mapped(0, 4 * i) + P2_(0, 1) * xyzw1_mapped(0, 4 * i + 1) +
-                P2_(0, 2) * xyzw1_mapped(0, 4 * i + 2) + P2_(0, 3) * xyzw1_mapped(0, 4 * i + 3);
+/** Number of points checked at once by the sequential probability ratio test. Bad
+  * hypotheses are usually rejected after a few tens of points.
+  */
+const int kSprtBatchSize = 16;
 
-            y = P2_(1, 0) * xyzw1_mapped(0, 4 * i) + P2_(1, 1) * xyzw1_mapped(0, 4 * i + 1) +
-                P2_(1, 2) * xyzw1_mapped(0, 4 * i + 2) + P2_(1, 3) * xyzw1_mapped(0, 4 * i + 3);
 
-            z = P2_(2, 0) * xyzw1_mapped(0, 4 * i) + P2_(2, 1) * xyzw1_mapped(0, 4 * i + 1) +
-                P2_(2, 2) * xyzw1_mapped(0, 4 * i + 2) + P2_(2, 3) * xyzw1_mapped(0, 4 * i + 3);
+/** Same as CalcHomographyP3MsacScore(), but stops as soon as the sequential probability
+  * ratio test rejects the hypothesis. Points must be in random order.
+  *
+  * \param num_inliers Number of checked points with errors under the threshold
+  * \param num_checked Number of checked points
+  * \return MSAC score, or the maximum double value if the hypothesis is rejected
+  */
+double CalcHomographyP3MsacScoreSprt(const Mat_<double> &H, const ProjectedPointsSoA &points,
+                                     const Mat_<double> &P2, double err_thresh,
+                                     const SprtTest &sprt, int &num_inliers, int &num_checked)
+{
+    int num_points = points.size();
+
+    // The test can't tell good hypotheses from bad ones yet
+    if (!(sprt.eps > sprt.delta)) {
+        num_checked = num_points;
+        return CalcHomographyP3MsacScore(H, points, P2, err_thresh, num_inliers);
+    }
+
+    double sq_thresh = sqr(err_thresh);
+    double mult_consistent = sprt.delta / sprt.eps;
+    double mult_inconsistent = (1 - sprt.delta) / (1 - sprt.eps);
+    double likelihood_ratio = 1;
+    double total_err = 0;
+    num_inliers = 0;
+
+    double P2H[12];
+    ComposeCameraHomographyP3(P2, H, P2H);
+    double sq_err[kSprtBatchSize];
 
-            sq_err = sqr(xy_r2_(0, 2 * i) - x / z) + sqr(xy_r2_(0, 2 * i + 1) - y / z);
+    for (num_checked = 0; num_checked < num_points;) {
+        int count = std::min(kSprtBatchSize, num_points - num_checked);
+        CalcReprojSqErrors(P2H, points, num_checked, count, sq_err);
 
-            if (sq_err < sqr(err_thresh)) {
-                total_err += sq_err;
+        for (int i = 0; i < count; ++i) {
+            num_checked++;
+
+            if (sq_err[i] < sq_thresh) {
+                total_err += sq_err[i];
                 num_inliers++;
+                likelihood_ratio *= mult_consistent;
             }
             else {
-                total_err += sqr(err_thresh);
+                total_err += sq_thresh;
+                likelihood_ratio *= mult_inconsistent;
             }
-        }
 
-        if (total_err < total_err_min) {
-            H_best = H.clone();
-            num_inliers_max = num_inliers;
-            total_err_min = total_err;
+            if (likelihood_ratio > sprt.threshold)
+                return numeric_limits<double>::max();
         }
     }
 
-    if (num_inliers_max >= 5) {
-        for (int i = 0; i < num_points; ++i) {
-            xyzw1_mapped(0, 4 * i) = H_best(0, 0) * xyzw1_(0, 4 * i) + H_best(0, 1) * xyzw1_(0, 4 * i + 1) +
-                                     H_best(0, 2) * xyzw1_(0, 4 * i + 2) + H_best(0, 3) * xyzw1_(0, 4 * i + 3);
+    return total_err;
+}
+
+
+/** MSAC hypothesis with its score. */
+struct HomographyP3Hypothesis {
+    HomographyP3Hypothesis()
+        : num_inliers(0), total_err(numeric_limits<double>::max()), rejected(false),
+          num_checked(0) {}
+
+    Mat_<double> H;
+    int num_inliers;
+    double total_err;
+
+    /** Whether the sequential probability ratio test rejected the hypothesis */
+    bool rejected;
+
+    /** Number of points checked before acceptance or rejection */
+    int num_checked;
+};
+
+
+/** Computes the PROSAC schedule: the i-th element is the number of iterations after which
+  * samples are drawn from more than subset_size + i best ranked points.
+  */
+vector<int> CalcProsacGrowth(int num_points, int subset_size, int max_iters) {
+    // Average number of samples from the best n points among max_iters of all the points
+    double T_n = max_iters;
+    for (int i = 0; i < subset_size; ++i)
+        T_n *= (double)(subset_size - i) / (num_points - i);
+
+    vector<int> growth(1, 1);
+    for (int n = subset_size; n < num_points && growth.back() < max_iters; ++n) {
+        double T_next = T_n * (n + 1) / (n + 1 - subset_size);
+        growth.push_back(growth.back() + (int)ceil(T_next - T_n));
+        T_n = T_next;
+    }
+    return growth;
+}
+
+
+/** \return Number of iterations which find a good hypothesis with the given confidence
+  * \param accept_prob Probability of accepting a hypothesis from an outliers free sample
+  */
+int CalcRequiredIters(double inliers_ratio, int subset_size, double confidence, int max_iters,
+                      double accept_prob = 1)
+{
+    double p = pow(inliers_ratio, subset_size) * accept_prob;
+    if (p <= 0 || confidence >= 1)
+        return max_iters;
+    if (p >= 1)
+        return 0;
+    double num_iters = log(1 - confidence) / log(1 - p);
+    return num_iters < max_iters ? (int)ceil(num_iters) : max_iters;
+}
+
+
+/** Probability that a point is consistent with a wrong hypothesis, used by the PROSAC
+  * non-randomness criterion.
+  */
+const double kProsacBeta = 0.05;
+
+/** Normal quantile of the PROSAC non-randomness criterion, it corresponds to 5% chance
+  * that a wrong hypothesis passes it.
+  */
+const double kProsacNonRandomnessQuantile = 1.645;
+
+
+/** Finds the number of iterations PROSAC needs (see Chum O., Matas J., "Matching with
+  * PROSAC - Progressive Sample Consensus", CVPR 2005). Each set of the best ranked points
+  * where the best hypothesis has a non-random number of inliers gives its own estimate from
+  * the inliers ratio within the set, and the least one is used.
+  *
+  * \param inliers_mask Inliers of the best hypothesis
+  * \param ranking Points in sampling order
+  * \param accept_prob Probability of accepting a hypothesis from an outliers free sample
+  */
+int CalcProsacRequiredIters(const Mat_<uchar> &inliers_mask, const vector<int> &ranking,
+                            int subset_size, double confidence, int max_iters,
+                            double accept_prob)
+{
+    int num_iters_required = max_iters;
+    int num_inliers = 0;
+
+    for (int n = 1; n <= (int)ranking.size(); ++n) {
+        if (inliers_mask(0, ranking[n - 1]))
+            num_inliers++;
+        if (n <= subset_size)
+            continue;
+
+        // Points beyond the sample are consistent with a wrong hypothesis by chance,
+        // so their inliers must be well above the binomial mean
+        double mean = (n - subset_size) * kProsacBeta;
+        double sigma = sqrt(mean * (1 - kProsacBeta));
+        if (num_inliers - subset_size <= mean + kProsacNonRandomnessQuantile * sigma)
+            continue;
+
+        num_iters_required = std::min(num_iters_required, CalcRequiredIters(
+                (double)num_inliers / n, subset_size, confidence, max_iters, accept_prob));
+    }
+
+    return num_iters_required;
+}
+
 
-            xyzw1_mapped(0, 4 * i + 1) = H_best(1, 0) * xyzw1_(0, 4 * i) + H_best(1, 1) * xyzw1_(0, 4 * i + 1) +
-                                         H_best(1, 2) * xyzw1_(0, 4 * i + 2) + H_best(1, 3) * xyzw1_(0, 4 * i + 3);
+/** Generates and scores a round of MSAC hypotheses, one per stripe. Each stripe draws
+  * samples from its own random numbers stream.
+  */
+class HomographyP3MsacBody : public ParallelLoopBody {
+public:
+    /** \param points First cloud and its images in the second image
+      * \param points_sprt The same in random order, the test isn't used if it's null
+      */
+    HomographyP3MsacBody(const Mat_<double> &xyzw1, const Mat_<double> &xyzw2,
+                         const ProjectedPointsSoA &points, const ProjectedPointsSoA *points_sprt,
+                         const Mat_<double> &P2, int subset_size, double err_thresh,
+                         const vector<int> &ranking, const vector<int> &prosac_growth,
+                         vector<RNG> &rngs, vector<HomographyP3Hypothesis> &hyps)
+        : xyzw1_(xyzw1), xyzw2_(xyzw2), points_(&points), points_sprt_(points_sprt), P2_(P2),
+          subset_size_(subset_size), err_thresh_(err_thresh), ranking_(&ranking),
+          prosac_growth_(&prosac_growth), rngs_(&rngs), hyps_(&hyps), first_iter_(0) {}
+
+    /** Sets index of the first hypothesis of the round. */
+    void set_first_iter(int val) { first_iter_ = val; }
+
+    /** Sets the test used in the round. */
+    void set_sprt(const SprtTest &val) { sprt_ = val; }
+
+    void operator()(const Range &range) const {
+        for (int i = range.start; i < range.end; ++i)
+            RunStripe(i);
+    }
+
+private:
+    void RunStripe(int stripe) const {
+        vector<int> subset;
+        DrawSample(first_iter_ + stripe, (*rngs_)[stripe], subset);
+
+        Mat_<double> xyzw1_subset(1, subset_size_ * 4);
+        Mat_<double> xyzw2_subset(1, subset_size_ * 4);
+        for (int i = 0; i < subset_size_; ++i) {
+            for (int k = 0; k < 4; ++k) {
+                xyzw1_subset(0, 4 * i + k) = xyzw1_(0, 4 * subset[i] + k);
+                xyzw2_subset(0, 4 * i + k) = xyzw2_(0, 4 * subset[i] + k);
+            }
+        }
+
+        HomographyP3Hypothesis &hyp = (*hyps_)[stripe];
+        hyp.H = FindHomographyP3Linear(xyzw1_subset, xyzw2_subset);
 
-            xyzw1_mapped(0, 4 * i + 2) = H_best(2, 0) * xyzw1_(0, 4 * i) + H_best(2, 1) * xyzw1_(0, 4 * i + 1) +
-                                         H_best(2, 2) * xyzw1_(0, 4 * i + 2) + H_best(2, 3) * xyzw1_(0, 4 * i + 3);
+        if (!points_sprt_) {
+            hyp.total_err = CalcHomographyP3MsacScore(hyp.H, *points_, P2_, err_thresh_,
+                                                      hyp.num_inliers);
+            hyp.num_checked = points_->size();
+            hyp.rejected = false;
+        }
+        else {
+            hyp.total_err = CalcHomographyP3MsacScoreSprt(hyp.H, *points_sprt_, P2_, err_thresh_,
+                                                          sprt_, hyp.num_inliers, hyp.num_checked);
+            hyp.rejected = hyp.total_err == numeric_limits<double>::max();
+        }
+    }
 
-            xyzw1_mapped(0, 4 * i + 3) = H_best(3, 0) * xyzw1_(0, 4 * i) + H_best(3, 1) * xyzw1_(0, 4 * i + 1) +
-                                         H_best(3, 2) * xyzw1_(0, 4 * i + 2) + H_best(3, 3) * xyzw1_(0, 4 * i + 3);
+    void DrawSample(int iter, RNG &rng, vector<int> &subset) const {
+        int num_points = (int)ranking_->size();
+        int range = num_points;
+
+        // PROSAC samples the worst point of the current set and the rest from the better ones
+        if (!prosac_growth_->empty()) {
+            vector<int>::const_iterator pos = lower_bound(
+                    prosac_growth_->begin(), prosac_growth_->end(), iter + 1);
+            if (pos != prosac_growth_->end()) {
+                range = subset_size_ + (int)(pos - prosac_growth_->begin()) - 1;
+                subset.push_back(range);
+            }
         }
 
-        Mat_<uchar> mask(1, num_points);
-        mask.setTo(0);
+        while ((int)subset.size() < subset_size_) {
+            int point = rng.uniform(0, range);
+            if (find(subset.begin(), subset.end(), point) == subset.end())
+                subset.push_back(point);
+        }
 
-        double x, y, z;
-        double sq_err;
+        for (size_t i = 0; i < subset.size(); ++i)
+            subset[i] = (*ranking_)[subset[i]];
+    }
 
-        for (int i = 0; i < num_points; ++i) {
-            x = P2_(0, 0) * xyzw1_mapped(0, 4 * i) + P2_(0, 1) * xyzw1_mapped(0, 4 * i + 1) +
-                P2_(0, 2) * xyzw1_mapped(0, 4 * i + 2) + P2_(0, 3) * xyzw1_mapped(0, 4 * i + 3);
+    Mat_<double> xyzw1_;
+    Mat_<double> xyzw2_;
+    const ProjectedPointsSoA *points_;
+    const ProjectedPointsSoA *points_sprt_;
+    Mat_<double> P2_;
+    int subset_size_;
+    double err_thresh_;
+    const vector<int> *ranking_;
+    const vector<int> *prosac_growth_;
+    vector<RNG> *rngs_;
+    vector<HomographyP3Hypothesis> *hyps_;
+    int first_iter_;
+    SprtTest sprt_;
+};
+
+
+/** Compares correspondences by descriptor distances. */
+class MatchDistLess {
+public:
+    MatchDistLess(const Mat_<double> &dists) : dists_(dists) {}
+    bool operator()(int i, int j) const { return dists_(0, i) < dists_(0, j); }
+
+private:
+    Mat_<double> dists_;
+};
+
+} // namespace
+
+
+Mat FindHomographyP3Robust(InputArray xyzw1, InputArray xyzw2, InputArray P1, InputArray P2,
+                           InputArray xy_l2, InputArray xy_r2, int num_iters, int subset_size, double err_thresh,
+                           InputArray match_dists, const SampleConsensusOpts &opts)
+{
+    CV_Assert(xyzw1.getMat().type() == CV_64F && xyzw1.getMat().rows == 1 && xyzw1.getMat().cols % 4 == 0);
+    CV_Assert(xyzw2.getMat().type() == CV_64F && xyzw2.getMat().rows == 1 && xyzw2.getMat().cols % 4 == 0);
+    CV_Assert(xyzw1.getMat().cols / 4 == xyzw2.getMat().cols / 4);
+    CV_Assert(xy_l2.getMat().type() == CV_64F && xy_l2.getMat().rows == 1 && xy_l2.getMat().cols % 2 == 0);
+    CV_Assert(xy_r2.getMat().type() == CV_64F && xy_r2.getMat().rows == 1 && xy_r2.getMat().cols % 2 == 0);
+    CV_Assert(P2.getMat().type() == CV_64F && P2.getMat().size() == Size(4, 3));
+    CV_Assert(xy_l2.getMat().cols / 2 == xyzw1.getMat().cols / 4);
+    CV_Assert(xy_r2.getMat().cols / 2 == xyzw2.getMat().cols / 4);
+    CV_Assert(subset_size >= 5);
+
+    Mat_<double> xyzw1_ = xyzw1.getMat();
+    Mat_<double> xyzw2_ = xyzw2.getMat();
+    Mat_<double> P1_ = P1.getMat();
+    Mat_<double> P2_ = P2.getMat();
+    Mat_<double> xy_l2_ = xy_l2.getMat();
+    Mat_<double> xy_r2_ = xy_r2.getMat();
+
+    int num_points = xyzw1_.cols / 4;
+    CV_Assert(num_points >= subset_size);
+
+    CV_Assert(opts.confidence() > 0 && opts.confidence() <= 1);
+
+    // Streams are seeded beforehand, so results don't depend on threads scheduling
+    RNG &rng = opts.rng() ? *opts.rng() : theRNG();
+    int num_stripes = std::max(1, std::min(opts.num_threads(), num_iters));
+    vector<RNG> rngs;
+    for (int i = 0; i < num_stripes; ++i) {
+        uint64 state = (uint64)rng.next() << 32;
+        rngs.push_back(RNG(state | rng.next()));
+    }
+
+    // Points in sampling order, the best matches go first for PROSAC
+    vector<int> ranking(num_points);
+    for (int i = 0; i < num_points; ++i)
+        ranking[i] = i;
+
+    vector<int> prosac_growth;
+    if (opts.sampling() == SampleConsensusOpts::SAMPLING_PROSAC && !match_dists.empty()) {
+        Mat_<double> dists;
+        match_dists.getMat().reshape(1, 1).convertTo(dists, CV_64F);
+        CV_Assert(dists.cols == num_points);
+        stable_sort(ranking.begin(), ranking.end(), MatchDistLess(dists));
+        prosac_growth = CalcProsacGrowth(num_points, subset_size, num_iters);
+    }
+
+    ProjectedPointsSoA points(xyzw1_, xy_r2_);
+
+    // Randomized RANSAC checks points in the same random order for all the hypotheses
+    Ptr<ProjectedPointsSoA> points_sprt;
+    if (opts.sprt()) {
+        vector<int> check_order(num_points);
+        for (int i = 0; i < num_points; ++i)
+            check_order[i] = i;
+        for (int i = num_points - 1; i > 0; --i)
+            std::swap(check_order[i], check_order[rng.uniform(0, i + 1)]);
+        points_sprt = new ProjectedPointsSoA(xyzw1_, xy_r2_, &check_order);
+    }
 
-            y = P2_(1, 0) * xyzw1_mapped(0, 4 * i) + P2_(1, 1) * xyzw1_mapped(0, 4 * i + 1) +
-                P2_(1, 2) * xyzw1_mapped(0, 4 * i + 2) + P2_(1, 3) * xyzw1_mapped(0, 4 * i + 3);
+    vector<HomographyP3Hypothesis> hyps(num_stripes);
+    HomographyP3MsacBody body(xyzw1_, xyzw2_, points, points_sprt, P2_, subset_size, err_thresh,
+                              ranking, prosac_growth, rngs, hyps);
+
+    // Termination and the test are updated after rounds of one hypothesis per stripe,
+    // which are the same for any threads scheduling
+    HomographyP3Hypothesis best;
+    Mat_<uchar> best_mask(1, num_points);
+    SprtTest sprt;
+    int num_rejected = 0;
+    int num_rejected_checked = 0;
+    int num_rejected_inliers = 0;
+    int num_iters_required = num_iters;
+    int iter = 0;
+
+    while (iter < num_iters_required) {
+        int round_size = std::min(num_stripes, num_iters_required - iter);
+        body.set_first_iter(iter);
+        body.set_sprt(sprt);
+        if (round_size > 1)
+            parallel_for_(Range(0, round_size), body, round_size);
+        else
+            body(Range(0, 1));
+        iter += round_size;
+
+        // Ties are resolved in favor of lower stripes
+        bool best_changed = false;
+        for (int i = 0; i < round_size; ++i) {
+            if (hyps[i].rejected) {
+                num_rejected++;
+                num_rejected_checked += hyps[i].num_checked;
+                num_rejected_inliers += hyps[i].num_inliers;
+            }
+            else if (hyps[i].total_err < best.total_err) {
+                best = hyps[i];
+                best_changed = true;
+            }
+        }
 
-            z = P2_(2, 0) * xyzw1_mapped(0, 4 * i) + P2_(2, 1) * xyzw1_mapped(0, 4 * i + 1) +
-                P2_(2, 2) * xyzw1_mapped(0, 4 * i + 2) + P2_(2, 3) * xyzw1_mapped(0, 4 * i + 3);
+        double accept_prob = 1;
+        if (opts.sprt()) {
+            // Bad hypotheses consistency is estimated from the rejected ones
+            if (best_changed)
+                sprt.eps = (double)best.num_inliers / num_points;
+            if (num_rejected_checked > 0)
+                sprt.delta = std::max((double)num_rejected_inliers / num_rejected_checked, 1e-4);
+            sprt.UpdateThreshold();
+            accept_prob = sprt.AcceptProb();
+        }
 
-            sq_err = sqr(xy_r2_(0, 2 * i) - x / z) + sqr(xy_r2_(0, 2 * i + 1) - y / z);
+        num_iters_required = CalcRequiredIters((double)best.num_inliers / num_points, subset_size,
+                                               opts.confidence(), num_iters, accept_prob);
 
-            if (sq_err < sqr(err_thresh)) {
-                mask(0, i) = 255;
+        // PROSAC can also stop once the best ranked points are explained
+        if (!prosac_growth.empty() && best.num_inliers > 0) {
+            if (best_changed) {
+                int num_inliers;
+                best_mask.setTo(0);
+                CalcHomographyP3MsacScore(best.H, points, P2_, err_thresh, num_inliers, &best_mask);
             }
+            num_iters_required = std::min(num_iters_required, CalcProsacRequiredIters(
+                    best_mask, ranking, subset_size, opts.confidence(), num_iters, accept_prob));
         }
+    }
+
+    if (opts.stats()) {
+        opts.stats()->num_iters = iter;
+        opts.stats()->num_rejected = num_rejected;
+        opts.stats()->num_inliers = best.num_inliers;
+    }
+
+    Mat_<double> H_best = best.H;
+    int num_inliers_max = best.num_inliers;
+
+    if (num_inliers_max >= 5) {
+        Mat_<uchar> mask(1, num_points);
+        mask.setTo(0);
+
+        int num_inliers;
+        CalcHomographyP3MsacScore(H_best, points, P2_, err_thresh, num_inliers, &mask);
+
+        Mat_<double> xyzw1_subset(1, num_inliers_max * 4);
+        Mat_<double> xyzw2_subset(1, num_inliers_max * 4);
 
-        xyzw1_subset.create(1, num_inliers_max * 4);
-        xyzw2_subset.create(1, num_inliers_max * 4);
         Mat_<double> xy_l2_subset(1, num_inliers_max * 2);
         Mat_<double> xy_r2_subset(1, num_inliers_max * 2);
 
@@ -1708,11 +4300,22 @@ public:
     HomographyP3ReprojError(Mat_<double> xyzw, Mat_<double> P1, Mat_<double> P2,
                             Mat_<double> xy1, Mat_<double> xy2)
         : xyzw_(xyzw), P1_(P1), P2_(P2), xy1_(xy1), xy2_(xy2),
-          num_points_(xyzw.cols / 4), step_(1e-6) {}
+          num_points_(xyzw.cols / 4)
+    {
+        // All residuals depend on all the arguments
+        blocks_.push_back(ResidualBlock(0, dimension()));
+        for (int i = 0; i < 15; ++i)
+            blocks_[0].args.push_back(i);
+    }
 
     void operator()(const Mat &arg, Mat &err);
     void Jacobian(const Mat &arg, Mat &jac);
 
+    const vector<ResidualBlock>& residual_blocks() const { return blocks_; }
+
+    template <typename T>
+    void CalcResidualBlock(const T *arg, int block_idx, T *err);
+
     int dimension() const { return 4 * num_points_; }
 
 private:
@@ -1720,64 +4323,65 @@ private:
     Mat_<double> P1_, P2_;
     Mat_<double> xy1_, xy2_;
     int num_points_;
-    double step_;
-    Mat_<double> err_;
+    vector<ResidualBlock> blocks_;
 };
 
 
 void HomographyP3ReprojError::operator ()(const Mat &arg, Mat &err) {
+    CV_Assert(arg.isContinuous());
     err.create(dimension(), 1, CV_64F);
-    Mat_<double> err_(err);
+    CV_Assert(err.isContinuous());
+    CalcResidualBlock(arg.ptr<double>(), 0, err.ptr<double>());
+}
 
-    Mat arg_ = Mat::ones(1, 16, CV_64F);
-    Mat tmp = arg_.colRange(0, 15);
-    arg.copyTo(tmp);
-    Mat H(arg_.reshape(0, 4));
 
-    Mat P1_H = P1_ * H;
-    Mat P2_H = P2_ * H;
+template <typename T>
+void HomographyP3ReprojError::CalcResidualBlock(const T *arg, int /*block_idx*/, T *err) {
+    // The last homography element is fixed to one
+    T H[16];
+    for (int i = 0; i < 15; ++i)
+        H[i] = arg[i];
+    H[15] = T(1);
 
-    Mat_<double> point(3, 1);
+    T P1_H[12], P2_H[12];
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            P1_H[4 * i + j] = P1_(i, 0) * H[j] + P1_(i, 1) * H[4 + j] +
+                              P1_(i, 2) * H[8 + j] + P1_(i, 3) * H[12 + j];
+            P2_H[4 * i + j] = P2_(i, 0) * H[j] + P2_(i, 1) * H[4 + j] +
+                              P2_(i, 2) * H[8 + j] + P2_(i, 3) * H[12 + j];
+        }
+    }
+
+    T point[3];
 
     for (int i = 0; i < num_points_; ++i) {
-        point = P1_H * xyzw_.colRange(4 * i, 4 * (i + 1)).t();
-        err_(4 * i, 0) = xy1_(0, 2 * i) - point(0, 0) / point(2, 0);
-        err_(4 * i + 1, 0) = xy1_(0, 2 * i + 1) - point(1, 0) / point(2, 0);
-        point = P2_H * xyzw_.colRange(4 * i, 4 * (i + 1)).t();
-        err_(4 * i + 2, 0) = xy2_(0, 2 * i) - point(0, 0) / point(2, 0);
-        err_(4 * i + 3, 0) = xy2_(0, 2 * i + 1) - point(1, 0) / point(2, 0);
+        const double *xyzw = &xyzw_(0, 4 * i);
+
+        for (int j = 0; j < 3; ++j)
+            point[j] = P1_H[4 * j] * xyzw[0] + P1_H[4 * j + 1] * xyzw[1] +
+                       P1_H[4 * j + 2] * xyzw[2] + P1_H[4 * j + 3] * xyzw[3];
+        err[4 * i] = xy1_(0, 2 * i) - point[0] / point[2];
+        err[4 * i + 1] = xy1_(0, 2 * i + 1) - point[1] / point[2];
+
+        for (int j = 0; j < 3; ++j)
+            point[j] = P2_H[4 * j] * xyzw[0] + P2_H[4 * j + 1] * xyzw[1] +
+                       P2_H[4 * j + 2] * xyzw[2] + P2_H[4 * j + 3] * xyzw[3];
+        err[4 * i + 2] = xy2_(0, 2 * i) - point[0] / point[2];
+        err[4 * i + 3] = xy2_(0, 2 * i + 1) - point[1] / point[2];
     }
 }
 
 
 void HomographyP3ReprojError::Jacobian(const Mat &arg, Mat &jac) {
-    Mat_<double> arg_(arg.clone());
-
-    jac.create(dimension(), arg_.cols, CV_64F);
-    Mat_<double> jac_(jac);
-    jac_.setTo(0);
-
-    for (int i = 0; i < arg_.cols; ++i) {
-        double val = arg_(0, i);
-
-        arg_(0, i) += step_;
-        Mat tmp = jac_.col(i);
-        (*this)(arg_, tmp);
-
-        arg_(0, i) = val - step_;
-        (*this)(arg_, err_);
-        arg_(0, i) = val;
-
-        for (int j = 0; j < dimension(); ++j)
-            jac_(j, i) = (jac_(j, i) - err_(j, 0)) / (2 * step_);
-    }
+    CalcJacobianAutoDiff<15>(*this, arg, jac);
 }
 
 } // namespace
 
 
 double RefineHomographyP3(InputOutputArray H, InputArray xyzw, InputArray P1, InputArray P2,
-                          InputArray xy1, InputArray xy2)
+                          InputArray xy1, InputArray xy2, const MinimizeOpts &opts)
 {
     CV_Assert(H.getMat().type() == CV_64F && H.getMat().size() == Size(4, 4));
     CV_Assert(xyzw.getMat().type() == CV_64F && xyzw.getMat().rows == 1 && xyzw.getMat().cols % 4 == 0);
@@ -1800,7 +4404,7 @@ double RefineHomographyP3(InputOutputArray H, InputArray xyzw, InputArray P1, In
     Mat_<double> arg_ = arg.colRange(0, 15);
 
     HomographyP3ReprojError func(xyzw_, P1_, P2_, xy1_, xy2_);
-    double rms_error = MinimizeLevMarq(func, arg_, MinimizeOpts::VERBOSE_SUMMARY);
+    double rms_error = Minimize(func, arg_, opts);
 
     Mat tmp = arg.colRange(0, 15);
     arg_.copyTo(tmp);
@@ -1958,15 +4562,27 @@ int FindFundamentalMatInliers(const detail::ImageFeatures &f1, const detail::Ima
     mask_tmp.setTo(0);
     Mat_<uchar> mask_(mask_tmp);
     int num_inliers = 0;
+    int num_matches = (int)matches.size();
+
+    double x1[kEpipDistBatchSize], y1[kEpipDistBatchSize];
+    double x2[kEpipDistBatchSize], y2[kEpipDistBatchSize];
+    double dist[kEpipDistBatchSize];
+
+    for (int start = 0; start < num_matches; start += kEpipDistBatchSize) {
+        int count = min(kEpipDistBatchSize, num_matches - start);
+        for (int j = 0; j < count; ++j) {
+            const Point2f &p1 = f1.keypoints[matches[start + j].queryIdx].pt;
+            const Point2f &p2 = f2.keypoints[matches[start + j].trainIdx].pt;
+            x1[j] = p2.x; y1[j] = p2.y;
+            x2[j] = p1.x; y2[j] = p1.y;
+        }
 
-    for (size_t i = 0; i < matches.size(); ++i) {
-        const Point2f &p1 = f1.keypoints[matches[i].queryIdx].pt;
-        const Point2f &p2 = f2.keypoints[matches[i].trainIdx].pt;
-
-        double err = SymEpipDist2(p2.x, p2.y, F_, p1.x, p1.y);
-        if (err < err_thresh * err_thresh) {
-            mask_(0, i) = 1;
-            num_inliers++;
+        SymEpipDist2(x1, y1, F_, x2, y2, count, dist);
+        for (int j = 0; j < count; ++j) {
+            if (dist[j] < err_thresh * err_thresh) {
+                mask_(0, start + j) = 1;
+                num_inliers++;
+            }
         }
     }
 
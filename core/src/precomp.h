@@ -15,5 +15,9 @@
 #include <opencv2/stitching/detail/util.hpp>
 #include <Eigen/Core>
 #include <Eigen/Eigenvalues>
+#include <Eigen/Cholesky>
+#include <Eigen/QR>
+#include <Eigen/SVD>
+#include <Eigen/Sparse>
 
 #endif // PRECOMP_H_
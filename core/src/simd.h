@@ -0,0 +1,39 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+// Vectorized kernels. Each one processes the largest prefix of the input which is
+// a multiple of its vector width and returns its length, the caller handles the rest.
+// Kernels for instruction sets above the compiler baseline live in separate translation
+// units built with the respective flags, so they must be selected at runtime.
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define AUTOCALIB_HAVE_SSE2 1
+#endif
+
+namespace autocalib {
+namespace simd {
+
+#ifdef AUTOCALIB_HAVE_SSE2
+int SymEpipDist2_SSE2(const double *x1, const double *y1, const double *F12,
+                      const double *x2, const double *y2, int count, double *dist);
+int SymEpipDist2_SSE2(const float *x1, const float *y1, const float *F12,
+                      const float *x2, const float *y2, int count, float *dist);
+int ReprojSqError_SSE2(const double *x, const double *y, const double *z, const double *w,
+                       const double *P, const double *u, const double *v, int count,
+                       double *sq_err);
+#endif
+
+#ifdef AUTOCALIB_HAVE_AVX
+int SymEpipDist2_AVX(const double *x1, const double *y1, const double *F12,
+                     const double *x2, const double *y2, int count, double *dist);
+int SymEpipDist2_AVX(const float *x1, const float *y1, const float *F12,
+                     const float *x2, const float *y2, int count, float *dist);
+int ReprojSqError_AVX(const double *x, const double *y, const double *z, const double *w,
+                      const double *P, const double *u, const double *v, int count,
+                      double *sq_err);
+#endif
+
+} // namespace simd
+} // namespace autocalib
+
+#endif // SIMD_H_
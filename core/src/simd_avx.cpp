@@ -0,0 +1,119 @@
+// This file is compiled with AVX enabled, so it mustn't include headers with inline
+// functions shared with other translation units (OpenCV, Eigen, STL), otherwise
+// the linker may pick AVX versions of them for the whole library.
+
+#include "simd.h"
+
+#ifdef AUTOCALIB_HAVE_AVX
+#  include <immintrin.h>
+#endif
+
+namespace autocalib {
+namespace simd {
+
+#ifdef AUTOCALIB_HAVE_AVX
+
+int SymEpipDist2_AVX(const double *x1, const double *y1, const double *F12,
+                     const double *x2, const double *y2, int count, double *dist)
+{
+    __m256d f[9];
+    for (int k = 0; k < 9; ++k)
+        f[k] = _mm256_set1_pd(F12[k]);
+    __m256d one = _mm256_set1_pd(1);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d x1_ = _mm256_loadu_pd(x1 + i), y1_ = _mm256_loadu_pd(y1 + i);
+        __m256d x2_ = _mm256_loadu_pd(x2 + i), y2_ = _mm256_loadu_pd(y2 + i);
+
+        // F12 * (x2, y2, 1)
+        __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(f[0], x2_), _mm256_mul_pd(f[1], y2_)), f[2]);
+        __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(f[3], x2_), _mm256_mul_pd(f[4], y2_)), f[5]);
+        __m256d c = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(f[6], x2_), _mm256_mul_pd(f[7], y2_)), f[8]);
+
+        // F12.t() * (x1, y1, 1), first two elements
+        __m256d d = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(f[0], x1_), _mm256_mul_pd(f[3], y1_)), f[6]);
+        __m256d e = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(f[1], x1_), _mm256_mul_pd(f[4], y1_)), f[7]);
+
+        __m256d s = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x1_, a), _mm256_mul_pd(y1_, b)), c);
+        __m256d n1 = _mm256_add_pd(_mm256_mul_pd(d, d), _mm256_mul_pd(e, e));
+        __m256d n2 = _mm256_add_pd(_mm256_mul_pd(a, a), _mm256_mul_pd(b, b));
+
+        _mm256_storeu_pd(dist + i, _mm256_mul_pd(_mm256_mul_pd(s, s),
+                                                 _mm256_add_pd(_mm256_div_pd(one, n1),
+                                                               _mm256_div_pd(one, n2))));
+    }
+
+    return i;
+}
+
+
+int SymEpipDist2_AVX(const float *x1, const float *y1, const float *F12,
+                     const float *x2, const float *y2, int count, float *dist)
+{
+    __m256 f[9];
+    for (int k = 0; k < 9; ++k)
+        f[k] = _mm256_set1_ps(F12[k]);
+    __m256 one = _mm256_set1_ps(1);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 x1_ = _mm256_loadu_ps(x1 + i), y1_ = _mm256_loadu_ps(y1 + i);
+        __m256 x2_ = _mm256_loadu_ps(x2 + i), y2_ = _mm256_loadu_ps(y2 + i);
+
+        // F12 * (x2, y2, 1)
+        __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[0], x2_), _mm256_mul_ps(f[1], y2_)), f[2]);
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[3], x2_), _mm256_mul_ps(f[4], y2_)), f[5]);
+        __m256 c = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[6], x2_), _mm256_mul_ps(f[7], y2_)), f[8]);
+
+        // F12.t() * (x1, y1, 1), first two elements
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[0], x1_), _mm256_mul_ps(f[3], y1_)), f[6]);
+        __m256 e = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(f[1], x1_), _mm256_mul_ps(f[4], y1_)), f[7]);
+
+        __m256 s = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x1_, a), _mm256_mul_ps(y1_, b)), c);
+        __m256 n1 = _mm256_add_ps(_mm256_mul_ps(d, d), _mm256_mul_ps(e, e));
+        __m256 n2 = _mm256_add_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b));
+
+        _mm256_storeu_ps(dist + i, _mm256_mul_ps(_mm256_mul_ps(s, s),
+                                                 _mm256_add_ps(_mm256_div_ps(one, n1),
+                                                               _mm256_div_ps(one, n2))));
+    }
+
+    return i;
+}
+
+
+int ReprojSqError_AVX(const double *x, const double *y, const double *z, const double *w,
+                      const double *P, const double *u, const double *v, int count,
+                      double *sq_err)
+{
+    __m256d p[12];
+    for (int k = 0; k < 12; ++k)
+        p[k] = _mm256_set1_pd(P[k]);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d x_ = _mm256_loadu_pd(x + i), y_ = _mm256_loadu_pd(y + i);
+        __m256d z_ = _mm256_loadu_pd(z + i), w_ = _mm256_loadu_pd(w + i);
+
+        // P * (x, y, z, w)
+        __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(p[0], x_), _mm256_mul_pd(p[1], y_)),
+                                                _mm256_mul_pd(p[2], z_)), _mm256_mul_pd(p[3], w_));
+        __m256d b = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(p[4], x_), _mm256_mul_pd(p[5], y_)),
+                                                _mm256_mul_pd(p[6], z_)), _mm256_mul_pd(p[7], w_));
+        __m256d c = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(p[8], x_), _mm256_mul_pd(p[9], y_)),
+                                                _mm256_mul_pd(p[10], z_)), _mm256_mul_pd(p[11], w_));
+
+        __m256d du = _mm256_sub_pd(_mm256_loadu_pd(u + i), _mm256_div_pd(a, c));
+        __m256d dv = _mm256_sub_pd(_mm256_loadu_pd(v + i), _mm256_div_pd(b, c));
+
+        _mm256_storeu_pd(sq_err + i, _mm256_add_pd(_mm256_mul_pd(du, du), _mm256_mul_pd(dv, dv)));
+    }
+
+    return i;
+}
+
+#endif // AUTOCALIB_HAVE_AVX
+
+} // namespace simd
+} // namespace autocalib
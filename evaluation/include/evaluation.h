@@ -223,6 +223,33 @@ void MatchSyntheticShots(const cv::detail::ImageFeatures &f1, const cv::detail::
   */
 cv::Mat CreateImage(const cv::detail::ImageFeatures &features);
 
+/** Creates shots of a synthetic sphere scene taken by the camera rotating about its center.
+  *
+  * \param num_shots Number of shots
+  * \param rng Pseudo random number generator
+  * \param K Camera intrinsics
+  * \param Rs Camera rotations, indexed by shots
+  * \param features Shots features
+  * \param matches Matches between all pairs of shots
+  */
+void CreateSyntheticRotationalShots(int num_shots, cv::RNG &rng, cv::Mat &K,
+                                    AbsoluteRotationMats &Rs, FeaturesCollection &features,
+                                    MatchesCollection &matches);
+
+/** Creates shots of a synthetic sphere scene taken by the stereo camera moving along a line.
+  *
+  * \param num_shots Number of stereo pairs
+  * \param rng Pseudo random number generator
+  * \param rig Stereo camera, i.e. intrinsics and the right camera motion relative to the
+  *            left one
+  * \param motions Left camera motions, indexed by stereo pairs
+  * \param features Shots features, 2i and 2i+1 are left and right shots of i-th pair
+  * \param matches Matches between shots of each pair and between all pairs of left shots
+  */
+void CreateSyntheticStereoShots(int num_shots, cv::RNG &rng, RigidCamera &rig,
+                                AbsoluteMotions &motions, FeaturesCollection &features,
+                                MatchesCollection &matches);
+
 
 //========================================================================
 // Camera viewers
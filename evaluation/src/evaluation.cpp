@@ -183,6 +183,96 @@ Mat CreateImage(const detail::ImageFeatures &features) {
 }
 
 
+namespace {
+
+Mat_<double> CreateSyntheticIntrinsics(Rect viewport) {
+    Mat_<double> K = Mat::eye(3, 3, CV_64F);
+    K(0, 0) = K(1, 1) = viewport.width + viewport.height;
+    K(0, 2) = viewport.width * 0.5;
+    K(1, 2) = viewport.height * 0.5;
+    return K;
+}
+
+} // namespace
+
+
+void CreateSyntheticRotationalShots(int num_shots, RNG &rng, Mat &K, AbsoluteRotationMats &Rs,
+                                    FeaturesCollection &features, MatchesCollection &matches)
+{
+    Rect viewport = Rect(0, 0, 640, 480);
+    Ptr<PointCloudScene> scene = SphereSceneCreator().Create(1000, rng);
+    K = CreateSyntheticIntrinsics(viewport);
+
+    Mat_<double> center = Mat::zeros(3, 1, CV_64F);
+    center(2, 0) = -10;
+
+    for (int i = 0; i < num_shots; ++i) {
+        Mat_<double> rvec(1, 3);
+        rng.fill(rvec, RNG::UNIFORM, -0.1, 0.1);
+        Mat R; Rodrigues(rvec, R);
+
+        RigidCamera cam = RigidCamera::FromLocalToWorld(K, R, center);
+        Rs[i] = cam.R();
+
+        Ptr<detail::ImageFeatures> features_i = new detail::ImageFeatures();
+        scene->TakeShot(cam, viewport, *features_i);
+        features[i] = features_i;
+    }
+    for (int i = 0; i < num_shots; ++i) {
+        for (int j = i + 1; j < num_shots; ++j) {
+            Ptr<vector<DMatch> > matches_ij = new vector<DMatch>();
+            MatchSyntheticShots(*(features.find(i)->second), *(features.find(j)->second), *matches_ij);
+            matches[make_pair(i, j)] = matches_ij;
+        }
+    }
+}
+
+
+void CreateSyntheticStereoShots(int num_shots, RNG &rng, RigidCamera &rig, AbsoluteMotions &motions,
+                                FeaturesCollection &features, MatchesCollection &matches)
+{
+    Rect viewport = Rect(0, 0, 640, 480);
+    Ptr<PointCloudScene> scene = SphereSceneCreator().Create(1000, rng);
+    Mat_<double> K = CreateSyntheticIntrinsics(viewport);
+
+    Mat_<double> rvec_rel(1, 3);
+    rvec_rel(0, 0) = 0.05; rvec_rel(0, 1) = -0.05; rvec_rel(0, 2) = 0.02;
+    Mat R_rel; Rodrigues(rvec_rel, R_rel);
+    Mat_<double> T_rel = Mat::zeros(3, 1, CV_64F);
+    T_rel(0, 0) = -1;
+    rig = RigidCamera(K, R_rel, T_rel);
+
+    for (int i = 0; i < num_shots; ++i) {
+        Mat_<double> center = Mat::zeros(3, 1, CV_64F);
+        center(0, 0) = i - 0.5 * num_shots; center(1, 0) = 0.3 * i; center(2, 0) = -10;
+        Mat_<double> rvec(1, 3);
+        rng.fill(rvec, RNG::UNIFORM, -0.1, 0.1);
+        Mat R; Rodrigues(rvec, R);
+
+        RigidCamera left = RigidCamera::FromLocalToWorld(K, R, center);
+        RigidCamera right(K, R_rel * left.R(), R_rel * left.T() + T_rel);
+        motions[i] = Motion(left.R(), left.T());
+
+        Ptr<detail::ImageFeatures> features_l = new detail::ImageFeatures();
+        scene->TakeShot(left, viewport, *features_l);
+        features[2 * i] = features_l;
+
+        Ptr<detail::ImageFeatures> features_r = new detail::ImageFeatures();
+        scene->TakeShot(right, viewport, *features_r);
+        features[2 * i + 1] = features_r;
+    }
+
+    for (int i = 0; i < num_shots; ++i) {
+        for (int j = i; j < num_shots; ++j) {
+            int to = i == j ? 2 * i + 1 : 2 * j;
+            Ptr<vector<DMatch> > matches_ij = new vector<DMatch>();
+            MatchSyntheticShots(*(features.find(2 * i)->second), *(features.find(to)->second), *matches_ij);
+            matches[make_pair(2 * i, to)] = matches_ij;
+        }
+    }
+}
+
+
 namespace {
 
     void InitGlut() {
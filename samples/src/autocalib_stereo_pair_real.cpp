@@ -668,34 +668,17 @@ int main(int argc, char **argv) {
         RigidCamera P_r_m(K_norm * K_init, avg_R.clone(), avg_T.clone());
         double final_rms_error = 0;       
 
-        RNG rng(0);
-        int num_iters = 3;
-        for (int i = 0; i < num_iters; ++i) {
-            if (weighted_ba) {
-                final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, REFINE_FLAG_K_ALL, rel_confs);
-                final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, REFINE_FLAG_K_ALL, rel_confs);
-                final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, REFINE_FLAG_K_ALL, rel_confs);
-            }
-            else {
-                final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, ~REFINE_FLAG_K_SKEW);
-                final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, ~REFINE_FLAG_K_SKEW);
-                final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, ~REFINE_FLAG_K_SKEW);
-            }
-            P_r_m = RigidCamera(K_norm.inv() * P_r_m.K(), P_r_m.R(), P_r_m.T());
+        int params_to_refine = weighted_ba ? REFINE_FLAG_K_ALL : ~REFINE_FLAG_K_SKEW;
+        RelativeConfidences ba_rel_confs = weighted_ba ? rel_confs : RelativeConfidences();
 
-            if (abs(P_r_m.K().at<double>(0, 1)) < 20) {
-                break;
-            }
-            else if (i < num_iters - 1) {
-                Mat_<double> K_init_new = K_init.clone();
-                K_init_new(0, 0) *= rng.uniform(0.8, 1.2);
-                K_init_new(0, 2) *= rng.uniform(0.8, 1.2);
-                K_init_new(1, 1) *= rng.uniform(0.8, 1.2);
-                K_init_new(1, 2) *= rng.uniform(0.8, 1.2);
-                cout << "K_init_new = \n" << K_init_new << endl;
-                P_r_m = RigidCamera(K_norm * K_init_new, P_r_m.R(), P_r_m.T());
-            }
-        }
+        RNG rng(0);
+        int num_starts = 3;
+        final_rms_error = RefineStereoCameraMultiStart(P_r_m, abs_motions, features_collection, matches_collection,
+                                                       params_to_refine, ba_rel_confs, num_starts, 20,
+                                                       numeric_limits<double>::max(), rng, K_norm);
+        final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, params_to_refine, ba_rel_confs);
+        final_rms_error = RefineStereoCamera(P_r_m, abs_motions, features_collection, matches_collection, params_to_refine, ba_rel_confs);
+        P_r_m = RigidCamera(K_norm.inv() * P_r_m.K(), P_r_m.R(), P_r_m.T());
 
         cout << "\nK_refined = \n" << P_r_m.K() << endl;
         cout << "\nSUMMARY\n";
@@ -383,6 +383,189 @@ TEST(FindHomographyP3Linear, CanFindEuclideanMap) {
 }
 
 
+/** Creates clouds related by a homography and their images in the second stereo pair.
+  * Every outlier_step-th correspondence is an outlier.
+  */
+void CreateSyntheticHomographyP3Data(int num_points, int outlier_step, RNG &rng,
+                                     Mat_<double> &P1, Mat_<double> &P2, Mat_<double> &H,
+                                     Mat_<double> &xyzw1, Mat_<double> &xyzw2,
+                                     Mat_<double> &xy_l2, Mat_<double> &xy_r2)
+{
+    P1 = Mat::eye(3, 4, CV_64F);
+    P1(0, 0) = P1(1, 1) = 500;
+    P1(0, 2) = 320; P1(1, 2) = 240;
+    P2 = P1.clone();
+    P2(0, 3) = -500;
+
+    H = Mat::eye(4, 4, CV_64F);
+    H(0, 3) = 0.1; H(2, 3) = 0.2;
+
+    xyzw1.create(1, num_points * 4);
+    xyzw2.create(1, num_points * 4);
+    xy_l2.create(1, num_points * 2);
+    xy_r2.create(1, num_points * 2);
+
+    for (int i = 0; i < num_points; ++i) {
+        Mat_<double> p1(4, 1);
+        p1(0, 0) = rng.uniform(-1., 1.);
+        p1(1, 0) = rng.uniform(-1., 1.);
+        p1(2, 0) = rng.uniform(4., 6.);
+        p1(3, 0) = 1;
+        Mat_<double> p2 = H * p1;
+
+        if (outlier_step > 0 && i % outlier_step == 0)
+            p2(0, 0) += rng.uniform(0.5, 1.);
+
+        Mat_<double> xy1 = P1 * p2, xy2 = P2 * p2;
+        for (int k = 0; k < 4; ++k) {
+            xyzw1(0, 4 * i + k) = p1(k, 0);
+            xyzw2(0, 4 * i + k) = p2(k, 0);
+        }
+        xy_l2(0, 2 * i) = xy1(0, 0) / xy1(2, 0);
+        xy_l2(0, 2 * i + 1) = xy1(1, 0) / xy1(2, 0);
+        xy_r2(0, 2 * i) = xy2(0, 0) / xy2(2, 0);
+        xy_r2(0, 2 * i + 1) = xy2(1, 0) / xy2(2, 0);
+    }
+}
+
+
+TEST(FindHomographyP3Linear, FixedSizeSolverMatchesSvd) {
+    RNG rng(0);
+    int max_num_points = 10;
+
+    Mat_<double> H = Mat::zeros(4, 4, CV_64F);
+    while (abs(determinant(H)) < 1e-3)
+        rng.fill(H, RNG::UNIFORM, -1, 1);
+
+    // Noisy points, so overdetermined systems haven't exact null vectors
+    Mat_<double> xyzw1(1, max_num_points * 4);
+    Mat_<double> xyzw2(1, max_num_points * 4);
+    rng.fill(xyzw1, RNG::UNIFORM, -1, 1);
+    for (int i = 0; i < max_num_points; ++i) {
+        Mat_<double> p = H * xyzw1.colRange(4 * i, 4 * i + 4).t();
+        for (int k = 0; k < 4; ++k)
+            xyzw2(0, 4 * i + k) = p(k, 0) + rng.gaussian(1e-2);
+    }
+
+    for (int num_points = 5; num_points <= max_num_points; ++num_points) {
+        Mat_<double> xyzw1_subset = xyzw1.colRange(0, 4 * num_points);
+        Mat_<double> xyzw2_subset = xyzw2.colRange(0, 4 * num_points);
+
+        Mat_<double> H_fixed = FindHomographyP3Linear(xyzw1_subset, xyzw2_subset, true);
+        Mat_<double> H_svd = FindHomographyP3Linear(xyzw1_subset, xyzw2_subset, false);
+
+        H_fixed /= H_fixed(3, 3);
+        H_svd /= H_svd(3, 3);
+        ASSERT_LT(norm(H_fixed, H_svd, NORM_INF), 1e-8) << "num points = " << num_points;
+    }
+}
+
+
+TEST(FindHomographyP3Robust, ParallelResultIsReproducible) {
+    RNG rng(0);
+    Mat_<double> P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2;
+    CreateSyntheticHomographyP3Data(200, 5, rng, P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2);
+
+    SampleConsensusOpts opts;
+    opts.set_num_threads(4);
+
+    RNG rng1(1);
+    opts.set_rng(&rng1);
+    Mat_<double> H1 = FindHomographyP3Robust(xyzw1, xyzw2, P1, P2, xy_l2, xy_r2, 40, 5, 3.0, noArray(), opts);
+
+    RNG rng2(1);
+    opts.set_rng(&rng2);
+    Mat_<double> H2 = FindHomographyP3Robust(xyzw1, xyzw2, P1, P2, xy_l2, xy_r2, 40, 5, 3.0, noArray(), opts);
+
+    ASSERT_EQ(0, norm(H1, H2, NORM_INF));
+
+    H1 /= H1(3, 3);
+    ASSERT_LT(norm(H, H1, NORM_INF), 1e-3);
+}
+
+
+TEST(FindHomographyP3Robust, AdaptiveTerminationStopsEarly) {
+    RNG rng(0);
+    Mat_<double> P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2;
+    CreateSyntheticHomographyP3Data(200, 0, rng, P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2);
+
+    SampleConsensusStats stats;
+    SampleConsensusOpts opts;
+    opts.set_stats(&stats);
+
+    Mat_<double> H_found = FindHomographyP3Robust(xyzw1, xyzw2, P1, P2, xy_l2, xy_r2, 100, 5, 3.0,
+                                                  noArray(), opts);
+
+    // The first hypothesis explains all the points
+    ASSERT_EQ(1, stats.num_iters);
+    ASSERT_EQ(200, stats.num_inliers);
+
+    H_found /= H_found(3, 3);
+    ASSERT_LT(norm(H, H_found, NORM_INF), 1e-3);
+}
+
+
+TEST(FindHomographyP3Robust, ProsacStartsFromBestMatches) {
+    RNG rng(0);
+    Mat_<double> P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2;
+    CreateSyntheticHomographyP3Data(200, 2, rng, P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2);
+
+    // Every second correspondence is an outlier and has the worst descriptor distance
+    Mat_<float> dists(1, 200);
+    for (int i = 0; i < 200; ++i)
+        dists(0, i) = i % 2 == 0 ? rng.uniform(50.f, 100.f) : rng.uniform(0.f, 10.f);
+
+    SampleConsensusStats stats_uniform;
+    SampleConsensusOpts opts;
+    RNG rng_uniform(1);
+    opts.set_rng(&rng_uniform);
+    opts.set_stats(&stats_uniform);
+    FindHomographyP3Robust(xyzw1, xyzw2, P1, P2, xy_l2, xy_r2, 500, 5, 3.0, dists, opts);
+
+    SampleConsensusStats stats_prosac;
+    RNG rng_prosac(1);
+    opts.set_rng(&rng_prosac);
+    opts.set_stats(&stats_prosac);
+    opts.set_sampling(SampleConsensusOpts::SAMPLING_PROSAC);
+    Mat_<double> H_found = FindHomographyP3Robust(xyzw1, xyzw2, P1, P2, xy_l2, xy_r2, 500, 5, 3.0,
+                                                  dists, opts);
+
+    ASSERT_EQ(100, stats_uniform.num_inliers);
+    ASSERT_EQ(100, stats_prosac.num_inliers);
+
+    // Uniform sampling needs about 150 iterations at the inliers ratio of 0.5, while PROSAC
+    // draws outliers free samples from the start and stops once the best matches are explained
+    ASSERT_LT(stats_prosac.num_iters, stats_uniform.num_iters);
+    ASSERT_LE(stats_prosac.num_iters, 10);
+
+    H_found /= H_found(3, 3);
+    ASSERT_LT(norm(H, H_found, NORM_INF), 1e-3);
+}
+
+
+TEST(FindHomographyP3Robust, SprtRejectsBadHypotheses) {
+    RNG rng(0);
+    Mat_<double> P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2;
+    CreateSyntheticHomographyP3Data(200, 3, rng, P1, P2, H, xyzw1, xyzw2, xy_l2, xy_r2);
+
+    SampleConsensusStats stats;
+    SampleConsensusOpts opts;
+    opts.set_sprt(true);
+    opts.set_stats(&stats);
+
+    RNG rng_sprt(1);
+    opts.set_rng(&rng_sprt);
+    Mat_<double> H_found = FindHomographyP3Robust(xyzw1, xyzw2, P1, P2, xy_l2, xy_r2, 100, 5, 3.0,
+                                                  noArray(), opts);
+
+    ASSERT_GT(stats.num_rejected, 0);
+    ASSERT_EQ(133, stats.num_inliers);
+
+    H_found /= H_found(3, 3);
+    ASSERT_LT(norm(H, H_found, NORM_INF), 1e-3);
+}
+
+
 TEST(EigenDecompose, CanDecomposeRotationMat) {
     Mat_<double> mat(2, 2);
     mat(0, 0) = 0; mat(0, 1) = -1;
@@ -434,3 +617,838 @@ TEST(PseudoInverse, CanFindForRandomMat3x4) {
     ASSERT_NEAR(0, norm(P * P_inv * P, P), 1e-6);
     ASSERT_NEAR(0, norm(P_inv * P * P_inv, P_inv), 1e-6);
 }
+
+
+TEST(SymEpipDist2, BatchMatchesScalar) {
+    RNG rng(0);
+    Mat_<double> F(3, 3);
+    rng.fill(F, RNG::UNIFORM, -1, 1);
+
+    // Odd size to exercise the scalar tail of the vectorized kernels
+    const int count = 37;
+    Mat_<double> xy(4, count);
+    rng.fill(xy, RNG::UNIFORM, 0, 640);
+
+    vector<double> dist(count);
+    SymEpipDist2(xy[0], xy[1], F, xy[2], xy[3], count, &dist[0]);
+
+    for (int i = 0; i < count; ++i) {
+        double expected = SymEpipDist2(xy(0, i), xy(1, i), F, xy(2, i), xy(3, i));
+        ASSERT_NEAR(expected, dist[i], 1e-12 * max(1., expected));
+    }
+}
+
+
+TEST(CalcRmsReprojectionError, BatchMatchesScalar) {
+    RNG rng(0);
+    Mat_<double> P(3, 4);
+    rng.fill(P, RNG::UNIFORM, -1, 1);
+
+    // Odd size to exercise the scalar tail of the vectorized kernels
+    const int num_points = 37;
+    Mat_<double> xyzw(1, num_points * 4), xy(1, num_points * 2);
+    rng.fill(xyzw, RNG::UNIFORM, -1, 1);
+    rng.fill(xy, RNG::UNIFORM, -10, 10);
+
+    double total_sq_error = 0;
+    for (int i = 0; i < num_points; ++i) {
+        Mat_<double> p = P * xyzw.colRange(4 * i, 4 * i + 4).t();
+        total_sq_error += (xy(0, 2 * i) - p(0, 0) / p(2, 0)) * (xy(0, 2 * i) - p(0, 0) / p(2, 0)) +
+                          (xy(0, 2 * i + 1) - p(1, 0) / p(2, 0)) * (xy(0, 2 * i + 1) - p(1, 0) / p(2, 0));
+    }
+    double expected = sqrt(total_sq_error / num_points);
+
+    ASSERT_NEAR(expected, CalcRmsReprojectionError(xy, P, xyzw), 1e-9 * expected);
+}
+
+
+TEST(SymEpipDist2, FloatBatchMatchesDouble) {
+    RNG rng(0);
+    Mat_<double> F(3, 3);
+    rng.fill(F, RNG::UNIFORM, -1, 1);
+
+    const int count = 37;
+    Mat_<float> xy(4, count);
+    rng.fill(xy, RNG::UNIFORM, 0, 640);
+
+    vector<float> dist(count);
+    SymEpipDist2(xy[0], xy[1], F, xy[2], xy[3], count, &dist[0]);
+
+    for (int i = 0; i < count; ++i) {
+        double expected = SymEpipDist2(xy(0, i), xy(1, i), F, xy(2, i), xy(3, i));
+        ASSERT_NEAR(expected, dist[i], 1e-4 * max(1., expected));
+    }
+}
+
+
+TEST(SymEpipDist2, FloatErrorWithinDocumentedBounds) {
+    RNG rng(0);
+
+    // Bounds documented for float SymEpipDist2() and MinimizeOpts::precision()
+    const Size sizes[] = {Size(640, 480), Size(4000, 3000)};
+    const double max_errors[] = {2e-4, 1e-3};
+
+    for (int k = 0; k < 2; ++k) {
+        Mat_<double> K = Mat::eye(3, 3, CV_64F);
+        K(0, 0) = K(1, 1) = sizes[k].width + sizes[k].height;
+        K(0, 2) = sizes[k].width * 0.5;
+        K(1, 2) = sizes[k].height * 0.5;
+
+        Mat_<double> rvec(1, 3);
+        rvec(0, 0) = 0.03; rvec(0, 1) = -0.02; rvec(0, 2) = 0.01;
+        Mat R; Rodrigues(rvec, R);
+        Mat_<double> T(3, 1);
+        T(0, 0) = -1; T(1, 0) = 0.05; T(2, 0) = 0.02;
+
+        Mat_<double> F = K.inv().t() * CrossProductMat(T) * R * K.inv();
+        F /= norm(F);
+
+        // Matches a few pixels away from their epipolar lines
+        const int count = 1000;
+        Mat_<float> xy(4, count);
+        for (int i = 0; i < count; ++i) {
+            double x2 = rng.uniform(0., (double)sizes[k].width);
+            double y2 = rng.uniform(0., (double)sizes[k].height);
+            Mat_<double> p2(3, 1);
+            p2(0, 0) = x2; p2(1, 0) = y2; p2(2, 0) = 1;
+            Mat_<double> line = F * p2;
+            double line_norm = sqrt(sqr(line(0, 0)) + sqr(line(1, 0)));
+
+            double x1 = rng.uniform(0., (double)sizes[k].width);
+            double y1 = -(line(0, 0) * x1 + line(2, 0)) / line(1, 0);
+            double offset = rng.uniform(-3., 3.);
+
+            xy(0, i) = (float)(x1 + offset * line(0, 0) / line_norm);
+            xy(1, i) = (float)(y1 + offset * line(1, 0) / line_norm);
+            xy(2, i) = (float)x2;
+            xy(3, i) = (float)y2;
+        }
+
+        vector<float> dist(count);
+        SymEpipDist2(xy[0], xy[1], F, xy[2], xy[3], count, &dist[0]);
+
+        for (int i = 0; i < count; ++i) {
+            double expected = SymEpipDist2(xy(0, i), xy(1, i), F, xy(2, i), xy(3, i));
+            ASSERT_NEAR(sqrt(expected), sqrt(dist[i]), max_errors[k])
+                    << "image size = " << sizes[k].width << "x" << sizes[k].height;
+        }
+    }
+}
+
+
+TEST(RodriguesToMatrix33, DerivativesMatchOpenCV) {
+    Mat_<double> rvec(1, 3);
+    rvec(0, 0) = 0.3; rvec(0, 1) = -0.2; rvec(0, 2) = 0.5;
+
+    Mat_<double> R, dR;
+    Rodrigues(rvec, R, dR);
+
+    autodiff::Jet<3> rvec_jet[3];
+    for (int i = 0; i < 3; ++i)
+        rvec_jet[i] = autodiff::Jet<3>(rvec(0, i), i);
+    autodiff::Matrix33<autodiff::Jet<3> > R_jet = autodiff::RodriguesToMatrix33(rvec_jet);
+
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            ASSERT_NEAR(R(i, j), R_jet(i, j).val, 1e-12);
+            for (int k = 0; k < 3; ++k)
+                ASSERT_NEAR(dR(k, 3 * i + j), R_jet(i, j).grad[k], 1e-9);
+        }
+    }
+}
+
+
+// Residuals (a * b, a^2) and (c^3) of arguments (a, b, c, d)
+class TwoBlocksFunc {
+public:
+    TwoBlocksFunc() : blocks_(2) {
+        blocks_[0] = ResidualBlock(0, 2);
+        blocks_[0].args.push_back(0);
+        blocks_[0].args.push_back(1);
+        blocks_[1] = ResidualBlock(2, 1);
+        blocks_[1].args.push_back(2);
+    }
+
+    const vector<ResidualBlock>& residual_blocks() const { return blocks_; }
+
+    void CalcResidualBlock(const Mat &arg, int block_idx, double *err) {
+        const double *a = arg.ptr<double>();
+        if (block_idx == 0) {
+            err[0] = a[0] * a[1];
+            err[1] = a[0] * a[0];
+        }
+        else
+            err[0] = a[2] * a[2] * a[2];
+    }
+
+    int dimension() const { return 3; }
+
+private:
+    vector<ResidualBlock> blocks_;
+};
+
+
+TEST(CalcJacobianBlockwise, CanDifferentiateBlocks) {
+    Mat_<double> arg(1, 4);
+    arg(0, 0) = 1; arg(0, 1) = 2; arg(0, 2) = 3; arg(0, 3) = 4;
+
+    TwoBlocksFunc func;
+    Mat jac;
+    CalcJacobianBlockwise(func, arg, jac, 1e-6);
+
+    Mat_<double> jac_gold = Mat::zeros(3, 4, CV_64F);
+    jac_gold(0, 0) = 2; jac_gold(0, 1) = 1;
+    jac_gold(1, 0) = 2;
+    jac_gold(2, 2) = 27;
+
+    ASSERT_EQ(jac.size(), jac_gold.size());
+    ASSERT_LT(norm(jac, jac_gold, NORM_INF), 1e-6);
+}
+
+
+TEST(ParamBlockLayout, FixedBlocksTakeNoArguments) {
+    ParamBlockLayout<5, 3> layout;
+    layout.AddBlock(4, true);
+    layout.AddBlock(2);
+    layout.AddBlock(7);
+
+    ASSERT_EQ(2, layout.num_free_blocks());
+    ASSERT_EQ(5 + 3 * 2, layout.num_args());
+    ASSERT_EQ(-1, layout.Offset(4));
+    ASSERT_EQ(5, layout.Offset(2));
+    ASSERT_EQ(8, layout.Offset(7));
+    ASSERT_TRUE(layout.Contains(4));
+    ASSERT_FALSE(layout.Contains(3));
+    ASSERT_EQ(-1, layout.Offset(3));
+}
+
+
+// Fits y = a * exp(b * x) + c
+class ExpFitFunc {
+public:
+    ExpFitFunc() {
+        for (int i = 0; i < 20; ++i) {
+            double x = 0.1 * i;
+            x_.push_back(x);
+            y_.push_back(2 * exp(-0.5 * x) + 0.3 + 0.01 * sin(7. * i));
+        }
+    }
+
+    void operator()(const Mat &arg, Mat &err) {
+        const double *a = arg.ptr<double>();
+        err.create(dimension(), 1, CV_64F);
+        for (int i = 0; i < dimension(); ++i)
+            err.at<double>(i, 0) = a[0] * exp(a[1] * x_[i]) + a[2] - y_[i];
+    }
+
+    void Jacobian(const Mat &arg, Mat &jac) {
+        const double *a = arg.ptr<double>();
+        jac.create(dimension(), 3, CV_64F);
+        for (int i = 0; i < dimension(); ++i) {
+            jac.at<double>(i, 0) = exp(a[1] * x_[i]);
+            jac.at<double>(i, 1) = a[0] * x_[i] * exp(a[1] * x_[i]);
+            jac.at<double>(i, 2) = 1;
+        }
+    }
+
+    int dimension() const { return (int)x_.size(); }
+
+private:
+    vector<double> x_, y_;
+};
+
+
+class StopAfterIters : public MinimizeCallback {
+public:
+    StopAfterIters(int max_iters) : max_iters(max_iters), num_calls(0) {}
+
+    bool operator()(int iter, const Mat&, double, int) {
+        num_calls++;
+        return iter < max_iters;
+    }
+
+    int max_iters;
+    int num_calls;
+};
+
+
+TEST(MinimizeLevMarq, MatchesCvLevMarq) {
+    ExpFitFunc func;
+    Mat_<double> arg(1, 3);
+    arg(0, 0) = 1; arg(0, 1) = 0; arg(0, 2) = 0;
+    Mat_<double> arg_gold = arg.clone();
+
+    double rms_err = MinimizeLevMarq(func, arg);
+
+    CvLevMarq solver(3, func.dimension(), MinimizeOpts::crit_default());
+    Mat param_dst(solver.param);
+    arg_gold.reshape(0, 3).copyTo(param_dst);
+
+    Mat err, jac;
+    while (true) {
+        const CvMat *param = 0;
+        CvMat *solver_jac = 0, *solver_err = 0;
+        bool proceed = solver.update(param, solver_jac, solver_err);
+        Mat(param).reshape(0, 1).copyTo(arg_gold);
+        if (!proceed || !solver_err)
+            break;
+
+        func(arg_gold, err);
+        Mat err_dst(solver_err);
+        err.copyTo(err_dst);
+        if (solver_jac) {
+            func.Jacobian(arg_gold, jac);
+            Mat jac_dst(solver_jac);
+            jac.copyTo(jac_dst);
+        }
+    }
+
+    func(arg_gold, err);
+    ASSERT_NEAR(sqrt(err.dot(err) / func.dimension()), rms_err, 1e-9);
+    ASSERT_LT(norm(arg, arg_gold, NORM_INF), 1e-6);
+}
+
+
+TEST(MinimizeLevMarq, CallbackCanStop) {
+    ExpFitFunc func;
+    Mat_<double> arg(1, 3);
+    arg(0, 0) = 1; arg(0, 1) = 0; arg(0, 2) = 0;
+
+    StopAfterIters *callback = new StopAfterIters(2);
+    MinimizeOpts opts;
+    opts.set_callback(Ptr<MinimizeCallback>(callback));
+    MinimizeLevMarq(func, arg, opts);
+
+    ASSERT_EQ(2, callback->num_calls);
+}
+
+
+TEST(MinimizeLevMarq, RecordsStats) {
+    ExpFitFunc func;
+    Mat_<double> arg_init(1, 3);
+    arg_init(0, 0) = 1; arg_init(0, 1) = 0; arg_init(0, 2) = 0;
+
+    MinimizeStats stats;
+    MinimizeOpts opts;
+    opts.set_stats(&stats);
+    Mat_<double> arg = arg_init.clone();
+    double rms_err = MinimizeLevMarq(func, arg, opts);
+
+    ASSERT_GT(stats.num_iters, 0);
+    ASSERT_EQ(stats.num_iters, (int)stats.iter_rms_errors.size());
+    ASSERT_EQ(stats.num_iters, (int)stats.iter_damping_lg10.size());
+    ASSERT_EQ(stats.num_iters, stats.num_jacobian_evals);
+    ASSERT_GE(stats.num_residual_evals, stats.num_iters + 1);
+    ASSERT_DOUBLE_EQ(rms_err, stats.iter_rms_errors.back());
+    for (size_t i = 1; i < stats.iter_rms_errors.size(); ++i)
+        ASSERT_LE(stats.iter_rms_errors[i], stats.iter_rms_errors[i - 1]);
+    ASSERT_NE(MinimizeStats::TERMINATION_NONE, stats.termination);
+    ASSERT_NE(MinimizeStats::TERMINATION_CALLBACK, stats.termination);
+    ASSERT_GE(stats.residual_time, 0);
+    ASSERT_GE(stats.jacobian_time, 0);
+    ASSERT_GE(stats.solve_time, 0);
+
+    // Statistics of subsequent minimizations are accumulated
+    opts.set_callback(new StopAfterIters(1));
+    arg = arg_init.clone();
+    MinimizeLevMarq(func, arg, opts);
+
+    ASSERT_EQ(MinimizeStats::TERMINATION_CALLBACK, stats.termination);
+    ASSERT_EQ(stats.num_iters, (int)stats.iter_rms_errors.size());
+}
+
+
+TEST(MinimizeLevMarq, BroydenUpdatesMatchFullJacobian) {
+    ExpFitFunc func;
+    Mat_<double> arg_init(1, 3);
+    arg_init(0, 0) = 1; arg_init(0, 1) = 0; arg_init(0, 2) = 0;
+
+    Mat_<double> arg_full = arg_init.clone();
+    double rms_err_full = MinimizeLevMarq(func, arg_full);
+
+    MinimizeStats stats;
+    MinimizeOpts opts;
+    opts.set_jacobian_recompute_period(5);
+    opts.set_stats(&stats);
+    Mat_<double> arg_broyden = arg_init.clone();
+    double rms_err_broyden = MinimizeLevMarq(func, arg_broyden, opts);
+
+    ASSERT_NEAR(rms_err_full, rms_err_broyden, 1e-9);
+    ASSERT_LT(norm(arg_full, arg_broyden, NORM_INF), 1e-6);
+    ASSERT_GT(stats.num_jacobian_updates, 0);
+    ASSERT_EQ(stats.num_iters, stats.num_jacobian_evals + stats.num_jacobian_updates);
+}
+
+
+TEST(MinimizeDogleg, MatchesLevMarq) {
+    ExpFitFunc func;
+    Mat_<double> arg_init(1, 3);
+    arg_init(0, 0) = 1; arg_init(0, 1) = 0; arg_init(0, 2) = 0;
+
+    Mat_<double> arg_lm = arg_init.clone();
+    double rms_err_lm = MinimizeLevMarq(func, arg_lm);
+
+    MinimizeStats stats;
+    MinimizeOpts opts;
+    opts.set_method(MinimizeOpts::METHOD_DOGLEG);
+    opts.set_stats(&stats);
+    Mat_<double> arg_dogleg = arg_init.clone();
+    double rms_err_dogleg = Minimize(func, arg_dogleg, opts);
+
+    ASSERT_NEAR(rms_err_lm, rms_err_dogleg, 1e-9);
+    ASSERT_LT(norm(arg_lm, arg_dogleg, NORM_INF), 1e-6);
+
+    // One factorization per Jacobian
+    ASSERT_GT(stats.num_iters, 0);
+    ASSERT_EQ(stats.num_iters, stats.num_jacobian_evals);
+    ASSERT_EQ(stats.num_jacobian_evals, stats.num_factorizations);
+    ASSERT_GT(stats.num_residual_evals, stats.num_jacobian_evals);
+}
+
+
+// Function with constant residuals, so its gradient is zero everywhere
+class ConstFunc {
+public:
+    void operator()(const Mat&, Mat &err) { err = Mat::ones(dimension(), 1, CV_64F); }
+    void Jacobian(const Mat&, Mat &jac) { jac = Mat::zeros(dimension(), 2, CV_64F); }
+    int dimension() const { return 3; }
+};
+
+
+TEST(MinimizeDogleg, StopsAtZeroGradient) {
+    MinimizeStats stats;
+    MinimizeOpts opts;
+    opts.set_method(MinimizeOpts::METHOD_DOGLEG);
+    opts.set_stats(&stats);
+    Mat_<double> arg = Mat::zeros(1, 2, CV_64F);
+    Minimize(ConstFunc(), arg, opts);
+
+    ASSERT_EQ(MinimizeStats::TERMINATION_NO_PROGRESS, stats.termination);
+    ASSERT_EQ(stats.num_iters, (int)stats.iter_rms_errors.size());
+    ASSERT_EQ(stats.num_iters, (int)stats.iter_damping_lg10.size());
+}
+
+
+// Checks that minimizations from the same start make the same first steps, what
+// holds only if the Jacobians they use agree
+void AssertSameFirstIterations(const MinimizeStats &stats1, const MinimizeStats &stats2,
+                               int num_iters)
+{
+    ASSERT_GE((int)stats1.iter_rms_errors.size(), num_iters);
+    ASSERT_GE((int)stats2.iter_rms_errors.size(), num_iters);
+    for (int i = 0; i < num_iters; ++i) {
+        ASSERT_EQ(stats1.iter_damping_lg10[i], stats2.iter_damping_lg10[i]) << "iter = " << i;
+        ASSERT_NEAR(stats1.iter_rms_errors[i], stats2.iter_rms_errors[i],
+                    1e-4 * stats1.iter_rms_errors[i]) << "iter = " << i;
+    }
+}
+
+
+// Synthetic stereo scene along with intrinsics perturbed from the true ones
+struct SyntheticStereoProblem {
+    SyntheticStereoProblem(int num_shots, RNG &rng, double focal_error = 0.02) {
+        CreateSyntheticStereoShots(num_shots, rng, rig_gold, motions_gold, features, matches);
+        K_init = rig_gold.K().clone();
+        K_init(0, 0) *= 1 + focal_error; K_init(1, 1) *= 1 - focal_error;
+        K_init(0, 2) += 5; K_init(1, 2) -= 5;
+    }
+
+    // Refines all but skew starting from the perturbed intrinsics and the true motions
+    double Refine(const MinimizeOpts &opts, RigidCamera &rig) const {
+        rig = RigidCamera(K_init, rig_gold.R(), rig_gold.T());
+        AbsoluteMotions motions = motions_gold;
+        return RefineStereoCamera(rig, motions, features, matches, ~REFINE_FLAG_K_SKEW,
+                                  RelativeConfidences(), opts);
+    }
+
+    RigidCamera rig_gold;
+    AbsoluteMotions motions_gold;
+    FeaturesCollection features;
+    MatchesCollection matches;
+    Mat_<double> K_init;
+};
+
+
+TEST(RefineStereoCamera, AnalyticJacobianMatchesNumeric) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(3, rng);
+
+    MinimizeStats stats_analytic;
+    MinimizeOpts opts;
+    opts.set_stats(&stats_analytic);
+    RigidCamera rig_analytic;
+    double err_analytic = problem.Refine(opts, rig_analytic);
+
+    MinimizeStats stats_numeric;
+    opts.set_stats(&stats_numeric);
+    opts.set_jacobian_method(MinimizeOpts::JACOBIAN_NUMERIC);
+    RigidCamera rig_numeric;
+    double err_numeric = problem.Refine(opts, rig_numeric);
+
+    ASSERT_NO_FATAL_FAILURE(AssertSameFirstIterations(stats_analytic, stats_numeric, 2));
+    ASSERT_LT(err_analytic, 1e-2);
+    ASSERT_NEAR(err_numeric, err_analytic, 1e-3);
+    ASSERT_LT(norm(rig_analytic.K(), rig_numeric.K(), NORM_INF), 1.);
+}
+
+
+TEST(RefineStereoCamera, SchurSolverMatchesDense) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(4, rng);
+
+    MinimizeOpts opts;
+    RigidCamera rig_dense;
+    double err_dense = problem.Refine(opts, rig_dense);
+
+    // Both solvers solve the same normal equations
+    opts.set_linear_solver(MinimizeOpts::LINEAR_SOLVER_SCHUR);
+    RigidCamera rig_schur;
+    double err_schur = problem.Refine(opts, rig_schur);
+
+    ASSERT_LT(err_schur, 1e-2);
+    ASSERT_NEAR(err_dense, err_schur, 1e-6);
+    ASSERT_LT(norm(rig_dense.K(), rig_schur.K(), NORM_INF), 1e-3);
+}
+
+
+TEST(RefineStereoCamera, StreamedSolverMatchesDense) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(4, rng);
+
+    MinimizeOpts opts;
+    RigidCamera rig_dense;
+    double err_dense = problem.Refine(opts, rig_dense);
+
+    opts.set_linear_solver(MinimizeOpts::LINEAR_SOLVER_DENSE_STREAMED);
+    RigidCamera rig_streamed;
+    double err_streamed = problem.Refine(opts, rig_streamed);
+
+    ASSERT_NEAR(err_dense, err_streamed, 1e-6);
+    ASSERT_LT(norm(rig_dense.K(), rig_streamed.K(), NORM_INF), 1e-3);
+}
+
+
+TEST(RefineStereoCamera, MixedPrecisionMatchesDouble) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(4, rng);
+
+    MinimizeOpts opts;
+    RigidCamera rig_double;
+    double err_double = problem.Refine(opts, rig_double);
+
+    // Accuracy envelope documented in MinimizeOpts::precision()
+    opts.set_precision(MinimizeOpts::PRECISION_MIXED);
+    RigidCamera rig_mixed;
+    double err_mixed = problem.Refine(opts, rig_mixed);
+
+    ASSERT_NEAR(err_double, err_mixed, 1e-3);
+    ASSERT_LT(norm(rig_double.K(), rig_mixed.K(), NORM_INF), 0.1);
+}
+
+
+TEST(RefineStereoCamera, ParallelNumericJacobianMatchesSerial) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(3, rng);
+
+    MinimizeOpts opts;
+    opts.set_jacobian_method(MinimizeOpts::JACOBIAN_NUMERIC);
+    RigidCamera rig_serial;
+    double err_serial = problem.Refine(opts, rig_serial);
+
+    opts.set_num_threads(4);
+    RigidCamera rig_parallel;
+    double err_parallel = problem.Refine(opts, rig_parallel);
+
+    ASSERT_NEAR(err_serial, err_parallel, 1e-12);
+    ASSERT_LT(norm(rig_serial.K(), rig_parallel.K(), NORM_INF), 1e-9);
+}
+
+
+TEST(RefineStereoCamera, CachedResidualBlocksMatchUncached) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(3, rng);
+
+    MinimizeOpts opts;
+    opts.set_jacobian_method(MinimizeOpts::JACOBIAN_NUMERIC);
+    RigidCamera rig(problem.K_init, problem.rig_gold.R(), problem.rig_gold.T());
+    Mat arg;
+    Ptr<autocalib::internal::BlockwiseFunc> func = autocalib::internal::CreateStereoCameraFunc(
+            rig, problem.motions_gold, problem.features, problem.matches, REFINE_FLAG_K_ALL,
+            RelativeConfidences(), opts, arg);
+
+    // Fills the cache
+    Mat jac;
+    func->Jacobian(arg, jac);
+
+    // Nothing, fx, the rig rotation and the last stereo pair translation are perturbed, so
+    // views reuse both the cached fundamental and essential matrices, the essential ones
+    // only, or recompute them
+    const int perturbed_args[] = {-1, 0, 5, arg.cols - 1};
+    const vector<ResidualBlock> &blocks = func->residual_blocks();
+
+    for (int i = 0; i < 4; ++i) {
+        Mat arg_perturbed = arg.clone();
+        if (perturbed_args[i] != -1)
+            arg_perturbed.at<double>(0, perturbed_args[i]) *= 1.001;
+
+        int num_changed = 0;
+        for (size_t j = 0; j < blocks.size(); ++j) {
+            if (blocks[j].num_rows == 0)
+                continue;
+            vector<double> err_cached(blocks[j].num_rows);
+            vector<double> err_uncached(blocks[j].num_rows);
+            vector<double> err_orig(blocks[j].num_rows);
+            func->CalcResidualBlock(arg_perturbed, (int)j, &err_cached[0]);
+            func->CalcResidualBlockUncached(arg_perturbed, (int)j, &err_uncached[0]);
+            func->CalcResidualBlockUncached(arg, (int)j, &err_orig[0]);
+
+            for (int k = 0; k < blocks[j].num_rows; ++k) {
+                ASSERT_NEAR(err_uncached[k], err_cached[k], 1e-9)
+                        << "perturbed arg = " << perturbed_args[i] << ", block = " << j;
+                if (abs(err_uncached[k] - err_orig[k]) > 1e-6)
+                    num_changed++;
+            }
+        }
+
+        if (perturbed_args[i] != -1) {
+            ASSERT_GT(num_changed, 0) << "perturbed arg = " << perturbed_args[i];
+        }
+    }
+}
+
+
+TEST(RefineStereoCamera, ResidualsMatchPerViewDistances) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(3, rng);
+
+    // Right-right views aren't used, so they must not shift rows of the following ones
+    MatchesCollection matches = problem.matches;
+    Ptr<vector<DMatch> > matches_rr = new vector<DMatch>();
+    MatchSyntheticShots(*(problem.features.find(1)->second),
+                        *(problem.features.find(3)->second), *matches_rr);
+    matches[make_pair(1, 3)] = matches_rr;
+
+    // Negative confidences are clamped to zero
+    RelativeConfidences rel_confs;
+    int view_idx = 0;
+    for (MatchesCollection::const_iterator iter = matches.begin(); iter != matches.end();
+         ++iter, ++view_idx)
+    {
+        rel_confs[iter->first] = view_idx == 1 ? -1. : 0.5 + 0.25 * view_idx;
+    }
+
+    RigidCamera rig(problem.K_init, problem.rig_gold.R(), problem.rig_gold.T());
+    Mat arg;
+    Ptr<autocalib::internal::BlockwiseFunc> func = autocalib::internal::CreateStereoCameraFunc(
+            rig, problem.motions_gold, problem.features, matches, REFINE_FLAG_K_ALL, rel_confs,
+            MinimizeOpts(), arg);
+
+    Mat_<double> err;
+    (*func)(arg, err);
+
+    Mat K_inv = rig.K().inv();
+    int pos = 0;
+    int num_nonzero = 0;
+    for (MatchesCollection::const_iterator iter = matches.begin(); iter != matches.end(); ++iter) {
+        int from = iter->first.first;
+        int to = iter->first.second;
+
+        // Distances are scale invariant, so neither the motions normalization nor the
+        // translations scale matter
+        Mat R, T;
+        if (IsLeftRightPair(from, to)) {
+            R = rig.R();
+            T = rig.T();
+        }
+        else if (BothAreLeft(from, to) && problem.motions_gold.count(from / 2) &&
+                 problem.motions_gold.count(to / 2))
+        {
+            const Motion &motion_from = problem.motions_gold.find(from / 2)->second;
+            const Motion &motion_to = problem.motions_gold.find(to / 2)->second;
+            R = motion_to.R() * motion_from.R().t();
+            T = motion_to.T() - R * motion_from.T();
+        }
+        else
+            continue;
+        Mat F = K_inv.t() * CrossProductMat(T) * R * K_inv;
+
+        double conf = max(0., rel_confs.find(iter->first)->second);
+        const vector<KeyPoint> &kps_from = problem.features.find(from)->second->keypoints;
+        const vector<KeyPoint> &kps_to = problem.features.find(to)->second->keypoints;
+        const vector<DMatch> &view_matches = *(iter->second);
+
+        for (size_t i = 0; i < view_matches.size(); ++i, ++pos) {
+            const Point2f &p_from = kps_from[view_matches[i].queryIdx].pt;
+            const Point2f &p_to = kps_to[view_matches[i].trainIdx].pt;
+            double dist = sqrt(SymEpipDist2(p_to.x, p_to.y, F, p_from.x, p_from.y)) * conf;
+            ASSERT_LT(pos, err.rows);
+            ASSERT_NEAR(dist, err(pos, 0), 1e-6 * max(1., dist))
+                    << "view = (" << from << ", " << to << "), match = " << i;
+            if (dist > 1e-3)
+                num_nonzero++;
+        }
+    }
+
+    ASSERT_EQ(pos, err.rows);
+    ASSERT_GT(num_nonzero, 0);
+}
+
+
+TEST(RefineStereoCamera, MultiStartFindsAcceptableResult) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(4, rng, 0.05);
+
+    RigidCamera rig(problem.K_init, problem.rig_gold.R(), problem.rig_gold.T());
+    AbsoluteMotions motions = problem.motions_gold;
+    double err = RefineStereoCameraMultiStart(rig, motions, problem.features, problem.matches,
+                                              ~REFINE_FLAG_K_SKEW, RelativeConfidences(), 4, 1., 1e-2,
+                                              rng, Mat(), 0.2, MinimizeOpts());
+
+    ASSERT_LT(err, 1e-2);
+    ASSERT_LT(abs(rig.K().at<double>(0, 1)), 1.);
+    ASSERT_EQ(problem.motions_gold.size(), motions.size());
+}
+
+
+// Counts calls and records whether any of them overlapped
+class CountConcurrentCalls : public MinimizeCallback {
+public:
+    CountConcurrentCalls() : num_calls(0), num_active(0), overlapped(false) {}
+
+    bool operator()(int, const Mat&, double, int) {
+        if (CV_XADD(&num_active, 1) != 0)
+            overlapped = true;
+        num_calls++;
+
+        // Widens the window other starts could call in
+        volatile double sum = 0;
+        for (int i = 0; i < 100000; ++i)
+            sum += i;
+
+        CV_XADD(&num_active, -1);
+        return true;
+    }
+
+    int num_calls;
+    int num_active;
+    bool overlapped;
+};
+
+
+TEST(RefineStereoCamera, MultiStartSerializesCallback) {
+    RNG rng(0);
+    SyntheticStereoProblem problem(3, rng, 0.05);
+
+    CountConcurrentCalls *callback = new CountConcurrentCalls();
+    MinimizeStats stats;
+    MinimizeOpts opts;
+    opts.set_callback(Ptr<MinimizeCallback>(callback));
+    opts.set_stats(&stats);
+
+    RigidCamera rig(problem.K_init, problem.rig_gold.R(), problem.rig_gold.T());
+    AbsoluteMotions motions = problem.motions_gold;
+    RefineStereoCameraMultiStart(rig, motions, problem.features, problem.matches,
+                                 ~REFINE_FLAG_K_SKEW, RelativeConfidences(), 4, 1., 1e-2,
+                                 rng, Mat(), 0.2, opts);
+
+    // Interrupted starts stop without calling the user callback
+    ASSERT_FALSE(callback->overlapped);
+    ASSERT_GT(callback->num_calls, 0);
+    ASSERT_LE(callback->num_calls, stats.num_iters);
+}
+
+
+// Synthetic rotational scene along with intrinsics perturbed from the true ones
+struct SyntheticRotationalProblem {
+    SyntheticRotationalProblem(int num_shots, RNG &rng, double focal_error = 0.02) {
+        CreateSyntheticRotationalShots(num_shots, rng, K_gold, Rs_gold, features, matches);
+        K_init = K_gold.clone();
+        K_init(0, 0) *= 1 + focal_error; K_init(1, 1) *= 1 - focal_error;
+        K_init(0, 2) += 5; K_init(1, 2) -= 5;
+    }
+
+    // Refines all but skew by default starting from the perturbed intrinsics and the
+    // true rotations
+    double Refine(const MinimizeOpts &opts, Mat &K,
+                  int params_to_refine = ~REFINE_FLAG_K_SKEW) const
+    {
+        K = K_init.clone();
+        return RefineRigidCamera(K, Rs_gold, features, matches, params_to_refine, opts);
+    }
+
+    Mat_<double> K_gold;
+    AbsoluteRotationMats Rs_gold;
+    FeaturesCollection features;
+    MatchesCollection matches;
+    Mat_<double> K_init;
+};
+
+
+TEST(RefineRigidCamera, AnalyticJacobianMatchesNumeric) {
+    RNG rng(0);
+    SyntheticRotationalProblem problem(3, rng);
+
+    MinimizeStats stats_analytic;
+    MinimizeOpts opts;
+    opts.set_stats(&stats_analytic);
+    Mat K_analytic;
+    double err_analytic = problem.Refine(opts, K_analytic);
+
+    MinimizeStats stats_numeric;
+    opts.set_stats(&stats_numeric);
+    opts.set_jacobian_method(MinimizeOpts::JACOBIAN_NUMERIC);
+    Mat K_numeric;
+    double err_numeric = problem.Refine(opts, K_numeric);
+
+    ASSERT_NO_FATAL_FAILURE(AssertSameFirstIterations(stats_analytic, stats_numeric, 2));
+    ASSERT_LT(err_analytic, 1e-2);
+    ASSERT_NEAR(err_numeric, err_analytic, 1e-3);
+    ASSERT_LT(norm(K_analytic, K_numeric, NORM_INF), 1.);
+}
+
+
+TEST(RefineRigidCamera, AnalyticJacobianMatchesNumericForAllMasks) {
+    RNG rng(0);
+    SyntheticRotationalProblem problem(3, rng);
+
+    // Masks with specialized kernels and a mask checked at runtime
+    const int masks[] = {REFINE_FLAG_K_ALL, REFINE_FLAG_K_FX | REFINE_FLAG_K_FY,
+                         REFINE_FLAG_K_FX | REFINE_FLAG_K_FY | REFINE_FLAG_K_PPX};
+
+    for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); ++i) {
+        MinimizeStats stats_analytic;
+        MinimizeOpts opts(TermCriteria(TermCriteria::MAX_ITER, 3, 0));
+        opts.set_stats(&stats_analytic);
+        Mat K_analytic;
+        double err_analytic = problem.Refine(opts, K_analytic, masks[i]);
+
+        MinimizeStats stats_numeric;
+        opts.set_stats(&stats_numeric);
+        opts.set_jacobian_method(MinimizeOpts::JACOBIAN_NUMERIC);
+        Mat K_numeric;
+        double err_numeric = problem.Refine(opts, K_numeric, masks[i]);
+
+        ASSERT_NO_FATAL_FAILURE(AssertSameFirstIterations(stats_analytic, stats_numeric, 2))
+                << "mask = " << masks[i];
+        ASSERT_NEAR(err_numeric, err_analytic, 1e-3) << "mask = " << masks[i];
+        ASSERT_LT(norm(K_analytic, K_numeric, NORM_INF), 1.) << "mask = " << masks[i];
+    }
+}
+
+
+TEST(RefineRigidCamera, PcgSolverMatchesDense) {
+    RNG rng(0);
+    SyntheticRotationalProblem problem(5, rng);
+
+    MinimizeOpts opts;
+    Mat K_dense;
+    double err_dense = problem.Refine(opts, K_dense);
+
+    opts.set_linear_solver(MinimizeOpts::LINEAR_SOLVER_PCG);
+    Mat K_pcg;
+    double err_pcg = problem.Refine(opts, K_pcg);
+
+    ASSERT_LT(err_pcg, 1e-2);
+    ASSERT_NEAR(err_dense, err_pcg, 1e-3);
+    ASSERT_LT(norm(K_dense, K_pcg, NORM_INF), 1.);
+}